@@ -0,0 +1,182 @@
+// StepperHubClient loopback test: the client talks to the host build of the hub (see HostHub.h) through an in-memory link,
+// requests are checked against the responses decoded, then the pipelined commands throughput of the pair is measured.
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 -O2 $FW -c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c Host/HostHub.c
+//   g++ -std=c++11 -O2 -IHost Host/ClientLoopbackTest.cpp Host/StepperHubClient.cpp stepperController.o telemetry.o stepperCommands.o HostHub.o -lpthread -o clientloopback
+//   clientloopback [commands]
+//
+// Exit code is the number of the failed tests.
+// The throughput is the one of the client and the decoder together (the link is not limited), the serial link is what limits it
+// on the real hub: at 115200 baud "#<id>setX:<position>" requests (~20 bytes) go at ~550 commands/s.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include "StepperHubClient.h"
+#include "HostHub.h"
+#include "HostTest.h"
+
+using namespace StepperHub;
+
+// host to hub and hub to host bytes, the link is pumped by the test (so the client is never called back from its own write)
+static std::string toHub;
+static std::string toHost;
+static uint32_t telemetryFrames;
+
+static Client client([](const uint8_t * data, size_t length) { toHub.append((const char *)data, length); });
+
+static void HubOutput(const uint8_t * data, uint32_t length, void * context) {
+  toHost.append((const char *)data, length);
+}
+
+// moves the bytes both ways until the link is idle
+static void Pump() {
+  std::string data;
+  client.Flush();
+  while (!toHub.empty() || !toHost.empty()) {
+    data.swap(toHub);
+    toHub.clear();
+    HostHub_Receive((const uint8_t *)data.data(), (uint32_t)data.size());
+    data.swap(toHost);
+    toHost.clear();
+    client.Receive((const uint8_t *)data.data(), data.size());
+  }
+}
+
+static void Ticks(uint32_t count) {
+  while (count--) {
+    HostHub_Tick();
+    Pump();
+  }
+}
+
+static bool IsReady(std::future<Response> & future) {
+  return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+// ========================================== //
+//    REQUESTS                                //
+// ========================================== //
+
+static void TestSetGet() {
+  std::future<Response> set = client.Set('X', 12345);
+  std::future<Response> add = client.Add('X', -345);
+  std::future<Response> get = client.Get('X', PARAM_TARGETPOSITION);
+  Pump();
+  CHECK(IsReady(set) && IsReady(add) && IsReady(get));
+  CHECK(set.get().status == STATUS_OK);
+  CHECK(add.get().status == STATUS_OK);
+  Response response = get.get();
+  CHECK(response.status == STATUS_OK);
+  CHECK(response.value == 12000);
+}
+
+static void TestGetAll() {
+  std::future<Response> get = client.Get('Y', PARAM_ALL);
+  Pump();
+  CHECK(IsReady(get));
+  Response response = get.get();
+  CHECK(response.status == STATUS_OK);
+  CHECK(strstr(response.text.data(), ".STATUS = ") != NULL);
+}
+
+static void TestLimitAndError() {
+  std::future<Response> limit = client.Set('Z', PARAM_MAXSPS, 100000000);
+  std::future<Response> error = client.Get('Q');
+  std::future<Response> sync = client.Sync();
+  Pump();
+  CHECK(IsReady(limit) && IsReady(error) && IsReady(sync));
+  CHECK(limit.get().status == STATUS_LIMIT);
+  CHECK(error.get().status == STATUS_ERROR);
+  CHECK(sync.get().status == STATUS_OK);
+}
+
+static void TestMove() {
+  std::future<Response> move = client.Move({ { 'X', 500, false }, { 'Y', -700, false }, { 'X', 20, true } });
+  Pump();
+  CHECK(IsReady(move));
+  CHECK(move.get().status == STATUS_OK);
+  Ticks(1);
+  std::future<Response> x = client.Get('X', PARAM_TARGETPOSITION);
+  std::future<Response> y = client.Get('Y', PARAM_TARGETPOSITION);
+  Pump();
+  CHECK(x.get().value == 520);
+  CHECK(y.get().value == -700);
+}
+
+// responses dropped by the hub (TX buffer full) complete as lost once a later response arrives
+static void TestLostResponse() {
+  HostHub_SetTxFree(0);
+  std::future<Response> lost = client.Get('X');
+  Pump();
+  CHECK(!IsReady(lost));
+  HostHub_SetTxFree(UINT32_MAX);
+  std::future<Response> sync = client.Sync();
+  Pump();
+  CHECK(IsReady(lost) && IsReady(sync));
+  CHECK(lost.get().status == STATUS_LOST);
+  CHECK(sync.get().status == STATUS_OK);
+  CHECK(client.InFlight() == 0);
+}
+
+static void TestTelemetry() {
+  std::future<Response> subscribe = client.Subscribe('X', PARAM_CURRENTPOSITION, 10);
+  Pump();
+  CHECK(subscribe.get().status == STATUS_OK);
+  telemetryFrames = 0;
+  Ticks(10 * 1000 / 50 * 5);
+  CHECK(telemetryFrames == 5);
+  std::future<Response> unsubscribe = client.Subscribe('X', PARAM_DEFAULT, 0);
+  Pump();
+  CHECK(unsubscribe.get().status == STATUS_OK);
+}
+
+// ========================================== //
+//    THROUGHPUT                              //
+// ========================================== //
+
+static void Throughput(uint32_t commands) {
+  std::vector<std::future<Response>> futures;
+  uint32_t lost = 0;
+
+  futures.reserve(commands);
+  auto start = std::chrono::steady_clock::now();
+  for (uint32_t i = 0; i < commands; i++)
+    futures.push_back(client.Set("XYZ"[i % 3], (int32_t)i - (int32_t)commands / 2));
+  Pump();
+  std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+
+  for (uint32_t i = 0; i < commands; i++) {
+    if (futures[i].get().status != STATUS_OK)
+      lost++;
+  }
+  printf("throughput: %.0f commands/s, %.2f us per command (%u commands, %u not OK)\n",
+    commands / time.count(), time.count() / commands * 1e6, commands, lost);
+  if (lost != 0)
+    failures++;
+}
+
+int main(int argc, char * argv[]) {
+  uint32_t commands = (argc > 1) ? atoi(argv[1]) : 1000000;
+
+  if (!HostHub_Init("XYZ")) {
+    printf("FLASH registers can't be mapped\n");
+    return 1;
+  }
+  HostHub_SetOutput(HubOutput, NULL);
+  client.OnTelemetry([](const TelemetryFrame & frame) { telemetryFrames++; });
+
+  RUN(TestSetGet);
+  RUN(TestGetAll);
+  RUN(TestLimitAndError);
+  RUN(TestMove);
+  RUN(TestLostResponse);
+  RUN(TestTelemetry);
+  Throughput(commands);
+
+  printf("%s\n", (failures == 0) ? "ALL OK" : "FAILED");
+  return failures;
+}
@@ -0,0 +1,249 @@
+// Request decoder benchmark, per byte cost:
+//  - keyword matching: the keyword tries of the decoder (Inc/stepperKeywordTries.h) against the linear scan it has used before them
+//    (every byte compared with every keyword still matching), both must find the same keywords;
+//  - the whole decoder (MDK-ARM/stepperCommands.c through the host build of the hub) on a few realistic requests mixes,
+//    bytes/s and requests/s, requests are executed, responses are dropped.
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 -O2 $FW Host/DecoderBenchmark.c Host/HostHub.c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c -o decoderbench
+//   decoderbench [megabytes]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stepperCommands.h"
+#include "HostHub.h"
+
+// the same as in stepperCommands.c
+#define TRIE_ROOT           1
+#define TRIE_SYMBOLS_COUNT  28
+
+#include "stepperKeywordTries.h"
+
+extern char * request_commands_arry[__CMD_COUNT];
+extern char * request_params_arry[__PARAM_COUNT];
+
+typedef struct {
+  const char *  text;         // "%d" is the value
+  uint32_t      weight;
+  bool          tagged;       // goes with "#<id>" prefix
+} mix_entry;
+
+typedef struct {
+  const char *      name;
+  const mix_entry * entries;
+  uint32_t          count;
+} requests_mix;
+
+#define MIX(name, entries) { name, entries, sizeof(entries) / sizeof(entries[0]) }
+
+// motion streaming mostly, with some polling
+static const mix_entry streamingMix[] = {
+  { "setX:%d\r", 30 }, { "addY:%d\r", 20 }, { "setZ.maxSPS:%d\r", 5 }, { "getX\r", 10 }, { "getY.currentPosition\r", 10 },
+  { "getZ.all\r", 2 }, { "sync\r", 5, true }, { "begin\r", 3 }, { "commit\r", 3 }, { "resetX:%d\r", 2 }, { "getX.status\r", 10 }
+};
+
+// a host which tags every request (StepperHubClient), position and status polling
+static const mix_entry pollingMix[] = {
+  { "getX.currentPosition\n", 30, true }, { "getY.status\n", 20, true }, { "getZ.all\n", 5, true }, { "setX:%d\n", 20, true },
+  { "sync\n", 10, true }, { "getY\n", 15, true }
+};
+
+// coordinated moves: staged targets of every stepper, committed at once
+static const mix_entry transactionsMix[] = {
+  { "begin\n", 10, true }, { "setX:%d\n", 10 }, { "setY:%d\n", 10 }, { "addZ:%d\n", 10 }, { "commit\n", 10, true }
+};
+
+// RS-485 bus traffic, every request is addressed (all of them are executed at address 0)
+static const mix_entry busMix[] = {
+  { "@3 setX:%d\n", 30, true }, { "@12 getY.currentPosition\n", 30, true }, { "@*begin\n", 5 }, { "@*setZ:%d\n", 10 },
+  { "@*commit\n", 5 }, { "@255 sync\n", 10, true }
+};
+
+static const requests_mix requestsMixes[] = {
+  MIX("streaming", streamingMix), MIX("polling", pollingMix), MIX("transactions", transactionsMix), MIX("bus", busMix)
+};
+
+static uint32_t rng = 1;
+
+static uint32_t Random(uint32_t range) {
+  rng = rng * 1103515245 + 12345;
+  return ((rng >> 8) & 0xFFFFFF) % range;
+}
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int32_t TrieSymbol(uint8_t data) {
+  if (data >= 'A' && data <= 'Z') return data - 'A' + 1;
+  if (data == '_') return TRIE_SYMBOLS_COUNT - 1;
+  return 0;
+}
+
+// walks the word a byte per step, as DecodeCmd/DecodeParam do, returns the keyword accepted (0 - none)
+static uint8_t TrieMatch(const uint8_t (* next)[TRIE_SYMBOLS_COUNT], const uint8_t * keyword, const bool * hasNext, const char * word) {
+  uint8_t node = TRIE_ROOT;
+  uint8_t n;
+
+  for (; ; word++) {
+    n = next[node][TrieSymbol(*word)];
+    if (n == 0)
+      return keyword[node];
+    if (!hasNext[n])
+      return keyword[n];
+    node = n;
+  }
+}
+
+// the decoder before the tries: the keywords still matching are filtered by every byte
+static uint8_t ScanMatch(char ** keywords, int32_t keywordsCount, const char * word) {
+  uint32_t filteredItems = UINT32_MAX;
+  int32_t index = 0;
+  int32_t filteredItemsCount;
+  int32_t validLength = 0;
+  int32_t valid = 0;
+  int32_t length;
+  int32_t i;
+
+  for (; ; word++, index++) {
+    filteredItemsCount = keywordsCount - 1;
+    for (i = 1; i < keywordsCount; i++) {
+      if (filteredItems & (1u << i)) {
+        length = strlen(keywords[i]);
+        if (length > index && keywords[i][index] == *word) {
+          valid = i;
+          validLength = length;
+        } else {
+          filteredItems &= ~(1u << i);
+          filteredItemsCount--;
+        }
+      } else {
+        filteredItemsCount--;
+      }
+    }
+    if (filteredItemsCount == 0)
+      return 0;
+    if (filteredItemsCount == 1 && validLength - 1 == index)
+      return valid;
+  }
+}
+
+// the linear scan can't accept a keyword which is a prefix of a longer one (the tries can)
+static bool IsPrefixKeyword(char ** keywords, int32_t keywordsCount, int32_t index) {
+  int32_t i;
+  for (i = 1; i < keywordsCount; i++) {
+    if (i != index && strncmp(keywords[i], keywords[index], strlen(keywords[index])) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void KeywordBenchmark(char ** keywords, int32_t keywordsCount, const uint8_t (* next)[TRIE_SYMBOLS_COUNT],
+                             const uint8_t * keyword, const bool * hasNext, const char * name) {
+  char words[64][24];
+  uint32_t rounds = 200000;
+  uint32_t bytes = 0;
+  volatile uint32_t sum = 0;
+  uint32_t round;
+  int32_t i;
+  double start;
+  double scanTime;
+  double trieTime;
+
+  // every keyword, terminated the way the decoder sees it (the next field goes right after)
+  for (i = 1; i < keywordsCount; i++) {
+    sprintf(words[i], "%sX", keywords[i]);
+    bytes += strlen(keywords[i]);
+    if (TrieMatch(next, keyword, hasNext, words[i]) != i ||
+        (ScanMatch(keywords, keywordsCount, words[i]) != i && !IsPrefixKeyword(keywords, keywordsCount, i))) {
+      printf("FAILED - \"%s\" is matched differently\n", keywords[i]);
+      exit(1);
+    }
+  }
+
+  start = Now();
+  for (round = 0; round < rounds; round++) {
+    for (i = 1; i < keywordsCount; i++)
+      sum += ScanMatch(keywords, keywordsCount, words[i]);
+  }
+  scanTime = Now() - start;
+
+  start = Now();
+  for (round = 0; round < rounds; round++) {
+    for (i = 1; i < keywordsCount; i++)
+      sum += TrieMatch(next, keyword, hasNext, words[i]);
+  }
+  trieTime = Now() - start;
+
+  printf("%-10s  scan %6.2f ns/byte  trie %6.2f ns/byte  (x%.1f)\n", name,
+    scanTime / rounds / bytes * 1e9, trieTime / rounds / bytes * 1e9, scanTime / trieTime);
+}
+
+static char * GenerateRequests(const requests_mix * mix, uint32_t length, uint32_t * requests) {
+  char * stream = malloc(length + 64);
+  const mix_entry * entry;
+  uint32_t totalWeight = 0;
+  uint32_t pick;
+  uint32_t i = 0;
+  uint32_t m;
+
+  for (m = 0; m < mix->count; m++)
+    totalWeight += mix->entries[m].weight;
+
+  *requests = 0;
+  while (i < length) {
+    pick = Random(totalWeight);
+    for (m = 0; pick >= mix->entries[m].weight; m++)
+      pick -= mix->entries[m].weight;
+    entry = &mix->entries[m];
+    // "#<id>" goes after "@<address>"
+    if (entry->tagged && entry->text[0] == '@') {
+      m = strcspn(entry->text, " ") + 1;
+      i += sprintf(stream + i, "%.*s#%u ", (int)(m - 1), entry->text, *requests + 1);
+      i += sprintf(stream + i, entry->text + m, (int32_t)Random(200000) - 100000);
+    } else {
+      if (entry->tagged)
+        i += sprintf(stream + i, "#%u ", *requests + 1);
+      i += sprintf(stream + i, entry->text, (int32_t)Random(200000) - 100000);
+    }
+    (*requests)++;
+  }
+  stream[i] = '\0';
+  return stream;
+}
+
+int main(int argc, char * argv[]) {
+  uint32_t megabytes = (argc > 1) ? atoi(argv[1]) : 16;
+  uint32_t requests;
+  uint32_t length;
+  char * stream;
+  double start;
+  double time;
+  size_t m;
+
+  if (!HostHub_Init("XYZ")) {
+    printf("FLASH registers can't be mapped\n");
+    return 1;
+  }
+
+  KeywordBenchmark(request_commands_arry, __CMD_COUNT, commandsTrieNext, commandsTrieKeyword, commandsTrieHasNext, "commands");
+  KeywordBenchmark(request_params_arry, __PARAM_COUNT, paramsTrieNext, paramsTrieKeyword, paramsTrieHasNext, "parameters");
+
+  for (m = 0; m < sizeof(requestsMixes) / sizeof(requestsMixes[0]); m++) {
+    stream = GenerateRequests(&requestsMixes[m], megabytes * 1024 * 1024, &requests);
+    length = strlen(stream);
+    start = Now();
+    HostHub_Receive((const uint8_t *)stream, length);
+    time = Now() - start;
+    printf("%-12s %6.2f ns/byte, %6.1f MB/s, %9.0f requests/s (%u requests, %u bytes)\n", requestsMixes[m].name,
+      time / length * 1e9, length / time / 1e6, requests / time, requests, length);
+    // staged targets are not left for the next mix
+    HostHub_ReceiveStr("\ncommit\n");
+    free(stream);
+  }
+  return 0;
+}
@@ -0,0 +1,182 @@
+// HAL and serial link of the hub for the host build of its command layer (see HostHub.h)
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "stm32f4xx_hal.h"
+#include "stepperController.h"
+#include "stepperCommands.h"
+#include "telemetry.h"
+#include "serial.h"
+#include "HostHub.h"
+
+#define HOST_TX_BUFFER_SIZE       (8*1024)
+#define HOST_TX_BULK_BUFFER_SIZE  (2*1024)
+#define HOST_RX_BUFFER_SIZE       (8*1024)
+
+// set by main.c on the hub
+uint32_t STEP_TIMER_CLOCK = 200000000;
+uint32_t STEP_CONTROLLER_PERIOD_US = 50;
+
+typedef struct {
+  TIM_HandleTypeDef handle;
+  TIM_TypeDef       regs;
+  GPIO_TypeDef      dirGPIO;
+  char              stepper;
+} host_timer;
+
+static host_timer timers[MAX_STEPPERS_COUNT];
+static uint32_t ticks;
+
+static host_hub_output output;
+static void * outputContext;
+static host_hub_output bulkOutput;
+static void * bulkOutputContext;
+static host_hub_step_timer stepTimerHook;
+static void * stepTimerContext;
+static uint32_t txFree = HOST_TX_BUFFER_SIZE;
+static uint8_t txBuffer[HOST_TX_BUFFER_SIZE];
+static uint8_t txBulkBuffer[HOST_TX_BULK_BUFFER_SIZE];
+static uint32_t baudRate = SERIAL_DEFAULT_BAUDRATE;
+
+// ========================================== //
+//    HAL                                     //
+// ========================================== //
+
+// the handle is the first member of host_timer
+HAL_StatusTypeDef HAL_TIM_PWM_Start(TIM_HandleTypeDef * htim, uint32_t channel) {
+  if (stepTimerHook != NULL)
+    stepTimerHook(((host_timer *)htim)->stepper, true, stepTimerContext);
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_TIM_PWM_Stop(TIM_HandleTypeDef * htim, uint32_t channel) {
+  if (stepTimerHook != NULL)
+    stepTimerHook(((host_timer *)htim)->stepper, false, stepTimerContext);
+  return HAL_OK;
+}
+
+uint32_t HAL_GetTick(void) {
+  return (uint32_t)((uint64_t)ticks * STEP_CONTROLLER_PERIOD_US / 1000);
+}
+
+// the config is not stored (but FLASH interface registers get written, see MapFlashRegisters)
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) { return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASH_Lock(void) { return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t typeProgram, uint32_t address, uint64_t data) { return HAL_OK; }
+void FLASH_Erase_Sector(uint32_t sector, uint8_t voltageRange) {}
+
+// Config saving writes FLASH interface registers directly (FLASH->SR), so they get RAM at the very same address.
+// Needs the low addresses to be available, as they are on Linux.
+static bool MapFlashRegisters(void) {
+  uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+  void * page = (void *)(FLASH_R_BASE & ~(pageSize - 1));
+  return mmap(page, pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) == page;
+}
+
+// ========================================== //
+//    SERIAL                                  //
+// ========================================== //
+
+uint8_t * Serial_TxReserve(uint32_t length) {
+  return (length <= txFree) ? txBuffer : NULL;
+}
+
+void Serial_TxCommit(uint32_t length) {
+  if (output != NULL)
+    output(txBuffer, length, outputContext);
+}
+
+uint8_t * Serial_TxBulkReserve(uint32_t length) {
+  return (length <= HOST_TX_BULK_BUFFER_SIZE) ? txBulkBuffer : NULL;
+}
+
+void Serial_TxBulkCommit(uint32_t length) {
+  if (bulkOutput != NULL)
+    bulkOutput(txBulkBuffer, length, bulkOutputContext);
+  else if (output != NULL)
+    output(txBulkBuffer, length, outputContext);
+}
+
+uint32_t Serial_LimitBaudRate(uint32_t rate) {
+  // PCLK1/8 at 50 MHz APB1
+  return (rate < SERIAL_MIN_BAUDRATE) ? SERIAL_MIN_BAUDRATE : (rate > 6250000) ? 6250000 : rate;
+}
+
+uint32_t Serial_SetBaudRate(uint32_t rate) {
+  return baudRate = Serial_LimitBaudRate(rate);
+}
+
+uint32_t Serial_GetBaudRate(void) {
+  return baudRate;
+}
+
+void Serial_ConfirmBaudRate(void) {}
+
+uint32_t Serial_GetRxFree(void) {
+  return HOST_RX_BUFFER_SIZE - 1;
+}
+
+uint32_t Serial_GetTxFree(void) {
+  return txFree;
+}
+
+// ========================================== //
+//    HOST HUB                                //
+// ========================================== //
+
+bool HostHub_Init(const char * steppers) {
+  static bool mapped;
+  host_timer * timer;
+  int32_t i;
+
+  if (!mapped && !MapFlashRegisters())
+    return false;
+  mapped = true;
+
+  for (i = 0; steppers[i] != '\0' && i < MAX_STEPPERS_COUNT; i++) {
+    timer = &timers[i];
+    timer->handle.Instance = &timer->regs;
+    timer->stepper = steppers[i];
+    Stepper_SetupPeripherals(steppers[i], &timer->handle, TIM_CHANNEL_1, &timer->dirGPIO, GPIO_PIN_0);
+    Stepper_InitDefaultState(steppers[i]);
+  }
+  InitDecoder();
+  return true;
+}
+
+void HostHub_SetOutput(host_hub_output fn, void * context) {
+  output = fn;
+  outputContext = context;
+}
+
+void HostHub_SetBulkOutput(host_hub_output fn, void * context) {
+  bulkOutput = fn;
+  bulkOutputContext = context;
+}
+
+void HostHub_SetStepTimerHook(host_hub_step_timer hook, void * context) {
+  stepTimerHook = hook;
+  stepTimerContext = context;
+}
+
+void HostHub_SetTxFree(uint32_t length) {
+  txFree = (length > HOST_TX_BUFFER_SIZE) ? HOST_TX_BUFFER_SIZE : length;
+}
+
+void HostHub_Receive(const uint8_t * data, uint32_t length) {
+  while (length--)
+    Serial_RxCallback(*data++);
+}
+
+void HostHub_ReceiveStr(const char * str) {
+  HostHub_Receive((const uint8_t *)str, strlen(str));
+}
+
+void HostHub_Tick(void) {
+  ticks++;
+  Stepper_ExecuteAllControllers();
+  Telemetry_ControllerTick();
+  ReportStepperEvents(&serialChannel);
+  Telemetry_SendPendingFrame();
+}
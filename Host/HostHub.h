@@ -0,0 +1,47 @@
+#ifndef __HOSTHUB_H
+#define __HOSTHUB_H
+
+// Host build of the hub command layer: the request decoder (MDK-ARM/stepperCommands.c), stepper controller and telemetry
+// are compiled for the host as they are, HAL and serial link of the hub are replaced by HostHub.c.
+// Step timers don't run (steppers don't move) unless the host simulates them (see HostHub_SetStepTimerHook),
+// controller passes run on HostHub_Tick.
+// Used by the host tests, benchmarks and the replay simulator:
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 -O2 $FW -c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c Host/HostHub.c
+//
+// Linux host is required (the hub writes FLASH interface registers at their MCU address).
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Receives everything the hub transmits, control and bulk channels in the order they are committed
+typedef void (* host_hub_output)(const uint8_t * data, uint32_t length, void * context);
+// Step timer of the stepper has been started (running) or stopped by the controller,
+// the period it runs is Stepper_GetStepPeriod (preloaded, it takes effect on the timer update)
+typedef void (* host_hub_step_timer)(char stepper, bool running, void * context);
+
+// Sets up steppers (one per name char) with RAM timers in their default state and starts the decoder.
+// Returns false if FLASH registers can't be mapped.
+bool HostHub_Init(const char * steppers);
+void HostHub_SetOutput(host_hub_output output, void * context);
+// Bulk channel (binary frames) goes here instead, NULL - to the output along with the control one
+void HostHub_SetBulkOutput(host_hub_output output, void * context);
+void HostHub_SetStepTimerHook(host_hub_step_timer hook, void * context);
+// TX buffer free space (control channel), reservations above it fail as they do on the hub
+void HostHub_SetTxFree(uint32_t txFree);
+// Decodes and executes the bytes, as the main loop does when they are received
+void HostHub_Receive(const uint8_t * data, uint32_t length);
+void HostHub_ReceiveStr(const char * str);
+// Controller pass (and telemetry tick), followed by the main loop reports (stop events, telemetry frames)
+void HostHub_Tick(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __HOSTHUB_H */
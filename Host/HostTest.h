@@ -0,0 +1,19 @@
+#ifndef __HOSTTEST_H
+#define __HOSTTEST_H
+
+// Harness of the host tests (a test is a function, the exit code of the test program is "failures"):
+// CHECK fails the current test and leaves it, RUN runs the test and reports it as OK unless it has failed.
+
+#include <stdio.h>
+#include <stdint.h>
+
+static int32_t failures;
+static const char * currentTest;
+
+#define CHECK(condition) \
+  do { if (!(condition)) { printf("%s: FAILED %s (line %d)\n", currentTest, #condition, __LINE__); failures++; return; } } while (0)
+
+#define RUN(test) \
+  do { int32_t before = failures; currentTest = #test; test(); if (failures == before) printf("%s: OK\n", #test); } while (0)
+
+#endif /* __HOSTTEST_H */
@@ -0,0 +1,278 @@
+// Request handling tests, run against the host build of the hub (see HostHub.h).
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 $FW Host/HubTests.c Host/HostHub.c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c -o hubtests
+//   hubtests
+//
+// Exit code is the number of the failed tests.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stepperController.h"
+#include "stepperCommands.h"
+#include "telemetry.h"
+#include "HostHub.h"
+#include "HostTest.h"
+
+static char output[16 * 1024];
+static uint32_t outputLength;
+static uint32_t telemetryFrames;
+static uint32_t rng = 1;
+
+static void Capture(const uint8_t * data, uint32_t length, void * context) {
+  if (length > 0 && data[0] == TELEMETRY_FRAME_SYNC) {
+    telemetryFrames++;
+    return;
+  }
+  if (outputLength + length < sizeof(output)) {
+    memcpy(output + outputLength, data, length);
+    outputLength += length;
+    output[outputLength] = '\0';
+  }
+}
+
+// the text responses to the request
+static const char * Request(const char * request) {
+  outputLength = 0;
+  output[0] = '\0';
+  HostHub_ReceiveStr(request);
+  return output;
+}
+
+static void Ticks(uint32_t count) {
+  while (count--)
+    HostHub_Tick();
+}
+
+// step timers don't run on the host, so the steps are made here (a step per controller pass) till every stepper stops
+static void Settle(void) {
+  uint32_t passes = 0;
+  bool moving;
+  char name;
+  int32_t i;
+
+  // the targets just set get to the controller on its next pass
+  HostHub_Tick();
+  do {
+    moving = false;
+    for (i = 0; (name = Stepper_GetName(i)) != '\0'; i++) {
+      if (!(Stepper_GetStatus(name) & SS_STOPPED)) {
+        Stepper_PulseTimerUpdate(name);
+        moving = true;
+      }
+    }
+    HostHub_Tick();
+  } while (moving && ++passes < 1000000);
+}
+
+// targets back to 0, and the steppers stopped there
+static void ResetTargets(void) {
+  Request("setX:0\rsetY:0\rsetZ:0\r");
+  Settle();
+}
+
+static uint32_t Random(uint32_t range) {
+  rng = rng * 1103515245 + 12345;
+  return ((rng >> 8) & 0xFFFFFF) % range;
+}
+
+// ========================================== //
+//    TELEMETRY                               //
+// ========================================== //
+
+static void TestBareSubscribeSubscribes(void) {
+  CHECK(strstr(Request("subscribeX\r"), "OK - X.TELEMETRY = 0x07 / 100 ms") != NULL);
+  telemetryFrames = 0;
+  Ticks(100 * 1000 / 50 * 3);
+  CHECK(telemetryFrames == 3);
+  CHECK(strstr(Request("subscribeX:0\r"), "OK - X.TELEMETRY = 0x00") != NULL);
+}
+
+static void TestPeriodKeptForBareSubscribe(void) {
+  CHECK(strstr(Request("subscribeY.status:10\r"), "OK - Y.TELEMETRY = 0x04 / 10 ms") != NULL);
+  CHECK(strstr(Request("subscribeY.status:0\r"), "OK - Y.TELEMETRY = 0x00 / 10 ms") != NULL);
+  CHECK(strstr(Request("subscribeY.currentPosition\r"), "OK - Y.TELEMETRY = 0x01 / 10 ms") != NULL);
+  CHECK(strstr(Request("subscribeY:0\r"), "OK - Y.TELEMETRY = 0x00 / 10 ms") != NULL);
+}
+
+static void TestNoFramesWhenNothingSubscribed(void) {
+  Request("subscribeX.status:1\rsubscribeY.all\r");
+  Request("subscribeX:0\r");
+  telemetryFrames = 0;
+  Ticks(100);
+  CHECK(telemetryFrames == 5);
+  Request("subscribeY:0\r");
+  telemetryFrames = 0;
+  Ticks(1000);
+  CHECK(telemetryFrames == 0);
+}
+
+// ========================================== //
+//    EVENTS                                  //
+// ========================================== //
+
+// the stop event waits for TX space, it is not taken (and lost) while TX is full
+static void TestStopEventKeptWhileTxFull(void) {
+  Request("setX:3\r");
+  HostHub_SetTxFree(0);
+  outputLength = 0;
+  output[0] = '\0';
+  Settle();
+  Ticks(10);
+  CHECK(strstr(output, "X.stop:") == NULL);
+  HostHub_SetTxFree(UINT32_MAX);
+  Ticks(1);
+  CHECK(strstr(output, "X.stop:3") != NULL);
+  ResetTargets();
+}
+
+// ========================================== //
+//    TRANSACTIONS                            //
+// ========================================== //
+
+// the second link of the hub, its responses are just dropped
+static uint8_t otherTx[1024];
+static uint8_t * OtherTxReserve(uint32_t length) { return (length <= sizeof(otherTx)) ? otherTx : NULL; }
+static void OtherTxCommit(uint32_t length) {}
+static const command_transport otherTransport = { OtherTxReserve, OtherTxCommit };
+static command_channel otherChannel;
+
+static void OtherRequest(const char * request) {
+  CommandChannel_Receive(&otherChannel, (const uint8_t *)request, strlen(request));
+}
+
+static void TestDirectSetWinsOverCommit(void) {
+  Request("begin\rsetX:100\rsetY:200\rcommit\rsetX:300\r");
+  Ticks(1);
+  CHECK(Stepper_GetTargetPosition('X') == 300);
+  CHECK(Stepper_GetTargetPosition('Y') == 200);
+  ResetTargets();
+}
+
+// commits of a single pass are merged, the last written wins
+static void TestCommitsMergedWithinPass(void) {
+  Request("begin\rsetX:100\rsetY:200\rcommit\rbegin\rsetY:-5\rsetZ:7\rcommit\r");
+  CHECK(Stepper_GetTargetPosition('X') == 0);
+  Ticks(1);
+  CHECK(Stepper_GetTargetPosition('X') == 100);
+  CHECK(Stepper_GetTargetPosition('Y') == -5);
+  CHECK(Stepper_GetTargetPosition('Z') == 7);
+  ResetTargets();
+}
+
+// every link stages and commits only its own targets
+static void TestTransactionsPerChannel(void) {
+  CHECK(CommandChannel_Init(&otherChannel, &otherTransport));
+  Request("begin\rsetX:100\r");
+  OtherRequest("begin\rsetY:200\rcommit\r");
+  Ticks(1);
+  CHECK(Stepper_GetTargetPosition('X') == 0);
+  CHECK(Stepper_GetTargetPosition('Y') == 200);
+  OtherRequest("begin\rsetZ:300\r");
+  CHECK(strstr(Request("setY:-1\rcommit\r"), "OK - COMMIT") != NULL);
+  Ticks(1);
+  CHECK(Stepper_GetTargetPosition('X') == 100);
+  CHECK(Stepper_GetTargetPosition('Y') == -1);
+  CHECK(Stepper_GetTargetPosition('Z') == 0);
+  OtherRequest("commit\r");
+  Ticks(1);
+  CHECK(Stepper_GetTargetPosition('Z') == 300);
+  ResetTargets();
+}
+
+// ========================================== //
+//    DECODER                                 //
+// ========================================== //
+
+// pieces of requests the line noise is made of (along with random bytes), none of them changes the link settings
+static const char * const garbagePieces[] = {
+  "set", "getX", "addY.", "Z.max", "SPS", "currentPosition", "begin", "commit", "sync", "subscribe",
+  ":", "-", ".", "#", "@", "@*", "@12", "#4294967295", "99999999999999999999", ":-2147483648", "\r", "\n", " "
+};
+
+// whatever garbage goes before, a line end gets the decoder back in sync, so the next request is decoded as sent
+static void TestResyncAfterGarbage(void) {
+  char garbage[128];
+  char request[32];
+  char expected[32];
+  uint32_t length;
+  uint32_t round;
+  const char * piece;
+
+  for (round = 0; round < 20000; round++) {
+    length = 0;
+    while (length < sizeof(garbage) - 32) {
+      if (Random(2) == 0) {
+        garbage[length++] = (char)Random(256);
+      } else {
+        piece = garbagePieces[Random(sizeof(garbagePieces) / sizeof(garbagePieces[0]))];
+        memcpy(garbage + length, piece, strlen(piece));
+        length += strlen(piece);
+      }
+      if (Random(16) == 0)
+        break;
+    }
+    // a staged transaction is not noise the decoder should drop, so it's committed
+    length += sprintf(garbage + length, "\ncommit");
+    outputLength = 0;
+    HostHub_Receive((const uint8_t *)garbage, length);
+    sprintf(request, "\n#%u sync\r", 100000 + round);
+    sprintf(expected, "#%u OK - SYNC = ", 100000 + round);
+    if (strstr(Request(request), expected) == NULL) {
+      printf("%s: garbage \"%.*s\"\n", currentTest, (int)length, garbage);
+      CHECK(strstr(output, expected) != NULL);
+    }
+  }
+  Request("subscribeX:0\rsubscribeY:0\rsubscribeZ:0\r");
+  ResetTargets();
+}
+
+// ========================================== //
+//    BUS ADDRESSING                          //
+// ========================================== //
+
+static void TestAddressLimit(void) {
+  CHECK(strstr(Request("address:300\r"), "LIMIT - ADDRESS = 255") != NULL);
+  CHECK(strstr(Request("@255 address:-1\r"), "LIMIT - ADDRESS = 0") != NULL);
+  CHECK(strstr(Request("address\r"), "OK - ADDRESS = 0") != NULL);
+}
+
+// broadcasts are never answered, but must be executed all the same
+static void TestBroadcastTransaction(void) {
+  CHECK(strstr(Request("address:5\r"), "OK - ADDRESS = 5") != NULL);
+  CHECK(strcmp(Request("@*begin\r@*setX:1000\r@*setY:-2000\r"), "") == 0);
+  Ticks(10);
+  CHECK(strstr(Request("@5 getX.targetPosition\r"), "X.TARGETPOSITION = 0") != NULL);
+  CHECK(strcmp(Request("@*commit\r"), "") == 0);
+  Ticks(1);
+  CHECK(strstr(Request("@5 getX.targetPosition\r"), "X.TARGETPOSITION = 1000") != NULL);
+  CHECK(strstr(Request("@5 getY.targetPosition\r"), "Y.TARGETPOSITION = -2000") != NULL);
+  CHECK(strcmp(Request("@*baud:57600\r"), "") == 0);
+  CHECK(strstr(Request("@5 baud\r"), "OK - BAUD = 57600") != NULL);
+  CHECK(strstr(Request("@5 baud:0\r"), "OK - BAUD = ") != NULL);
+  CHECK(strstr(Request("@5 address:0\r"), "OK - ADDRESS = 0") != NULL);
+  ResetTargets();
+}
+
+int main(void) {
+  if (!HostHub_Init("XYZ")) {
+    printf("FLASH registers can't be mapped\n");
+    return 1;
+  }
+  HostHub_SetOutput(Capture, NULL);
+
+  RUN(TestBareSubscribeSubscribes);
+  RUN(TestPeriodKeptForBareSubscribe);
+  RUN(TestNoFramesWhenNothingSubscribed);
+  RUN(TestStopEventKeptWhileTxFull);
+  RUN(TestDirectSetWinsOverCommit);
+  RUN(TestCommitsMergedWithinPass);
+  RUN(TestTransactionsPerChannel);
+  RUN(TestResyncAfterGarbage);
+  RUN(TestAddressLimit);
+  RUN(TestBroadcastTransaction);
+
+  printf("%s\n", (failures == 0) ? "ALL OK" : "FAILED");
+  return failures;
+}
@@ -0,0 +1,142 @@
+// Generates the keyword tries of the request decoder (Inc/stepperKeywordTries.h) from the command and parameter names
+// of MDK-ARM/stepperCommands.c, so the tables are const (FLASH) and the hub doesn't build anything at startup.
+// Must be rerun whenever the names change (the decoder refuses to compile if the number of keywords differs).
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 $FW Host/KeywordTries.c Host/HostHub.c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c -o keywordtries
+//   keywordtries > Inc/stepperKeywordTries.h
+//   keywordtries -check       exit code 1 if Inc/stepperKeywordTries.h is out of date
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "stepperCommands.h"
+
+// the same as in stepperCommands.c
+#define TRIE_ROOT           1
+#define TRIE_SYMBOLS_COUNT  28
+// node indexes are uint8_t
+#define TRIE_MAX_NODES      256
+
+#include "stepperKeywordTries.h"
+
+extern char * request_commands_arry[__CMD_COUNT];
+extern char * request_params_arry[__PARAM_COUNT];
+
+typedef struct {
+  uint8_t next[TRIE_MAX_NODES][TRIE_SYMBOLS_COUNT];
+  uint8_t keyword[TRIE_MAX_NODES];
+  bool    hasNext[TRIE_MAX_NODES];
+  // keyword prefix the node stands for
+  char    prefix[TRIE_MAX_NODES][16];
+  int32_t nodesCount;
+} trie_builder;
+
+static trie_builder commands;
+static trie_builder params;
+
+// 'A'..'Z' and '_', symbol 0 is for everything else (never has transitions)
+static int32_t TrieSymbol(char c) {
+  if (c >= 'A' && c <= 'Z') return c - 'A' + 1;
+  if (c == '_') return TRIE_SYMBOLS_COUNT - 1;
+  return 0;
+}
+
+static bool BuildTrie(trie_builder * trie, char ** keywords, int32_t keywordsCount) {
+  int32_t i;
+  int32_t sym;
+  int32_t node;
+  const char * c;
+
+  memset(trie, 0, sizeof(trie_builder));
+  // node 0 is never a valid transition target, so it's reserved, and TRIE_ROOT goes next
+  trie->nodesCount = TRIE_ROOT + 1;
+
+  // keyword 0 is UNKNOWN/UNDEFINED placeholder, it's never decoded
+  for (i = 1; i < keywordsCount; i++) {
+    node = TRIE_ROOT;
+    for (c = keywords[i]; *c; c++) {
+      sym = TrieSymbol(*c);
+      if (sym == 0 || c - keywords[i] >= (int32_t)sizeof(trie->prefix[0]) - 1) {
+        fprintf(stderr, "keyword \"%s\" can't be decoded\n", keywords[i]);
+        return false;
+      }
+      if (trie->next[node][sym] == 0) {
+        if (trie->nodesCount == TRIE_MAX_NODES) {
+          fprintf(stderr, "too many keywords\n");
+          return false;
+        }
+        memcpy(trie->prefix[trie->nodesCount], keywords[i], c - keywords[i] + 1);
+        trie->next[node][sym] = (uint8_t)trie->nodesCount++;
+      }
+      trie->hasNext[node] = true;
+      node = trie->next[node][sym];
+    }
+    trie->keyword[node] = (uint8_t)i;
+  }
+  return true;
+}
+
+static void PrintTrie(const trie_builder * trie, const char * name, const char * upperName, int32_t keywordsCount) {
+  int32_t node;
+  int32_t sym;
+
+  printf("#define %s_TRIE_KEYWORDS %d\n", upperName, keywordsCount);
+  printf("#define %s_TRIE_NODES    %d\n\n", upperName, trie->nodesCount);
+
+  printf("static const uint8_t %sTrieNext[%s_TRIE_NODES][TRIE_SYMBOLS_COUNT] = {\n", name, upperName);
+  for (node = 0; node < trie->nodesCount; node++) {
+    printf("  {");
+    for (sym = 0; sym < TRIE_SYMBOLS_COUNT; sym++)
+      printf("%s%2d", (sym == 0) ? "" : ",", trie->next[node][sym]);
+    printf("}%s  // %s\n", (node + 1 < trie->nodesCount) ? "," : " ", (node == 0) ? "reserved" : (node == TRIE_ROOT) ? "root" : trie->prefix[node]);
+  }
+  printf("};\n\n");
+
+  printf("static const uint8_t %sTrieKeyword[%s_TRIE_NODES] = {", name, upperName);
+  for (node = 0; node < trie->nodesCount; node++)
+    printf("%s%s%d", (node == 0) ? "" : ",", (node % 32 == 0) ? "\n  " : "", trie->keyword[node]);
+  printf("\n};\n\n");
+
+  printf("static const bool %sTrieHasNext[%s_TRIE_NODES] = {", name, upperName);
+  for (node = 0; node < trie->nodesCount; node++)
+    printf("%s%s%d", (node == 0) ? "" : ",", (node % 32 == 0) ? "\n  " : "", trie->hasNext[node]);
+  printf("\n};\n\n");
+}
+
+static bool IsUpToDate(const trie_builder * trie, int32_t nodesCount, const uint8_t (* next)[TRIE_SYMBOLS_COUNT], const uint8_t * keyword, const bool * hasNext) {
+  int32_t node;
+
+  if (trie->nodesCount != nodesCount)
+    return false;
+  for (node = 0; node < nodesCount; node++) {
+    if (memcmp(trie->next[node], next[node], TRIE_SYMBOLS_COUNT) != 0 || trie->keyword[node] != keyword[node] || trie->hasNext[node] != hasNext[node])
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char * argv[]) {
+  if (!BuildTrie(&commands, request_commands_arry, __CMD_COUNT) || !BuildTrie(&params, request_params_arry, __PARAM_COUNT))
+    return 1;
+
+  if (argc > 1 && strcmp(argv[1], "-check") == 0) {
+    if (!IsUpToDate(&commands, COMMANDS_TRIE_NODES, commandsTrieNext, commandsTrieKeyword, commandsTrieHasNext) ||
+        !IsUpToDate(&params, PARAMS_TRIE_NODES, paramsTrieNext, paramsTrieKeyword, paramsTrieHasNext)) {
+      printf("Inc/stepperKeywordTries.h is out of date\n");
+      return 1;
+    }
+    printf("Inc/stepperKeywordTries.h is up to date (%d + %d nodes)\n", commands.nodesCount, params.nodesCount);
+    return 0;
+  }
+
+  printf("#ifndef __STEPPERKEYWORDTRIES_H\n");
+  printf("#define __STEPPERKEYWORDTRIES_H\n\n");
+  printf("// Generated by Host/KeywordTries.c from request_commands_arry and request_params_arry (MDK-ARM/stepperCommands.c), do not edit.\n");
+  printf("// Keyword tries of the request decoder: a row per node, a transition per symbol (0 - none, see TrieSymbol),\n");
+  printf("// keyword (request_commands or request_params) which ends at the node (0 - none), and whether there are longer keywords going through it.\n\n");
+  PrintTrie(&commands, "commands", "COMMANDS", __CMD_COUNT);
+  PrintTrie(&params, "params", "PARAMS", __PARAM_COUNT);
+  printf("#endif /* __STEPPERKEYWORDTRIES_H */\n");
+  return 0;
+}
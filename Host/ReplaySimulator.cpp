@@ -0,0 +1,394 @@
+// Replays RX capture (see "RX CAPTURE" in MDK-ARM/stepperCommands.c) through the hub firmware itself:
+// the request decoder, stepper controller and telemetry are compiled for the host (HostHub.h) and fed with the recorded bytes
+// at the controller ticks they have been decoded at. Step timers are simulated in timer clock cycles (ARR/PSC preload included),
+// so the same capture always gives the same step timeline - a regression baseline for the controller and decoder changes,
+// and a benchmark (the replay runs much faster than the real time).
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 $FW -c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c Host/HostHub.c
+//   g++ -std=c++11 $FW Host/ReplaySimulator.cpp Host/StepperHubClient.cpp stepperController.o telemetry.o stepperCommands.o HostHub.o -lpthread -o replaysim
+//   replaysim capture.bin [-steps steps.csv] [-expect <hash>] [-quiet]
+//
+// Linux host is required (the hub registers the firmware touches are mapped at their MCU addresses).
+//
+// capture.bin is either the raw bytes received from the hub after "capture" request, or the capture itself (as OnCapture gives it).
+// The responses produced by the replay are printed with the tick they have been sent at, then the summary:
+// final positions, number of steps and the hash of the step timeline. -expect fails (exit code 2) if the hash differs,
+// -steps writes every step (timer cycle, tick, stepper, position, currentSPS) as CSV.
+//
+// Not modeled: main loop latency (the bytes of a tick are decoded right after the controller pass, and stop events are reported
+// once per tick), FLASH programming stalls, TX flow (responses never overflow). So the responses reading the positions
+// of moving steppers may differ from the ones the hub has sent, while the targets get to the controller at the same passes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+#include "StepperHubClient.h"
+#include "HostHub.h"
+
+extern "C" {
+#include "stepperController.h"
+#include "stepperCommands.h"
+#include "telemetry.h"
+#include "rxCapture.h"
+}
+
+struct RxByte {
+  uint32_t  tick;             // since the capture start
+  uint8_t   data;
+};
+
+struct StepTimer {
+  char              stepper;
+  bool              running;
+  uint64_t          nextUpdate;
+};
+
+static StepTimer timers[MAX_STEPPERS_COUNT];
+static size_t timersCount;
+// timer clock cycles since the replay start
+static uint64_t now;
+static uint32_t tick;
+
+static FILE * stepsFile;
+static uint64_t steps;
+static uint64_t stepsHash = 14695981039346656037ULL;
+static bool quiet;
+static std::string responseLine;
+static uint32_t bulkFrames;
+
+// FNV-1a
+static void Hash(uint64_t & hash, uint64_t value, size_t bytes) {
+  for (size_t i = 0; i < bytes; i++) {
+    hash ^= (uint8_t)(value >> (i * 8));
+    hash *= 1099511628211ULL;
+  }
+}
+
+static StepTimer * FindTimer(char stepper) {
+  for (size_t i = 0; i < timersCount; i++) {
+    if (timers[i].stepper == stepper)
+      return &timers[i];
+  }
+  return NULL;
+}
+
+// ========================================== //
+//    HOST HUB HOOKS                          //
+// ========================================== //
+
+static void OnStepTimer(char stepper, bool running, void * context) {
+  StepTimer * timer = FindTimer(stepper);
+  if (timer == NULL)
+    return;
+  // the controller has just forced the update (EGR = UG), so the first period is the current ARR/PSC
+  timer->running = running;
+  if (running)
+    timer->nextUpdate = now + Stepper_GetStepPeriod(stepper);
+}
+
+static void OnResponse(const uint8_t * data, uint32_t length, void * context) {
+  for (uint32_t i = 0; i < length; i++) {
+    char c = (char)data[i];
+    if (c == '\r')
+      continue;
+    if (c != '\n') {
+      responseLine += c;
+      continue;
+    }
+    if (!quiet)
+      printf("%10u  %s\n", tick, responseLine.c_str());
+    responseLine.clear();
+  }
+}
+
+// telemetry frames are just counted
+static void OnBulkFrame(const uint8_t * data, uint32_t length, void * context) {
+  bulkFrames++;
+}
+
+// ========================================== //
+//    REPLAY                                  //
+// ========================================== //
+
+static bool LoadCapture(const char * path, std::vector<uint8_t> & capture) {
+  std::vector<uint8_t> raw;
+  uint8_t buffer[4096];
+  size_t length;
+  uint32_t magic = 0;
+  size_t received = 0;
+  FILE * file = fopen(path, "rb");
+
+  if (file == NULL) {
+    perror(path);
+    return false;
+  }
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    raw.insert(raw.end(), buffer, buffer + length);
+  fclose(file);
+
+  if (raw.size() >= 4)
+    memcpy(&magic, raw.data(), 4);
+  if (magic == RX_CAPTURE_MAGIC) {
+    capture.swap(raw);
+    return true;
+  }
+
+  // raw port bytes - text responses and the other frames are skipped
+  StepperHub::Client client([](const uint8_t *, size_t) {});
+  client.OnCapture([&](uint32_t offset, const uint8_t * data, size_t count) {
+    if (offset + count > capture.size())
+      capture.resize(offset + count);
+    memcpy(&capture[offset], data, count);
+    received += count;
+  });
+  client.Receive(raw.data(), raw.size());
+
+  if (received != capture.size()) {
+    fprintf(stderr, "%s: %u capture bytes are missing\n", path, (unsigned)(capture.size() - received));
+    return false;
+  }
+  return true;
+}
+
+static bool DecodeStream(const capture_header & header, const uint8_t * stream, std::vector<RxByte> & bytes) {
+  const uint8_t * end = stream + header.streamLength;
+  RxByte b = { 0, 0 };
+  uint32_t delta;
+  uint32_t shift;
+
+  while (stream < end) {
+    b.data = *stream++;
+    if (b.data == RX_CAPTURE_ESCAPE) {
+      delta = 0;
+      shift = 0;
+      do {
+        if (stream == end || shift > 28)
+          return false;
+        delta |= (uint32_t)(*stream & 0x7F) << shift;
+        shift += 7;
+      } while (*stream++ & 0x80);
+      // 0 - the escape byte itself
+      if (delta != 0) {
+        b.tick += delta;
+        continue;
+      }
+    }
+    bytes.push_back(b);
+  }
+  return bytes.size() == header.rxBytes;
+}
+
+static void ApplyProfile(const capture_stepper * s, int32_t profile) {
+  const capture_profile * p = &s->profiles[profile];
+
+  Stepper_SetMaxSPS(s->name, p->maxSPS);
+  // minSPS sets the acceleration by itself, so the captured one goes after it
+  Stepper_SetMinSPS(s->name, p->minSPS);
+  Stepper_SetAccSPS(s->name, p->accSPS);
+  Stepper_SetAccPrescaler(s->name, p->accPrescaler);
+
+  if (Stepper_GetMinSPS(s->name) != p->minSPS || Stepper_GetMaxSPS(s->name) != p->maxSPS ||
+      Stepper_GetAccSPS(s->name) != p->accSPS || Stepper_GetAccPrescaler(s->name) != p->accPrescaler)
+    fprintf(stderr, "%c: the captured motion parameters of profile %d can't be set as they are\n", s->name, profile);
+}
+
+// Sets the host hub up with the captured steppers, returns false if it can't be
+static bool ApplySnapshot(const capture_header & header) {
+  const capture_stepper * s;
+  char names[MAX_STEPPERS_COUNT + 1];
+
+  for (size_t i = 0; i < header.steppersCount && i < MAX_STEPPERS_COUNT; i++) {
+    names[i] = header.steppers[i].name;
+    timers[timersCount++].stepper = header.steppers[i].name;
+  }
+  names[timersCount] = '\0';
+  if (!HostHub_Init(names))
+    return false;
+  HostHub_SetOutput(OnResponse, NULL);
+  HostHub_SetBulkOutput(OnBulkFrame, NULL);
+  HostHub_SetStepTimerHook(OnStepTimer, NULL);
+  Stepper_SetHubAddress(header.hubAddress);
+
+  // setters change the active profile only, so every profile that has been set is selected in turn, the captured one goes last.
+  // The ones never set are left alone - they still become a copy of the active one when selected (profile 0 is always set).
+  for (int32_t profile = 0; profile < CONFIG_PROFILES_COUNT; profile++) {
+    if (profile == header.profile)
+      continue;
+    for (size_t i = 0; i < timersCount; i++) {
+      if (header.steppers[i].profilesSet & (1 << profile)) {
+        Stepper_SelectProfile(profile);
+        ApplyProfile(&header.steppers[i], profile);
+      }
+    }
+  }
+  Stepper_SelectProfile(header.profile);
+  for (size_t i = 0; i < timersCount; i++) {
+    s = &header.steppers[i];
+    ApplyProfile(s, header.profile);
+    Stepper_SetCurrentPosition(s->name, s->position);
+  }
+
+  // subscriptions in the captured order, so the frames have the same layout
+  Telemetry_SetPeriod(header.telemetryPeriodMs);
+  for (size_t i = 0; i < header.subscriptionsCount && i < MAX_STEPPERS_COUNT; i++)
+    Telemetry_Subscribe(header.subscriptions[i].stepper, (telemetry_fields)header.subscriptions[i].fields, true);
+
+  serialChannel.transactionActive = (header.flags & RX_CAPTURE_FLAG_TRANSACTION) != 0;
+  serialChannel.transactionFailed = (header.flags & RX_CAPTURE_FLAG_FAILED) != 0;
+  serialChannel.transactionCount = std::min<int32_t>(header.stagedCount, MAX_STEPPERS_COUNT);
+  memcpy(serialChannel.transactionSteppers, header.stagedSteppers, sizeof(serialChannel.transactionSteppers));
+  memcpy(serialChannel.transactionTargets, header.stagedTargets, sizeof(serialChannel.transactionTargets));
+  if (header.committedCount > 0)
+    Stepper_CommitTargets(&serialChannel.committedTargets, std::min<int32_t>(header.committedCount, MAX_STEPPERS_COUNT),
+                          header.committedSteppers, header.committedTargets);
+  return true;
+}
+
+static void RecordStep(StepTimer * timer, int32_t position) {
+  steps++;
+  Hash(stepsHash, (uint8_t)timer->stepper, 1);
+  Hash(stepsHash, now, 8);
+  Hash(stepsHash, (uint32_t)position, 4);
+  if (stepsFile != NULL)
+    fprintf(stepsFile, "%llu,%u,%c,%d,%d\n", (unsigned long long)now, tick, timer->stepper, position, Stepper_GetCurrentSPS(timer->stepper));
+}
+
+// Step timer updates up to (and including) the cycle, in the order they happen.
+// The step timers preempt the controller, so the ones at the very same cycle go first.
+static void RunStepTimers(uint64_t until) {
+  StepTimer * timer;
+  uint64_t period;
+  int32_t position;
+
+  for (;;) {
+    timer = NULL;
+    for (size_t i = 0; i < timersCount; i++) {
+      if (timers[i].running && timers[i].nextUpdate <= until && (timer == NULL || timers[i].nextUpdate < timer->nextUpdate))
+        timer = &timers[i];
+    }
+    if (timer == NULL)
+      return;
+
+    now = timer->nextUpdate;
+    // the update event loads the preloaded ARR/PSC, whatever the handler does goes to the next period
+    period = Stepper_GetStepPeriod(timer->stepper);
+    position = Stepper_GetCurrentPosition(timer->stepper);
+    Stepper_PulseTimerUpdate(timer->stepper);
+    if (Stepper_GetCurrentPosition(timer->stepper) != position)
+      RecordStep(timer, Stepper_GetCurrentPosition(timer->stepper));
+    if (timer->running)
+      timer->nextUpdate = now + period;
+  }
+}
+
+static bool AllStopped(void) {
+  for (size_t i = 0; i < timersCount; i++) {
+    if (!(Stepper_GetStatus(timers[i].stepper) & SS_STOPPED))
+      return false;
+  }
+  return true;
+}
+
+int main(int argc, char ** argv) {
+  std::vector<uint8_t> capture;
+  std::vector<RxByte> bytes;
+  capture_header header;
+  const char * expect = NULL;
+  uint64_t tickCycles;
+  uint32_t lastTick;
+  uint32_t maxTicks;
+  size_t next = 0;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <capture> [-steps steps.csv] [-expect hash] [-quiet]\n", argv[0]);
+    return 1;
+  }
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-steps") == 0 && i + 1 < argc) {
+      stepsFile = fopen(argv[++i], "w");
+      if (stepsFile == NULL) {
+        perror(argv[i]);
+        return 1;
+      }
+      fprintf(stepsFile, "cycle,tick,stepper,position,currentSPS\n");
+    } else if (strcmp(argv[i], "-expect") == 0 && i + 1 < argc) {
+      expect = argv[++i];
+    } else if (strcmp(argv[i], "-quiet") == 0) {
+      quiet = true;
+    }
+  }
+
+  if (!LoadCapture(argv[1], capture))
+    return 1;
+  if (capture.size() < sizeof(header)) {
+    fprintf(stderr, "%s: no capture\n", argv[1]);
+    return 1;
+  }
+  memcpy(&header, capture.data(), sizeof(header));
+  if (header.magic != RX_CAPTURE_MAGIC || sizeof(header) + header.streamLength > capture.size() ||
+      !DecodeStream(header, &capture[sizeof(header)], bytes)) {
+    fprintf(stderr, "%s: the capture is damaged\n", argv[1]);
+    return 1;
+  }
+  if (header.flags & RX_CAPTURE_FLAG_FULL)
+    fprintf(stderr, "the capture has been cut (buffer full), replaying what's there\n");
+
+  STEP_TIMER_CLOCK = header.clock;
+  STEP_CONTROLLER_PERIOD_US = header.controllerPeriodUs;
+  // the controller timer runs ARR + 1 cycles per tick, not the rounded microseconds
+  tickCycles = header.controllerCycles;
+  lastTick = bytes.empty() ? header.ticks : std::max(header.ticks, bytes.back().tick);
+  // a minute to stop after the last request
+  maxTicks = lastTick + 60000000 / header.controllerPeriodUs;
+
+  if (!ApplySnapshot(header)) {
+    fprintf(stderr, "can't map FLASH registers at 0x%08x\n", (unsigned)FLASH_R_BASE);
+    return 1;
+  }
+
+  auto started = std::chrono::steady_clock::now();
+  for (;;) {
+    // main loop: everything received within this tick
+    while (next < bytes.size() && bytes[next].tick == tick)
+      HostHub_Receive(&bytes[next++].data, 1);
+    Stepper_SavePendingConfig();
+
+    if (tick >= lastTick && next == bytes.size() && AllStopped())
+      break;
+    if (tick >= maxTicks) {
+      fprintf(stderr, "the steppers are still moving a minute after the last request\n");
+      break;
+    }
+
+    // controller timer interrupt
+    tick++;
+    RunStepTimers(tick * tickCycles);
+    now = tick * tickCycles;
+    // controller pass, then the main loop reports (stop events, telemetry frames)
+    HostHub_Tick();
+  }
+  double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+  double simulated = (double)tick * tickCycles / header.clock;
+
+  if (stepsFile != NULL)
+    fclose(stepsFile);
+
+  printf("replayed %u bytes, %u ticks (%.3f s) in %.3f s", header.rxBytes, tick, simulated, elapsed);
+  if (elapsed > 0)
+    printf(" - %.1fx real time", simulated / elapsed);
+  printf("\n");
+  for (size_t i = 0; i < timersCount; i++)
+    printf("%c = %d%s", timers[i].stepper, Stepper_GetCurrentPosition(timers[i].stepper), (i + 1 < timersCount) ? " " : "\n");
+  printf("steps = %llu hash = %016llx telemetry frames = %u\n", (unsigned long long)steps, (unsigned long long)stepsHash, bulkFrames);
+
+  if (expect != NULL && strtoull(expect, NULL, 16) != stepsHash) {
+    fprintf(stderr, "step timeline differs from %s\n", expect);
+    return 2;
+  }
+  return 0;
+}
@@ -0,0 +1,156 @@
+// Response formatting benchmark: "get<stepper>.all" response formatted by the append builder of the hub (MDK-ARM/stepperCommands.c)
+// against the same response formatted with sprintf, the way the hub did it before the builder.
+// Both must give the very same bytes. The whole request (decode, execute, format) through the host build of the hub goes last.
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 -O2 $FW Host/ResponseBenchmark.c Host/HostHub.c Src/stepperController.c Src/telemetry.c MDK-ARM/stepperCommands.c -o responsebench
+//   responsebench [iterations]
+//
+// The ratio is what counts, the host is not the hub (newlib sprintf on Cortex-M4 is way slower than glibc one).
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "stepperController.h"
+#include "stepperCommands.h"
+#include "HostHub.h"
+
+// the builder of stepperCommands.c
+char * AppendBytes(char * out, const char * data, uint32_t length);
+char * AppendChar(char * out, char c);
+char * AppendParamValue(char * out, request_params param, int32_t value);
+int32_t GetParamValue(char stepper, request_params param);
+
+// request_params_arry of stepperCommands.c
+static const char * paramNames[__PARAM_COUNT] = { "UNDEFINED", "ALL", "TARGETPOSITION", "CURRENTPOSITION", "MINSPS", "MAXSPS", "CURRENTSPS", "ACCSPS", "ACCPRESCALER", "STATUS" };
+
+static char builderResponse[1024];
+static char printfResponse[1024];
+static uint32_t hubResponses;
+
+static double Now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// ExecuteTaggedRequest, PARAM_ALL
+static char * FormatBuilder(char * out, char stepper) {
+  request_params param = (request_params)(PARAM_ALL + 1);
+
+  out = AppendBytes(out, "OK - ", 5);
+  out = AppendChar(out, stepper);
+  out = AppendBytes(out, "\r\n", 2);
+  do {
+    out = AppendChar(out, '\t');
+    out = AppendParamValue(out, param, GetParamValue(stepper, param));
+    param++;
+  } while (param < __PARAM_COUNT);
+  return out;
+}
+
+static char * PrintStatusPrintf(char * out, stepper_status status) {
+  char * separator = "";
+  if (status & SS_STOPPED) {
+    out += sprintf(out, "STOPPED");
+    separator = " | ";
+  }
+  if (status & SS_BREAKING) {
+    out += sprintf(out, "%sBREAKING", separator);
+    separator = " | ";
+  }
+  if (status & SS_BREAKCORRECTION) {
+    out += sprintf(out, "%sBREAKCORRECTION", separator);
+    separator = " | ";
+  }
+  if (status & SS_STARTING) {
+    out += sprintf(out, "%sSTARTING", separator);
+    separator = " | ";
+  }
+  if (status & SS_RUNNING_BACKWARD) {
+    out += sprintf(out, "%sRUNNING_BACKWARD", separator);
+    separator = " | ";
+  }
+  if (status & SS_RUNNING_FORWARD) {
+    out += sprintf(out, "%sRUNNING_FORWARD", separator);
+  }
+  if (status == 0x00) {
+    out += sprintf(out, "UNDEFINED");
+  }
+  return out;
+}
+
+// the hub response code before the builder
+static char * FormatPrintf(char * out, char stepper) {
+  request_params param = (request_params)(PARAM_ALL + 1);
+  int32_t value;
+
+  out += sprintf(out, "OK - %c", stepper);
+  out += sprintf(out, "\r\n");
+  do {
+    value = GetParamValue(stepper, param);
+    if (param == PARAM_STATUS) {
+      out += sprintf(out, "\t.%s = 0x%.2X ", paramNames[param], value);
+      out = PrintStatusPrintf(out, (stepper_status)value);
+      out += sprintf(out, "\r\n");
+    } else {
+      out += sprintf(out, "\t.%s = %d\r\n", paramNames[param], value);
+    }
+    param++;
+  } while (param < __PARAM_COUNT);
+  return out;
+}
+
+static void CountResponse(const uint8_t * data, uint32_t length, void * context) {
+  hubResponses++;
+}
+
+int main(int argc, char * argv[]) {
+  uint32_t iterations = (argc > 1) ? atoi(argv[1]) : 1000000;
+  uint32_t builderLength = 0;
+  uint32_t printfLength = 0;
+  uint32_t i;
+  double start;
+  double builderTime;
+  double printfTime;
+  double hubTime;
+
+  if (!HostHub_Init("XYZ")) {
+    printf("FLASH registers can't be mapped\n");
+    return 1;
+  }
+  // realistic values - multi-digit and negative ones
+  HostHub_ReceiveStr("setX.maxSPS:250000\rsetX.minSPS:1200\rresetX:-1234567\rsetX:8765432\r");
+
+  start = Now();
+  for (i = 0; i < iterations; i++)
+    builderLength = FormatBuilder(builderResponse, 'X') - builderResponse;
+  builderTime = Now() - start;
+
+  start = Now();
+  for (i = 0; i < iterations; i++)
+    printfLength = FormatPrintf(printfResponse, 'X') - printfResponse;
+  printfTime = Now() - start;
+
+  if (builderLength != printfLength || memcmp(builderResponse, printfResponse, builderLength) != 0) {
+    printf("FAILED - the responses differ:\n%.*s\n%.*s\n", (int)builderLength, builderResponse, (int)printfLength, printfResponse);
+    return 1;
+  }
+
+  HostHub_SetOutput(CountResponse, NULL);
+  start = Now();
+  for (i = 0; i < iterations; i++)
+    HostHub_ReceiveStr("getX.all\r");
+  hubTime = Now() - start;
+  if (hubResponses != iterations) {
+    printf("FAILED - %u responses to %u requests\n", hubResponses, iterations);
+    return 1;
+  }
+
+  printf("get<stepper>.all response, %u bytes, %u iterations\n", builderLength, iterations);
+  printf("  builder   %8.1f ns\n", builderTime / iterations * 1e9);
+  printf("  sprintf   %8.1f ns  (x%.1f)\n", printfTime / iterations * 1e9, printfTime / builderTime);
+  printf("  request   %8.1f ns  (decode, execute and format through the hub)\n", hubTime / iterations * 1e9);
+  return 0;
+}
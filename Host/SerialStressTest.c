@@ -0,0 +1,204 @@
+// Stress test of the serial RX path (Src/serial.c compiled for the host): long continuous command streams
+// are written to the RX buffer the way circular DMA does it (NDTR counting down, half/full transfer callbacks,
+// the zero NDTR moment before the reload), while the main loop drains it at random moments.
+// Every byte has to come to Serial_RxCallback exactly once and in order, none is lost or repeated across the wraps.
+// With SERIAL_FLOW_CONTROL the main loop may be late for as long as it takes, and the host stops (after a few bytes from its FIFO)
+// only when RTS holds it - so RTS must hold it in time, whatever the main loop does.
+//
+//   FW="-DUSE_HAL_DRIVER -DSTM32F446xx -IInc -IDrivers/STM32F4xx_HAL_Driver/Inc -IDrivers/CMSIS/Device/ST/STM32F4xx/Include -IDrivers/CMSIS/Include"
+//   gcc -std=gnu99 $FW -D__weak="__attribute__((weak))" -Dfputc=Serial_fputc -D"SERIAL_LOCK()=" -D"SERIAL_UNLOCK()=" Host/SerialStressTest.c Src/serial.c -o serialstress
+//   gcc -std=gnu99 $FW -D__weak="__attribute__((weak))" -Dfputc=Serial_fputc -D"SERIAL_LOCK()=" -D"SERIAL_UNLOCK()=" -DSERIAL_FLOW_CONTROL Host/SerialStressTest.c Src/serial.c -o serialstress_rts
+//   serialstress [megabytes] [seed]
+//
+// Exit code is 0 when the whole stream has been received intact.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "stm32f4xx_hal.h"
+#include "mxconstants.h"
+#include "serial.h"
+
+// the same as in serial.c
+#define RX_BUFFER_SIZE (8*1024)
+// bytes the host may still send after RTS has asked it to hold (USB-UART bridges have 32..64 bytes FIFO)
+#define HOST_FIFO_SIZE 64
+
+UART_HandleTypeDef huart2;
+static DMA_HandleTypeDef hdmaRx;
+static DMA_Stream_TypeDef rxStream;
+static USART_TypeDef usart;
+
+static uint8_t * dmaBuffer;
+static uint32_t dmaSize;
+
+static char * stream;
+static uint32_t streamLength;
+static uint32_t sent;
+static uint32_t received;
+static uint32_t errors;
+static bool rtsHeld;
+static uint32_t rtsHolds;
+static uint32_t hostFifo;
+
+static uint32_t rng = 1;
+
+static uint32_t Random(uint32_t range) {
+  rng = rng * 1103515245 + 12345;
+  return ((rng >> 8) & 0xFFFFFF) % range;
+}
+
+// HAL shims
+
+uint32_t HAL_GetTick(void) {
+  return 0;
+}
+
+uint32_t HAL_RCC_GetPCLK1Freq(void) {
+  return 50000000;
+}
+
+static uint32_t Random(uint32_t range);
+
+void HAL_GPIO_WritePin(GPIO_TypeDef * port, uint16_t pin, GPIO_PinState state) {
+  if (port != UART_RTS_GPIO_Port || pin != UART_RTS_Pin)
+    return;
+  if (state == GPIO_PIN_SET && !rtsHeld) {
+    rtsHolds++;
+    // whatever is in the host FIFO goes out anyway
+    hostFifo = Random(HOST_FIFO_SIZE + 1);
+  }
+  rtsHeld = (state == GPIO_PIN_SET);
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_DMA(UART_HandleTypeDef * huart, uint8_t * data, uint16_t size) {
+  dmaBuffer = data;
+  dmaSize = size;
+  rxStream.NDTR = size;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef * huart, uint8_t * data, uint16_t size) {
+  // nothing is sent in this test, the transfer is complete at once
+  return HAL_OK;
+}
+
+void Serial_RxCallback(uint8_t byte) {
+  if (received >= sent || byte != (uint8_t)stream[received]) {
+    if (errors++ < 10)
+      printf("byte %u: got 0x%02X, expected 0x%02X\n", received, byte, (received < sent) ? (uint8_t)stream[received] : 0);
+    // the read index has gone past the DMA one, it would never stop
+    if (received > sent + RX_BUFFER_SIZE) {
+      printf("FAILED - the main loop reads more than has been received\n");
+      exit(1);
+    }
+  }
+  received++;
+}
+
+// Circular DMA: the byte goes to (size - NDTR), NDTR is reloaded on the next byte after it has got to 0
+static void DmaReceive(uint8_t byte) {
+  if (rxStream.NDTR == 0)
+    rxStream.NDTR = dmaSize;
+
+  dmaBuffer[dmaSize - rxStream.NDTR] = byte;
+  rxStream.NDTR--;
+
+  if (rxStream.NDTR == dmaSize / 2)
+    HAL_UART_RxHalfCpltCallback(&huart2);
+  else if (rxStream.NDTR == 0)
+    HAL_UART_RxCpltCallback(&huart2);
+}
+
+static void GenerateStream(uint32_t length) {
+  static const char * commands[] = { "setX:", "addY:", "getZ", "getX.all", "setY.maxSPS:", "resetZ:", "#", "begin", "commit", "sync" };
+  uint32_t i = 0;
+  int n;
+
+  stream = malloc(length + 64);
+  while (i < length) {
+    const char * cmd = commands[Random(sizeof(commands) / sizeof(commands[0]))];
+    if (cmd[0] == '#') {
+      n = sprintf(stream + i, "#%u ", Random(1000000));
+    } else if (cmd[strlen(cmd) - 1] == ':') {
+      n = sprintf(stream + i, "%s%d\r", cmd, (int32_t)Random(2000000) - 1000000);
+    } else {
+      n = sprintf(stream + i, "%s\r", cmd);
+    }
+    i += n;
+  }
+  streamLength = length;
+}
+
+int main(int argc, char * argv[]) {
+  uint32_t megabytes = (argc > 1) ? atoi(argv[1]) : 64;
+  uint32_t burst;
+  uint32_t maxPending = 0;
+  uint32_t passes = 0;
+
+  if (argc > 2)
+    rng = atoi(argv[2]);
+
+  huart2.Instance = &usart;
+  huart2.hdmarx = &hdmaRx;
+  hdmaRx.Instance = &rxStream;
+  Serial_InitRxSequence();
+  if (dmaSize != RX_BUFFER_SIZE) {
+    printf("RX DMA has not been started\n");
+    return 1;
+  }
+
+  GenerateStream(megabytes * 1024 * 1024);
+
+  while (received < streamLength) {
+#ifdef SERIAL_FLOW_CONTROL
+    // the line time the main loop is late for
+    burst = Random(3 * RX_BUFFER_SIZE);
+#else
+    // the line delivers a burst, main loop may be late up to almost the whole buffer
+    // (it can't fall behind more than that, the bytes are lost without flow control)
+    burst = Random(RX_BUFFER_SIZE);
+    if (burst > RX_BUFFER_SIZE - 1 - (sent - received))
+      burst = RX_BUFFER_SIZE - 1 - (sent - received);
+#endif
+    if (burst > streamLength - sent)
+      burst = streamLength - sent;
+
+    while (burst--) {
+      if (rtsHeld) {
+        if (hostFifo == 0)
+          break;
+        hostFifo--;
+      }
+      if (sent - received == RX_BUFFER_SIZE - 1) {
+        // the next byte would overwrite the one not decoded yet
+        if (errors++ < 10)
+          printf("RX buffer overrun at byte %u\n", sent);
+        break;
+      }
+      DmaReceive(stream[sent++]);
+      if (Random(4096) == 0)
+        Serial_RxIdleCallback();
+    }
+
+    if (sent - received > maxPending)
+      maxPending = sent - received;
+    if (Serial_GetRxFree() != RX_BUFFER_SIZE - 1 - (sent - received)) {
+      if (errors++ < 10)
+        printf("free space %u, expected %u\n", Serial_GetRxFree(), RX_BUFFER_SIZE - 1 - (sent - received));
+    }
+
+    Serial_ProcessReceived();
+    passes++;
+    if (received != sent) {
+      if (errors++ < 10)
+        printf("%u bytes left in the buffer after the main loop pass\n", sent - received);
+      received = sent;
+    }
+  }
+
+  printf("%u bytes, %u main loop passes, max %u bytes pending, RTS held %u times: %s (%u errors)\n",
+    streamLength, passes, maxPending, rtsHolds, errors ? "FAILED" : "OK", errors);
+  return errors ? 1 : 0;
+}
@@ -0,0 +1,674 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include "StepperHubClient.h"
+
+namespace StepperHub {
+
+// see TELEMETRY_FRAME_SYNC and telemetry_fields in telemetry.h
+static const uint8_t FRAME_SYNC = 0xA5;
+// see controlTrace.h
+static const uint8_t TRACE_FRAME_SYNC = 0xA6;
+static const size_t TRACE_RECORD_SIZE = 24;
+// see rxCapture.h
+static const uint8_t CAPTURE_FRAME_SYNC = 0xA7;
+static const uint8_t TF_POSITION = 0x01;
+static const uint8_t TF_SPS = 0x02;
+static const uint8_t TF_STATUS = 0x04;
+
+static const char OVERFLOW_MSG[] = "!!! TX BUFFER OVERFLOW !!!";
+// the hub has __PARAM_COUNT - 2 values after "OK - X" for ".all"
+static const int32_t ALL_LINES = 8;
+
+static const char * PARAM_NAMES[] = {
+  "", ".all", ".targetPosition", ".currentPosition", ".minSPS", ".maxSPS",
+  ".currentSPS", ".accSPS", ".accPrescaler", ".status"
+};
+
+// Parses decimal (or 0x hex) number, skipping leading spaces, returns false if there is no number.
+static bool ParseNumber(const char * p, const char * end, int64_t & value) {
+  bool negative = false;
+  int64_t result = 0;
+
+  while (p < end && *p == ' ') p++;
+  if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+  if (end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+    const char * start = p += 2;
+    for (; p < end; p++) {
+      char c = *p;
+      if (c >= '0' && c <= '9') result = result * 16 + (c - '0');
+      else if (c >= 'A' && c <= 'F') result = result * 16 + (c - 'A' + 10);
+      else if (c >= 'a' && c <= 'f') result = result * 16 + (c - 'a' + 10);
+      else break;
+    }
+    if (p == start) return false;
+  } else {
+    const char * start = p;
+    for (; p < end && *p >= '0' && *p <= '9'; p++)
+      result = result * 10 + (*p - '0');
+    if (p == start) return false;
+  }
+
+  value = negative ? -result : result;
+  return true;
+}
+
+static bool StartsWith(const char * p, const char * end, const char * prefix) {
+  size_t length = strlen(prefix);
+  return (size_t)(end - p) >= length && memcmp(p, prefix, length) == 0;
+}
+
+// Number which goes after "<key> = " in the text
+static int64_t FindField(const char * begin, const char * end, const char * key, int64_t defaultValue) {
+  size_t keyLength = strlen(key);
+  int64_t value;
+
+  for (const char * p = begin; p + keyLength + 3 <= end; p++) {
+    if (memcmp(p, key, keyLength) == 0 && memcmp(p + keyLength, " = ", 3) == 0 &&
+        (p == begin || p[-1] == ' ' || p[-1] == '.') &&
+        ParseNumber(p + keyLength + 3, end, value))
+      return value;
+  }
+  return defaultValue;
+}
+
+// ========================================== //
+//    RESPONSE                                //
+// ========================================== //
+
+Response::Response() : status(STATUS_NORESPONSE), errorCode(0), value(0), length(0) {
+  text[0] = '\0';
+}
+
+int64_t Response::Field(const char * key, int64_t defaultValue) const {
+  return FindField(text.data(), text.data() + length, key, defaultValue);
+}
+
+// ========================================== //
+//    JITTER ANALYSIS                         //
+// ========================================== //
+
+JitterStats AnalyzeJitter(const JitterCapture & capture) {
+  JitterStats stats;
+  double tickNs = (capture.clock != 0) ? 1e9 / capture.clock : 0;
+  double sum = 0;
+  double sumSq = 0;
+  int32_t minDeviation = 0;
+  int32_t maxDeviation = 0;
+  int32_t maxCycleToCycle = 0;
+  std::vector<int32_t> errors;
+
+  stats.histogram.fill(0);
+  errors.reserve(capture.count);
+  for (size_t i = 0; i < capture.count; i++) {
+    int32_t deviation = capture.deviations[i];
+    int32_t bin = deviation + (int32_t)JITTER_HISTOGRAM_BINS / 2;
+
+    sum += deviation;
+    sumSq += (double)deviation * deviation;
+    if (i == 0 || deviation < minDeviation) minDeviation = deviation;
+    if (i == 0 || deviation > maxDeviation) maxDeviation = deviation;
+    if (i > 0 && abs(deviation - capture.deviations[i - 1]) > maxCycleToCycle)
+      maxCycleToCycle = abs(deviation - capture.deviations[i - 1]);
+    stats.histogram[std::min(std::max(bin, 0), (int32_t)JITTER_HISTOGRAM_BINS - 1)]++;
+    errors.push_back(abs(deviation));
+  }
+
+  double n = (capture.count != 0) ? (double)capture.count : 1;
+  double mean = sum / n;
+  std::sort(errors.begin(), errors.end());
+
+  stats.expected = capture.period * tickNs;
+  stats.mean = (capture.period + mean) * tickNs;
+  stats.stddev = sqrt(std::max(sumSq / n - mean * mean, 0.0)) * tickNs;
+  stats.min = ((int32_t)capture.period + minDeviation) * tickNs;
+  stats.max = ((int32_t)capture.period + maxDeviation) * tickNs;
+  stats.maxError = errors.empty() ? 0 : errors.back() * tickNs;
+  stats.p99Error = errors.empty() ? 0 : errors[std::min(errors.size() * 99 / 100, errors.size() - 1)] * tickNs;
+  stats.maxCycleToCycle = maxCycleToCycle * tickNs;
+  return stats;
+}
+
+// ========================================== //
+//    REQUESTS                                //
+// ========================================== //
+
+Client::Client(WriteFn write, size_t windowBytes) :
+  write(write), windowBytes(windowBytes), inFlightBytes(0), address(0), broadcast(false),
+  nextId(1), lastSentId(0), flushRequested(false), responseId(0), responseActive(false), responseLinesLeft(0), jitterActive(false), jitterLeft(0),
+  lineLength(0), lineOverflow(false), frameLength(0), inFrame(false) {
+}
+
+void Client::SetAddress(uint8_t address) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->address = address;
+}
+
+void Client::SetBroadcast(bool broadcast) {
+  std::lock_guard<std::mutex> lock(mutex);
+  this->broadcast = broadcast;
+}
+
+void Client::EncodePrefix(std::string & out, uint32_t id, bool tagged) {
+  if (broadcast) {
+    out += "@*";
+  } else if (address != 0) {
+    out += '@';
+    out += std::to_string(address);
+  }
+  if (tagged) {
+    out += '#';
+    out += std::to_string(id);
+  }
+}
+
+std::future<Response> Client::Enqueue(const char * command, char stepper, Param param, bool hasValue, int64_t value, int32_t lines) {
+  std::lock_guard<std::mutex> lock(mutex);
+  uint32_t id = broadcast ? 0 : nextId++;
+  Queued q;
+
+  q.id = id;
+  EncodePrefix(q.text, id, !broadcast);
+  q.text += command;
+  if (stepper != '\0') q.text += stepper;
+  q.text += PARAM_NAMES[param];
+  if (hasValue) {
+    q.text += ':';
+    q.text += std::to_string(value);
+  }
+  // line end terminates value-only requests (baud, address) and drops any garbage before the next one
+  q.text += '\n';
+
+  if (broadcast) {
+    std::promise<Response> promise;
+    promise.set_value(Response());
+    queued.push_back(q);
+    return promise.get_future();
+  }
+
+  Pending & p = pending[id];
+  p.id = id;
+  p.bytes = q.text.size();
+  p.lines = lines;
+  queued.push_back(q);
+  return p.promise.get_future();
+}
+
+std::future<Response> Client::Get(char stepper, Param param) {
+  return Enqueue("get", stepper, param, false, 0, (param == PARAM_ALL) ? ALL_LINES : 0);
+}
+
+std::future<Response> Client::Set(char stepper, Param param, int64_t value) {
+  return Enqueue("set", stepper, param, true, value, 0);
+}
+
+std::future<Response> Client::Set(char stepper, int32_t targetPosition) {
+  return Enqueue("set", stepper, PARAM_DEFAULT, true, targetPosition, 0);
+}
+
+std::future<Response> Client::Add(char stepper, Param param, int64_t value) {
+  return Enqueue("add", stepper, param, true, value, 0);
+}
+
+std::future<Response> Client::Add(char stepper, int32_t offset) {
+  return Enqueue("add", stepper, PARAM_DEFAULT, true, offset, 0);
+}
+
+std::future<Response> Client::Reset(char stepper, Param param) {
+  return Enqueue("reset", stepper, param, false, 0, (param == PARAM_ALL || param == PARAM_DEFAULT) ? ALL_LINES : 0);
+}
+
+std::future<Response> Client::Subscribe(char stepper, Param param, uint32_t periodMs) {
+  return Enqueue("subscribe", stepper, param, true, periodMs, 0);
+}
+
+std::future<Response> Client::Baud(uint32_t baudRate) {
+  return Enqueue("baud", '\0', PARAM_DEFAULT, baudRate != 0, baudRate, 0);
+}
+
+std::future<Response> Client::Address(int32_t address) {
+  return Enqueue("address", '\0', PARAM_DEFAULT, address >= 0, address, 0);
+}
+
+std::future<Response> Client::Save(int32_t delayMs) {
+  return Enqueue("save", '\0', PARAM_DEFAULT, delayMs >= 0, delayMs, 0);
+}
+
+std::future<Response> Client::Profile(int32_t profile) {
+  return Enqueue("profile", '\0', PARAM_DEFAULT, profile >= 0, profile, 0);
+}
+
+std::future<Response> Client::Jitter(char stepper, uint32_t samples) {
+  return Enqueue("jitter", stepper, PARAM_DEFAULT, samples > 0, samples, 0);
+}
+
+std::future<Response> Client::Load(bool reset) {
+  // per handler line goes after the totals
+  return Enqueue("load", '\0', PARAM_DEFAULT, reset, 1, reset ? 0 : 1);
+}
+
+std::future<Response> Client::Trace(bool clear) {
+  return Enqueue("trace", '\0', PARAM_DEFAULT, clear, 1, 0);
+}
+
+std::future<Response> Client::Capture(int32_t mode) {
+  return Enqueue("capture", '\0', PARAM_DEFAULT, mode >= 0, mode, 0);
+}
+
+std::future<Response> Client::Sync() {
+  return Enqueue("sync", '\0', PARAM_DEFAULT, false, 0, 0);
+}
+
+std::future<Response> Client::Move(const std::vector<Target> & targets) {
+  std::lock_guard<std::mutex> lock(mutex);
+  std::set<char> steppers;
+  uint32_t beginId = broadcast ? 0 : nextId++;
+  uint32_t commitId = broadcast ? 0 : nextId++;
+  Queued q;
+
+  q.id = commitId;
+  EncodePrefix(q.text, beginId, !broadcast);
+  q.text += "begin\n";
+  // staged requests are not answered, so they go without tags
+  for (size_t i = 0; i < targets.size(); i++) {
+    EncodePrefix(q.text, 0, false);
+    q.text += targets[i].relative ? "add" : "set";
+    q.text += targets[i].stepper;
+    q.text += ':';
+    q.text += std::to_string(targets[i].value);
+    q.text += '\n';
+    steppers.insert(targets[i].stepper);
+  }
+  EncodePrefix(q.text, commitId, !broadcast);
+  q.text += "commit\n";
+  queued.push_back(q);
+
+  if (broadcast) {
+    std::promise<Response> promise;
+    promise.set_value(Response());
+    return promise.get_future();
+  }
+
+  // "begin" response is just consumed
+  Pending & begin = pending[beginId];
+  begin.id = beginId;
+  begin.bytes = 0;
+  begin.lines = 0;
+
+  Pending & commit = pending[commitId];
+  commit.id = commitId;
+  commit.bytes = q.text.size();
+  commit.lines = (int32_t)steppers.size();
+  return commit.promise.get_future();
+}
+
+void Client::Flush() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    flushRequested = true;
+  }
+  Pump();
+}
+
+void Client::Pump() {
+  std::lock_guard<std::mutex> writeLock(writeMutex);
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!flushRequested)
+      return;
+
+    writeBuffer.clear();
+    while (!queued.empty()) {
+      Queued & q = queued.front();
+      // the window may only be exceeded by a single request, otherwise it would never go
+      if (inFlightBytes > 0 && inFlightBytes + q.text.size() > windowBytes)
+        break;
+      if (q.id != 0) {
+        inFlightBytes += q.text.size();
+        lastSentId = q.id;
+      }
+      writeBuffer += q.text;
+      queued.pop_front();
+    }
+    if (queued.empty())
+      flushRequested = false;
+  }
+  // single write for the whole batch, the hub decodes it on the fly
+  if (!writeBuffer.empty())
+    write((const uint8_t *)writeBuffer.data(), writeBuffer.size());
+}
+
+size_t Client::InFlight() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return std::distance(pending.begin(), pending.upper_bound(lastSentId));
+}
+
+void Client::OnStop(StopFn handler) {
+  std::lock_guard<std::mutex> lock(mutex);
+  stopHandler = handler;
+}
+
+void Client::OnTelemetry(TelemetryFn handler) {
+  std::lock_guard<std::mutex> lock(mutex);
+  telemetryHandler = handler;
+}
+
+void Client::OnJitter(JitterFn handler) {
+  std::lock_guard<std::mutex> lock(mutex);
+  jitterHandler = handler;
+}
+
+void Client::OnTrace(TraceFn handler) {
+  std::lock_guard<std::mutex> lock(mutex);
+  traceHandler = handler;
+}
+
+void Client::OnCapture(CaptureFn handler) {
+  std::lock_guard<std::mutex> lock(mutex);
+  captureHandler = handler;
+}
+
+void Client::OnOverflow(OverflowFn handler) {
+  std::lock_guard<std::mutex> lock(mutex);
+  overflowHandler = handler;
+}
+
+// ========================================== //
+//    RESPONSES                               //
+// ========================================== //
+
+void Client::Receive(const uint8_t * data, size_t length) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t i = 0; i < length; i++)
+      DecodeByte(data[i]);
+  }
+  // some window might have been freed
+  Pump();
+}
+
+void Client::DecodeByte(uint8_t data) {
+  if (inFrame) {
+    frame[frameLength++] = data;
+    // sync, length, <length> bytes, checksum
+    if (frameLength >= 2 && frameLength == (size_t)frame[1] + 3) {
+      DecodeFrame();
+      inFrame = false;
+    }
+    return;
+  }
+
+  // binary frames go only between the responses, never inside of them
+  if (lineLength == 0 && (data == FRAME_SYNC || data == TRACE_FRAME_SYNC || data == CAPTURE_FRAME_SYNC)) {
+    inFrame = true;
+    frame[0] = data;
+    frameLength = 1;
+    return;
+  }
+
+  if (data == '\n') {
+    if (!lineOverflow)
+      DecodeLine();
+    lineLength = 0;
+    lineOverflow = false;
+    return;
+  }
+
+  if (data == '\r')
+    return;
+
+  if (lineLength < line.size())
+    line[lineLength++] = (char)data;
+  else
+    lineOverflow = true;
+}
+
+void Client::DecodeFrame() {
+  TelemetryFrame f;
+  uint8_t checksum = 0;
+  size_t end = frameLength - 1;
+  size_t i;
+
+  for (i = 0; i < end; i++)
+    checksum += frame[i];
+  if (checksum != frame[end])
+    return;
+  if (frame[0] == TRACE_FRAME_SYNC) {
+    DecodeTraceFrame();
+    return;
+  }
+  if (frame[0] == CAPTURE_FRAME_SYNC) {
+    DecodeCaptureFrame();
+    return;
+  }
+  if (end < 8)
+    return;
+
+  memcpy(&f.tick, &frame[2], 4);
+  memcpy(&f.dropped, &frame[6], 2);
+  f.count = 0;
+
+  for (i = 8; i + 2 <= end && f.count < MAX_TELEMETRY_STEPPERS; ) {
+    TelemetryRecord & r = f.records[f.count++];
+    r.stepper = (char)frame[i++];
+    r.fields = frame[i++];
+    r.position = r.sps = 0;
+    r.status = 0;
+    if ((r.fields & TF_POSITION) && i + 4 <= end) { memcpy(&r.position, &frame[i], 4); i += 4; }
+    if ((r.fields & TF_SPS) && i + 4 <= end)      { memcpy(&r.sps, &frame[i], 4); i += 4; }
+    if ((r.fields & TF_STATUS) && i + 1 <= end)   { r.status = frame[i++]; }
+  }
+
+  if (telemetryHandler)
+    telemetryHandler(f);
+}
+
+void Client::DecodeLine() {
+  const char * p = line.data();
+  const char * end = p + lineLength;
+  int64_t number;
+  uint32_t id = 0;
+  bool tagged = false;
+
+  // overflow message goes with no line end, right before whatever comes next
+  if (StartsWith(p, end, OVERFLOW_MSG)) {
+    p += sizeof(OVERFLOW_MSG) - 1;
+    if (overflowHandler)
+      overflowHandler();
+  }
+
+  if (p < end && *p == '\t' && jitterActive) {
+    DecodeJitterLine(p + 1, end);
+    return;
+  }
+
+  if (p < end && *p == '\t') {
+    // continuation of the multi-line response
+    if (!responseActive)
+      return;
+    if (response.length + 2 + (end - p) <= MAX_RESPONSE_LENGTH) {
+      memcpy(&response.text[response.length], "\r\n", 2);
+      memcpy(&response.text[response.length + 2], p, end - p);
+      response.length += 2 + (end - p);
+      response.text[response.length] = '\0';
+    }
+    if (--responseLinesLeft <= 0)
+      CompleteResponse();
+    return;
+  }
+
+  // anything else means that the previous response is over (even if some lines are missing)
+  if (responseActive)
+    CompleteResponse();
+  jitterActive = false;
+
+  if (p < end && *p == '@') {
+    // on the bus, ignore the other hubs
+    if (!ParseNumber(p + 1, end, number) || number != address)
+      return;
+    p = (const char *)memchr(p, ' ', end - p);
+    if (p == NULL)
+      return;
+    p++;
+  }
+
+  if (p < end && *p == '#') {
+    if (!ParseNumber(p + 1, end, number))
+      return;
+    id = (uint32_t)number;
+    tagged = true;
+    p = (const char *)memchr(p, ' ', end - p);
+    if (p == NULL)
+      return;
+    p++;
+  }
+
+  if (!tagged) {
+    // "X.stop:100" event
+    if (end - p > 6 && memcmp(p + 1, ".stop:", 6) == 0 && ParseNumber(p + 7, end, number)) {
+      if (stopHandler)
+        stopHandler(p[0], (int32_t)number);
+    }
+    // "X.jitter: N = 256 ..." event, followed by the lines of deviations
+    if (end - p > 8 && memcmp(p + 1, ".jitter:", 8) == 0) {
+      jitter.stepper   = p[0];
+      jitter.requested = (uint32_t)FindField(p, end, "REQUESTED", 0);
+      jitter.clock     = (uint32_t)FindField(p, end, "CLOCK", 0);
+      jitter.sps       = (uint32_t)FindField(p, end, "SPS", 0);
+      jitter.period    = (uint32_t)FindField(p, end, "PERIOD", 0);
+      jitter.count     = 0;
+      number = FindField(p, end, "N", 0);
+      jitterLeft = (number < 0) ? 0 : (number > (int64_t)MAX_JITTER_SAMPLES) ? MAX_JITTER_SAMPLES : (size_t)number;
+      jitterActive = true;
+      if (jitterLeft == 0)
+        DecodeJitterLine(end, end);
+    }
+    return;
+  }
+
+  // responses come in order, so whatever has been sent before and is not answered - is lost
+  FailEarlierThan(id);
+
+  std::map<uint32_t, Pending>::iterator it = pending.find(id);
+  if (it == pending.end())
+    return;
+
+  Response & r = response;
+  r.length = (size_t)(end - p) < MAX_RESPONSE_LENGTH ? (size_t)(end - p) : MAX_RESPONSE_LENGTH;
+  memcpy(r.text.data(), p, r.length);
+  r.text[r.length] = '\0';
+  r.errorCode = 0;
+  r.value = 0;
+
+  if (StartsWith(p, end, "OK - ")) {
+    r.status = STATUS_OK;
+  } else if (StartsWith(p, end, "LIMIT - ")) {
+    r.status = STATUS_LIMIT;
+  } else {
+    r.status = STATUS_ERROR;
+    if (StartsWith(p, end, "ERROR - ") && ParseNumber(p + 8, end, number))
+      r.errorCode = (int32_t)number;
+    r.value = r.errorCode;
+  }
+
+  if (r.status != STATUS_ERROR) {
+    const char * eq = NULL;
+    for (const char * c = p; c + 3 <= end; c++) {
+      if (memcmp(c, " = ", 3) == 0) { eq = c + 3; break; }
+    }
+    if (eq != NULL && ParseNumber(eq, end, number))
+      r.value = number;
+  }
+
+  responseId = id;
+  responseActive = true;
+  responseLinesLeft = (r.status == STATUS_OK) ? it->second.lines : 0;
+  if (responseLinesLeft <= 0)
+    CompleteResponse();
+}
+
+void Client::DecodeTraceFrame() {
+  TraceFrame f;
+  size_t end = frameLength - 1;
+
+  if (end < 6)
+    return;
+  memcpy(&f.index, &frame[2], 4);
+  f.count = 0;
+
+  for (size_t i = 6; i + TRACE_RECORD_SIZE <= end && f.count < MAX_TRACE_RECORDS_PER_FRAME; i += TRACE_RECORD_SIZE) {
+    TraceRecord & r = f.records[f.count++];
+    memcpy(&r.tick, &frame[i], 4);
+    r.stepper    = (char)frame[i + 4];
+    r.event      = frame[i + 5];
+    r.fromStatus = frame[i + 6];
+    r.toStatus   = frame[i + 7];
+    memcpy(&r.currentSPS, &frame[i + 8], 4);
+    memcpy(&r.stepsToTarget, &frame[i + 12], 4);
+    memcpy(&r.estimatedTime, &frame[i + 16], 4);
+    memcpy(&r.requiredTime, &frame[i + 20], 4);
+  }
+
+  if (traceHandler)
+    traceHandler(f);
+}
+
+void Client::DecodeCaptureFrame() {
+  uint32_t offset;
+  size_t end = frameLength - 1;
+
+  if (end < 6)
+    return;
+  memcpy(&offset, &frame[2], 4);
+
+  if (captureHandler)
+    captureHandler(offset, &frame[6], end - 6);
+}
+
+void Client::DecodeJitterLine(const char * p, const char * end) {
+  int64_t number;
+
+  while (jitterLeft > 0 && p < end && ParseNumber(p, end, number)) {
+    jitter.deviations[jitter.count++] = (int16_t)number;
+    jitterLeft--;
+    // skip the number just parsed
+    while (p < end && *p == ' ') p++;
+    if (p < end && (*p == '-' || *p == '+')) p++;
+    while (p < end && *p >= '0' && *p <= '9') p++;
+  }
+
+  if (jitterLeft == 0) {
+    jitterActive = false;
+    if (jitterHandler)
+      jitterHandler(jitter);
+  }
+}
+
+void Client::CompleteResponse() {
+  std::map<uint32_t, Pending>::iterator it = pending.find(responseId);
+
+  responseActive = false;
+  if (it == pending.end())
+    return;
+
+  inFlightBytes -= (it->second.bytes < inFlightBytes) ? it->second.bytes : inFlightBytes;
+  it->second.promise.set_value(response);
+  pending.erase(it);
+}
+
+void Client::FailEarlierThan(uint32_t id) {
+  while (!pending.empty() && pending.begin()->first < id) {
+    Pending & p = pending.begin()->second;
+    Response lost;
+    lost.status = STATUS_LOST;
+    inFlightBytes -= (p.bytes < inFlightBytes) ? p.bytes : inFlightBytes;
+    p.promise.set_value(lost);
+    pending.erase(pending.begin());
+  }
+}
+
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+// Host side client for StepperHub UART protocol (see MDK-ARM/stepperCommands.c).
+//
+// The client doesn't own the serial port, it only encodes requests and decodes the incoming stream:
+//  - requests are written through WriteFn (called from Flush() and Receive()),
+//  - everything read from the port must be passed to Receive().
+//
+// Every request gets a tag ("#<id>"), so its response is matched to the future returned by the request method.
+// Requests are queued and sent by Flush() as a single write, pipelined up to windowBytes in flight
+// (the hub RX buffer is 8 kB, so keep the window below that if hardware flow control is not used).
+// Responses come in the same order the requests have been sent, so when a tagged response arrives,
+// all the requests sent before it and still not answered are lost (TX overflow) - they complete with STATUS_LOST.
+//
+// Receive() doesn't allocate, responses are decoded into fixed size buffers.
+// Handlers (OnStop, OnTelemetry, OnJitter, OnTrace, OnCapture, OnOverflow) are invoked from Receive() with the client locked,
+// so they must not call the client back.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <array>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace StepperHub {
+
+enum Param {
+  PARAM_DEFAULT = 0,          // whatever the command takes by default (targetPosition for set/add, currentPosition for get)
+  PARAM_ALL,
+  PARAM_TARGETPOSITION,
+  PARAM_CURRENTPOSITION,
+  PARAM_MINSPS,
+  PARAM_MAXSPS,
+  PARAM_CURRENTSPS,
+  PARAM_ACCSPS,
+  PARAM_ACCPRESCALER,
+  PARAM_STATUS
+};
+
+enum Status {
+  STATUS_OK = 0,
+  STATUS_LIMIT,               // value has been limited, Response::value is the one which has been applied
+  STATUS_ERROR,               // Response::errorCode is stepper_command_error
+  STATUS_LOST,                // response has been lost (hub TX overflow), the request might be executed or not
+  STATUS_NORESPONSE           // broadcast request, never answered
+};
+
+// Max response length of the hub (MAX_RESPONSE_LENGTH) without the prefixes
+static const size_t MAX_RESPONSE_LENGTH = 384;
+static const size_t MAX_TELEMETRY_STEPPERS = 10;
+// JITTER_MAX_SAMPLES of the hub
+static const size_t MAX_JITTER_SAMPLES = 1024;
+static const size_t JITTER_HISTOGRAM_BINS = 33;
+// TRACE_RECORDS_PER_FRAME of the hub
+static const size_t MAX_TRACE_RECORDS_PER_FRAME = 10;
+
+struct Response {
+  Status    status;
+  int32_t   errorCode;
+  // the first number after " = " (or the error code), e.g. 100 for "OK - X.TARGETPOSITION = 100"
+  int64_t   value;
+  // response text without tag/address prefixes, continuation lines are included (separated with "\r\n\t")
+  std::array<char, MAX_RESPONSE_LENGTH + 1> text;
+  size_t    length;
+
+  Response();
+  // Number which goes after "<key> = " in the text, e.g. Field("RX") for "sync" response.
+  // Returns defaultValue if there is no such key.
+  int64_t Field(const char * key, int64_t defaultValue = 0) const;
+};
+
+struct TelemetryRecord {
+  char      stepper;
+  uint8_t   fields;           // telemetry_fields mask, tells which of the values below are present
+  int32_t   position;
+  int32_t   sps;
+  uint8_t   status;
+};
+
+struct TelemetryFrame {
+  uint32_t  tick;
+  uint16_t  dropped;
+  size_t    count;
+  TelemetryRecord records[MAX_TELEMETRY_STEPPERS];
+};
+
+// Stepper controller decision, see trace_record in controlTrace.h
+struct TraceRecord {
+  uint32_t  tick;
+  char      stepper;
+  uint8_t   event;            // trace_event
+  uint8_t   fromStatus;
+  uint8_t   toStatus;
+  int32_t   currentSPS;
+  int32_t   stepsToTarget;
+  float     estimatedTime;    // seconds
+  float     requiredTime;
+};
+
+struct TraceFrame {
+  uint32_t  index;            // index of the first record since the trace has been cleared
+  size_t    count;
+  TraceRecord records[MAX_TRACE_RECORDS_PER_FRAME];
+};
+
+// "X.jitter:" event - step periods captured by the hub (see "STEP JITTER")
+struct JitterCapture {
+  char      stepper;
+  uint32_t  requested;
+  uint32_t  count;
+  uint32_t  clock;            // capture timer clock, Hz
+  uint32_t  sps;              // commanded speed
+  uint32_t  period;           // commanded period, clock ticks
+  // every captured period minus the commanded one, clock ticks
+  std::array<int16_t, MAX_JITTER_SAMPLES> deviations;
+};
+
+struct JitterStats {
+  // periods, nanoseconds
+  double    expected;
+  double    mean;
+  double    stddev;
+  double    min;
+  double    max;
+  // max |period - expected|, and 99th percentile of it
+  double    maxError;
+  double    p99Error;
+  // max difference of two consecutive periods (cycle-to-cycle jitter)
+  double    maxCycleToCycle;
+  // deviation histogram, bin i counts the deviations of (i - JITTER_HISTOGRAM_BINS/2) ticks, the edge bins take everything beyond
+  std::array<uint32_t, JITTER_HISTOGRAM_BINS> histogram;
+};
+
+JitterStats AnalyzeJitter(const JitterCapture & capture);
+
+struct Target {
+  char      stepper;
+  int32_t   value;
+  bool      relative;         // "add" instead of "set"
+};
+
+class Client {
+public:
+  typedef std::function<void(const uint8_t * data, size_t length)> WriteFn;
+  typedef std::function<void(char stepper, int32_t position)> StopFn;
+  typedef std::function<void(const TelemetryFrame & frame)> TelemetryFn;
+  typedef std::function<void(const JitterCapture & capture)> JitterFn;
+  typedef std::function<void(const TraceFrame & frame)> TraceFn;
+  // a piece of RX capture (see rxCapture.h), offset - since the capture start
+  typedef std::function<void(uint32_t offset, const uint8_t * data, size_t length)> CaptureFn;
+  typedef std::function<void(void)> OverflowFn;
+
+  explicit Client(WriteFn write, size_t windowBytes = 4096);
+
+  // Hub bus address (see "BUS ADDRESSING"), 0 - point-to-point link.
+  // Requests go with "@<address>" prefix, and responses from the other hubs are ignored.
+  void SetAddress(uint8_t address);
+  // Next requests go to all the hubs on the bus (and are never answered) until SetBroadcast(false).
+  void SetBroadcast(bool broadcast);
+
+  std::future<Response> Get(char stepper, Param param = PARAM_DEFAULT);
+  std::future<Response> Set(char stepper, Param param, int64_t value);
+  std::future<Response> Set(char stepper, int32_t targetPosition);
+  std::future<Response> Add(char stepper, Param param, int64_t value);
+  std::future<Response> Add(char stepper, int32_t offset);
+  std::future<Response> Reset(char stepper, Param param = PARAM_ALL);
+  std::future<Response> Subscribe(char stepper, Param param, uint32_t periodMs);
+  std::future<Response> Baud(uint32_t baudRate = 0);
+  std::future<Response> Address(int32_t address = -1);
+  // delayMs < 0 - writes pending config changes to FLASH, otherwise sets the save delay
+  std::future<Response> Save(int32_t delayMs = -1);
+  // profile < 0 - returns the active motion profile, otherwise switches all the steppers to it
+  std::future<Response> Profile(int32_t profile = -1);
+  // CPU load since the last reset (see "CPU LOAD"), reset - starts a new window instead
+  std::future<Response> Load(bool reset = false);
+  // Dumps the controller trace (see "CONTROLLER TRACE") to OnTrace handler, clear - drops it instead
+  std::future<Response> Trace(bool clear = false);
+  // RX capture (see "RX CAPTURE"): mode < 0 - dumps it to OnCapture handler, 0 - stops it, otherwise starts the recording
+  std::future<Response> Capture(int32_t mode = -1);
+  // Arms the step jitter capture of samples periods (0 - hub default), the result goes to OnJitter handler.
+  std::future<Response> Jitter(char stepper, uint32_t samples = 0);
+  std::future<Response> Sync();
+  // Sends "begin", all the targets and "commit" in one batch, the future gets "commit" response.
+  std::future<Response> Move(const std::vector<Target> & targets);
+
+  // Sends queued requests (as many as the window allows, the rest goes as responses arrive).
+  void Flush();
+  // Decodes the data received from the port, completes the futures and invokes the handlers.
+  void Receive(const uint8_t * data, size_t length);
+
+  void OnStop(StopFn handler);
+  void OnTelemetry(TelemetryFn handler);
+  void OnJitter(JitterFn handler);
+  void OnTrace(TraceFn handler);
+  void OnCapture(CaptureFn handler);
+  void OnOverflow(OverflowFn handler);
+
+  // Number of requests sent and not answered yet.
+  size_t InFlight();
+
+private:
+  struct Pending {
+    uint32_t  id;
+    size_t    bytes;
+    // continuation lines expected after "OK" first line
+    int32_t   lines;
+    std::promise<Response> promise;
+  };
+
+  struct Queued {
+    uint32_t  id;
+    std::string text;
+  };
+
+  std::future<Response> Enqueue(const char * command, char stepper, Param param, bool hasValue, int64_t value, int32_t lines);
+  void EncodePrefix(std::string & out, uint32_t id, bool tagged);
+  void Pump();
+  void DecodeByte(uint8_t data);
+  void DecodeLine();
+  void DecodeFrame();
+  void DecodeTraceFrame();
+  void DecodeCaptureFrame();
+  void DecodeJitterLine(const char * p, const char * end);
+  void CompleteResponse();
+  void FailEarlierThan(uint32_t id);
+
+  WriteFn   write;
+  StopFn    stopHandler;
+  TelemetryFn telemetryHandler;
+  JitterFn  jitterHandler;
+  TraceFn   traceHandler;
+  CaptureFn captureHandler;
+  OverflowFn overflowHandler;
+
+  size_t    windowBytes;
+  size_t    inFlightBytes;
+  uint8_t   address;
+  bool      broadcast;
+  uint32_t  nextId;
+  uint32_t  lastSentId;
+  bool      flushRequested;
+
+  std::deque<Queued> queued;
+  std::map<uint32_t, Pending> pending;
+  std::string writeBuffer;
+
+  // response being assembled
+  Response  response;
+  uint32_t  responseId;
+  bool      responseActive;
+  int32_t   responseLinesLeft;
+
+  // jitter event being assembled
+  JitterCapture jitter;
+  bool      jitterActive;
+  size_t    jitterLeft;
+
+  // decoder state
+  std::array<char, MAX_RESPONSE_LENGTH + 64> line;
+  size_t    lineLength;
+  bool      lineOverflow;
+  std::array<uint8_t, 3 + 255> frame;
+  size_t    frameLength;
+  bool      inFrame;
+
+  std::mutex mutex;
+  std::mutex writeMutex;
+};
+
+}
@@ -0,0 +1,84 @@
+// Decodes the controller trace (see "CONTROLLER TRACE" in MDK-ARM/stepperCommands.c) from the raw bytes received
+// from the hub after "trace" request, and prints the records as CSV.
+//
+//   g++ -std=c++11 Host/TraceDecoder.cpp Host/StepperHubClient.cpp -lpthread -o tracedecoder
+//   tracedecoder capture.bin [controllerPeriodUs] > trace.csv
+//
+// Text responses and telemetry frames in the capture are skipped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "StepperHubClient.h"
+
+// see trace_event in controlTrace.h
+static const char * EventName(uint8_t event) {
+  switch (event) {
+    case 1:  return "START";
+    case 2:  return "ACCELERATE";
+    case 3:  return "BRAKE";
+    case 4:  return "DECELERATE";
+    case 5:  return "BRAKECORRECTION";
+    default: return "UNKNOWN";
+  }
+}
+
+// see stepper_status in stepperController.h
+static void PrintStatus(uint8_t status) {
+  static const struct { uint8_t flag; const char * name; } flags[] = {
+    { 0x01, "BACKWARD" }, { 0x02, "FORWARD" }, { 0x04, "STARTING" },
+    { 0x10, "BREAKING" }, { 0x20, "BREAKCORRECTION" }, { 0x80, "STOPPED" }
+  };
+  const char * separator = "";
+
+  for (size_t i = 0; i < sizeof(flags) / sizeof(flags[0]); i++) {
+    if (status & flags[i].flag) {
+      printf("%s%s", separator, flags[i].name);
+      separator = "|";
+    }
+  }
+}
+
+int main(int argc, char ** argv) {
+  FILE * file;
+  uint8_t buffer[4096];
+  size_t length;
+  double periodUs = 50;
+  uint32_t expectedIndex = 0;
+  bool first = true;
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <capture> [controllerPeriodUs]\n", argv[0]);
+    return 1;
+  }
+  file = fopen(argv[1], "rb");
+  if (file == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  if (argc > 2)
+    periodUs = atof(argv[2]);
+
+  StepperHub::Client client([](const uint8_t *, size_t) {});
+  client.OnTrace([&](const StepperHub::TraceFrame & frame) {
+    // a frame lost on the way (or the capture started in the middle) leaves a gap in the indices
+    if (!first && frame.index != expectedIndex)
+      fprintf(stderr, "records %u..%u are missing\n", expectedIndex, frame.index - 1);
+    first = false;
+    expectedIndex = frame.index + (uint32_t)frame.count;
+
+    for (size_t i = 0; i < frame.count; i++) {
+      const StepperHub::TraceRecord & r = frame.records[i];
+      printf("%u,%u,%.3f,%c,%s,", frame.index + (uint32_t)i, r.tick, r.tick * periodUs / 1000.0, r.stepper, EventName(r.event));
+      PrintStatus(r.fromStatus);
+      printf(",");
+      PrintStatus(r.toStatus);
+      printf(",%d,%d,%.0f,%.0f\n", r.currentSPS, r.stepsToTarget, r.estimatedTime * 1e6, r.requiredTime * 1e6);
+    }
+  });
+
+  printf("index,tick,ms,stepper,event,from,to,currentSPS,stepsToTarget,estimatedUs,requiredUs\n");
+  while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    client.Receive(buffer, length);
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,74 @@
+#ifndef __CONTROLTRACE_H
+#define __CONTROLTRACE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stepperController.h"
+
+// Uncomment to log the stepper controller decisions into RAM ring (see "trace" request in stepperCommands.c).
+// When commented out, TRACE_DECISION is empty - no overhead at all.
+//#define CONTROL_TRACE
+
+// Must be a power of 2
+#define TRACE_RECORDS             512
+// Trace frames are binary like telemetry ones, but have their own sync byte
+#define TRACE_FRAME_SYNC          0xA6
+#define TRACE_RECORDS_PER_FRAME   10
+
+typedef enum {
+  TE_START            = 1,    // STOPPED -> STARTING, target is away
+  TE_ACCELERATE       = 2,    // currentSPS incremented
+  TE_BRAKE            = 3,    // estimated time to target <= time required to reduce the speed, braking is started
+  TE_DECELERATE       = 4,    // currentSPS decremented while braking
+  TE_BRAKECORRECTION  = 5     // braking has been overestimated, rolling at the current speed
+} trace_event;
+
+// 24 bytes, little-endian, goes to the frames as is
+typedef struct {
+  uint32_t  tick;             // controller timer ticks since the trace has been cleared
+  char      stepper;
+  uint8_t   event;            // trace_event
+  uint8_t   fromStatus;       // stepper_status before the decision
+  uint8_t   toStatus;         // and after it
+  int32_t   currentSPS;       // after the decision
+  int32_t   stepsToTarget;
+  // time to target at the average of currentSPS and minSPS, and time required to reduce the speed down to minSPS,
+  // seconds (IEEE 754 single), both are 0 when the braking check hasn't been done for the decision
+  float     estimatedTime;
+  float     requiredTime;
+} trace_record;
+
+/*
+FRAME STRUCTURE (little-endian)
+
+    uint8_t       sync      - TRACE_FRAME_SYNC
+    uint8_t       length    - number of bytes from "index" till the end of the last record
+    uint32_t      index     - index of the first record in the frame (since the trace has been cleared)
+    trace_record  records[] - up to TRACE_RECORDS_PER_FRAME records
+    uint8_t       checksum  - 8-bit sum of all the preceding frame bytes (including sync)
+*/
+
+#if defined(CONTROL_TRACE)
+
+// Controller decision (in the controller interrupt only - the ring has a single writer)
+#define TRACE_DECISION(stepper, event, fromStatus, estimatedTime, requiredTime) \
+          ControlTrace_Record((stepper), (event), (fromStatus), (estimatedTime), (requiredTime))
+
+void ControlTrace_Init(void);
+void ControlTrace_Record(stepper_state * stepper, trace_event event, uint8_t fromStatus, float estimatedTime, float requiredTime);
+// Stops the recording and starts sending the ring content (oldest first) as frames, recording resumes once it is sent.
+// Returns the number of records to be sent, total - number of records since the trace has been cleared.
+uint32_t ControlTrace_StartDump(uint32_t * total);
+// Sends the frames of the dump being in progress while there is bulk TX space, must be invoked from the main loop.
+// Returns true if there has been anything to send.
+bool ControlTrace_SendPending(void);
+// Drops everything recorded so far (and the dump in progress), the record ticks start from 0.
+void ControlTrace_Clear(void);
+
+#else
+
+#define TRACE_DECISION(stepper, event, fromStatus, estimatedTime, requiredTime)
+
+#endif
+
+#endif /* __CONTROLTRACE_H */
@@ -0,0 +1,106 @@
+#ifndef __ISRPROFILER_H
+#define __ISRPROFILER_H
+
+#include <stdint.h>
+#include "stm32f4xx_hal.h"
+
+// Uncomment to measure the interrupt handlers with DWT cycle counter (see "isr" and "load" requests in stepperCommands.c).
+// When commented out, ISR_PROFILE_BEGIN/ISR_PROFILE_END/MAIN_PROFILE are empty - no overhead at all.
+//#define ISR_PROFILING
+
+typedef enum {
+  ISR_TIM1      = 0,    // X step timer
+  ISR_TIM2      = 1,    // Y step timer
+  ISR_TIM3      = 2,    // Z step timer
+  ISR_TIM14     = 3,    // stepper controller timer
+  ISR_DMA_RX    = 4,    // USART2 RX DMA stream
+  ISR_DMA_TX    = 5,    // USART2 TX DMA stream
+  ISR_USART2    = 6,
+  __ISR_COUNT   = 7
+} isr_source;
+
+// Main loop work, only the calls which have done something count (the rest is idle polling)
+typedef enum {
+  MAIN_DECODE   = 0,    // requests decoding and execution, including the responses
+  MAIN_OTHER    = 1,    // stop events, telemetry frames, config saving
+  __MAIN_COUNT  = 2
+} main_section;
+
+// Histogram bucket N counts the values of 2^(N-1) .. 2^N-1 CPU cycles (bucket 0 - zero), the last one takes everything above
+#define ISR_HISTOGRAM_BUCKETS 16
+// Latency of the interrupts which have no timer counter to derive it from
+#define ISR_LATENCY_UNKNOWN   0xFFFFFFFF
+
+typedef struct {
+  uint32_t  count;
+  // CPU cycles from the timer update event till the handler has read the counter
+  uint32_t  maxLatency;
+  uint32_t  latency[ISR_HISTOGRAM_BUCKETS];
+  // CPU cycles spent in the handler, including the higher priority handlers which have preempted it
+  uint32_t  maxDuration;
+  uint32_t  duration[ISR_HISTOGRAM_BUCKETS];
+  // CPU cycles spent in the handler itself, without the higher priority handlers (since the last load reset)
+  uint64_t  cycles;
+} isr_stats;
+
+// CPU cycles since the last load reset, and how much of them the main loop has spent on the work
+typedef struct {
+  uint64_t  window;
+  uint64_t  main[__MAIN_COUNT];
+} cpu_load;
+
+#if defined(ISR_PROFILING)
+
+// CPU cycles spent in all the profiled handlers (wraps), so a handler (or main loop call) knows how much it has been preempted for
+extern volatile uint32_t isrProfileCycles;
+
+// Must go first in the handler. latency - CPU cycles since the interrupt event (or ISR_LATENCY_UNKNOWN),
+// step and controller timers are clocked at HCLK (TIMPRE), so their counters give it (see the functions below).
+#define ISR_PROFILE_BEGIN(latency)  uint32_t isrProfileStart = DWT->CYCCNT; uint32_t isrProfileLatency = (latency); \
+                                    uint32_t isrProfilePreempted = isrProfileCycles
+#define ISR_PROFILE_END(source)     IsrProfiler_Record((source), isrProfileLatency, isrProfileStart, isrProfilePreempted)
+
+// Latency of a step timer update: they count down from ARR, and every count takes PSC+1 cycles (PSC > 0 at low speeds).
+// ARR/PSC are preloaded, so once the controller has written the next period, they don't tell where the counter has started from.
+// The counter above ARR is the only sure sign of that, such a sample is dropped rather than taken as a huge latency.
+__STATIC_INLINE uint32_t IsrProfiler_DownCounterLatency(TIM_TypeDef * tim) {
+  uint32_t cnt = tim->CNT;
+  uint32_t arr = tim->ARR;
+  return (cnt > arr) ? ISR_LATENCY_UNKNOWN : (arr - cnt) * (tim->PSC + 1);
+}
+
+// Latency of the controller timer update, it counts up from 0
+__STATIC_INLINE uint32_t IsrProfiler_UpCounterLatency(TIM_TypeDef * tim) {
+  return tim->CNT * (tim->PSC + 1);
+}
+
+// Accounts the main loop call to the section if it returns true (has done something).
+#define MAIN_PROFILE(section, call) do { uint32_t mainProfileStart = DWT->CYCCNT; uint32_t mainProfilePreempted = isrProfileCycles; \
+                                         if (call) IsrProfiler_RecordMain((section), mainProfileStart, mainProfilePreempted); } while (0)
+// Must be invoked on every main loop pass, keeps the load window running (DWT counter wraps in 21 s at 200 MHz).
+#define MAIN_PROFILE_PASS()         IsrProfiler_UpdateWindow()
+
+// Enables DWT cycle counter, must be invoked before the interrupts are enabled.
+void IsrProfiler_Init(void);
+void IsrProfiler_Record(isr_source source, uint32_t latency, uint32_t start, uint32_t preempted);
+void IsrProfiler_RecordMain(main_section section, uint32_t start, uint32_t preempted);
+void IsrProfiler_UpdateWindow(void);
+// Statistics are updated by the interrupts, so the reader may see a handler record half-done (good enough for diagnostics).
+const isr_stats * IsrProfiler_GetStats(isr_source source);
+const char * IsrProfiler_GetName(isr_source source);
+const cpu_load * IsrProfiler_GetLoad(void);
+// Resets everything, including the load
+void IsrProfiler_Reset(void);
+// Starts the new load window
+void IsrProfiler_ResetLoad(void);
+
+#else
+
+#define ISR_PROFILE_BEGIN(latency)
+#define ISR_PROFILE_END(source)
+#define MAIN_PROFILE(section, call) (void)(call)
+#define MAIN_PROFILE_PASS()
+
+#endif
+
+#endif /* __ISRPROFILER_H */
@@ -49,6 +49,12 @@
 #define MOTORS_ENABLE_Pin GPIO_PIN_9
 #define MOTORS_ENABLE_GPIO_Port GPIOA
 /* USER CODE BEGIN Private defines */
+#define UART_CTS_Pin GPIO_PIN_0
+#define UART_CTS_GPIO_Port GPIOA
+#define UART_RTS_Pin GPIO_PIN_1
+#define UART_RTS_GPIO_Port GPIOA
+#define UART_DE_Pin GPIO_PIN_4
+#define UART_DE_GPIO_Port GPIOA
 
 /* USER CODE END Private defines */
 
@@ -0,0 +1,41 @@
+#ifndef __POSITIONJOURNAL_H
+#define __POSITIONJOURNAL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Uncomment to keep the stopped position of every stepper in the battery-backed SRAM (4kB, VBAT pin),
+// so the positions survive power loss and reset, and the axes don't need to be homed again.
+//#define POSITION_JOURNAL
+
+/*
+JOURNAL STRUCTURE (BKPSRAM_BASE)
+
+    uint32_t  magic           - JOURNAL_MAGIC, the whole journal is cleared if it doesn't match
+    
+    for each stepper (up to MAX_STEPPERS_COUNT):
+      uint32_t  tag           - JOURNAL_ENTRY_MARK | state << 8 | stepper name
+      int32_t   position      - currentPosition when the stepper has stopped
+      uint32_t  check         - tag ^ position ^ JOURNAL_CHECK_SEED
+      
+  Entry is written only when the stepper stops (or its position is set while it is stopped), 
+  and is marked as moving when the stepper starts. So nothing is written during motion,
+  while a stepper which was moving at power loss (its position is unknown) is not restored.
+*/
+
+// Enables backup SRAM (and its regulator, so it keeps the data on VBAT), clears the journal if it is not valid.
+void Journal_Init(void);
+
+// Stepper has stopped at the position.
+// THREAD-SAFE (may be invoked at any time, including the step timer interrupt)
+void Journal_RecordStopped(char stepper, int32_t position);
+
+// Stepper has started moving, its journal entry is not valid until it stops.
+// THREAD-SAFE (may be invoked at any time, including the controller timer interrupt)
+void Journal_RecordMoving(char stepper);
+
+// Returns true if there is a valid stopped position of the stepper in the journal.
+// Must be invoked for every stepper on startup (before the steppers are started), it takes the journal entries.
+bool Journal_RestorePosition(char stepper, int32_t * position);
+
+#endif /* __POSITIONJOURNAL_H */
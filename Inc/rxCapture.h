@@ -0,0 +1,110 @@
+#ifndef __RXCAPTURE_H
+#define __RXCAPTURE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stepperController.h"
+
+// Uncomment to record the received bytes along with the controller tick they have been decoded at
+// (see "capture" request in stepperCommands.c). The capture can be replayed by Host/ReplaySimulator.cpp.
+// When commented out, the RX path has no overhead at all.
+//#define RX_CAPTURE
+
+// Stream bytes (the header with the steppers snapshot goes on top of it)
+#define RX_CAPTURE_SIZE             (8*1024)
+// Capture frames are binary like telemetry ones, but have their own sync byte
+#define RX_CAPTURE_FRAME_SYNC       0xA7
+#define RX_CAPTURE_BYTES_PER_FRAME  240
+#define RX_CAPTURE_MAGIC            0x32435852    // "RXC2"
+// Stream escape byte, followed by a varint: controller ticks passed since the previous byte, 0 - the escape byte itself
+#define RX_CAPTURE_ESCAPE           0xFF
+
+#define RX_CAPTURE_FLAG_FULL        0x01          // the stream is cut - there has been no room for the rest
+#define RX_CAPTURE_FLAG_TRANSACTION 0x02          // serial channel transaction is open (begin has been received)
+#define RX_CAPTURE_FLAG_FAILED      0x04          // ... and it has failed already
+
+// 16 bytes, motion parameters of a profile
+typedef struct {
+  int32_t   minSPS;
+  int32_t   maxSPS;
+  int32_t   accSPS;
+  int32_t   accPrescaler;
+} capture_profile;
+
+// 72 bytes, stepper state at the capture start
+typedef struct {
+  char            name;
+  uint8_t         profilesSet;        // bit per profile which has been set, the others become a copy of the active one when selected
+  uint8_t         reserved[2];
+  int32_t         position;
+  capture_profile profiles[CONFIG_PROFILES_COUNT];
+} capture_stepper;
+
+// 2 bytes, telemetry subscription record (in the order the steppers have been subscribed first)
+typedef struct {
+  char      stepper;
+  uint8_t   fields;                   // telemetry_fields
+} capture_subscription;
+
+// 888 bytes, little-endian, goes to the frames as is, followed by the stream
+typedef struct {
+  uint32_t        magic;              // RX_CAPTURE_MAGIC
+  uint32_t        clock;              // STEP_TIMER_CLOCK
+  uint32_t        controllerPeriodUs; // STEP_CONTROLLER_PERIOD_US
+  uint32_t        controllerCycles;   // controller timer period, (ARR + 1) * (PSC + 1) cycles of the clock
+  uint32_t        startTick;          // Stepper_GetControllerTick() when the capture has been started
+  uint32_t        ticks;              // capture duration, controller ticks
+  uint32_t        rxBytes;            // bytes received (the stream has the ticks escaped in addition)
+  uint32_t        streamLength;
+  uint8_t         hubAddress;
+  uint8_t         profile;
+  uint8_t         steppersCount;
+  uint8_t         flags;              // RX_CAPTURE_FLAG_*
+  capture_stepper steppers[MAX_STEPPERS_COUNT];
+  // telemetry
+  uint32_t        telemetryPeriodMs;
+  uint8_t         subscriptionsCount;
+  uint8_t         reserved[3];
+  capture_subscription subscriptions[MAX_STEPPERS_COUNT];
+  // serial channel: staged targets of the open transaction, and the committed ones the controller hasn't latched yet
+  uint8_t         stagedCount;
+  uint8_t         committedCount;
+  char            stagedSteppers[MAX_STEPPERS_COUNT];
+  char            committedSteppers[MAX_STEPPERS_COUNT];
+  uint8_t         padding[2];
+  int32_t         stagedTargets[MAX_STEPPERS_COUNT];
+  int32_t         committedTargets[MAX_STEPPERS_COUNT];
+} capture_header;
+
+/*
+FRAME STRUCTURE (little-endian)
+
+    uint8_t       sync      - RX_CAPTURE_FRAME_SYNC
+    uint8_t       length    - number of bytes from "offset" till the end of the data
+    uint32_t      offset    - offset of the data in the capture (capture_header, then the stream)
+    uint8_t       data[]    - up to RX_CAPTURE_BYTES_PER_FRAME bytes
+    uint8_t       checksum  - 8-bit sum of all the preceding frame bytes (including sync)
+*/
+
+#if defined(RX_CAPTURE)
+
+// Drops the previous capture and starts recording, the steppers (all the profiles), telemetry subscriptions
+// and the serial channel transaction are snapshot first.
+// Returns SERR_MUSTBESTOPPED if any of the steppers is moving (nothing changes).
+stepper_error RxCapture_Start(void);
+// Stops the recording, the capture is kept till the next start.
+void RxCapture_Stop(void);
+// Records the received byte, must be invoked from the main loop right before the byte gets decoded.
+void RxCapture_Record(uint8_t data);
+// Stops the recording and starts sending the capture as frames. Returns the capture length (header + stream).
+uint32_t RxCapture_StartDump(void);
+// Sends the frames of the dump being in progress while there is bulk TX space, must be invoked from the main loop.
+// Returns true if there has been anything to send.
+bool RxCapture_SendPending(void);
+// Received bytes recorded so far, and whether the capture has been cut
+uint32_t RxCapture_GetRxBytes(void);
+bool RxCapture_IsFull(void);
+
+#endif
+
+#endif /* __RXCAPTURE_H */
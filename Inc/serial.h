@@ -1,5 +1,24 @@
 
 #include <stdint.h>
+#include <stdbool.h>
+
+// Uncomment to enable USART2 flow control:
+//  - CTS at PA0 (Arduino A0) - host holds our TX while it's busy (USART hardware CTS)
+//  - RTS at PA1 (Arduino A1) - we ask the host to hold once RX buffer is more than half full, till it's drained to a quarter
+//    (active low, GPIO driven, since USART hardware RTS can't see the DMA buffer fill level)
+//#define SERIAL_FLOW_CONTROL
+
+// Uncomment to drive half-duplex RS-485 transceiver (multi-drop bus, see Stepper_SetHubAddress):
+//  - DE at PA4 (Arduino A2) - driver enabled (active high) only while we transmit, 
+//    receiver enable (~RE) should be tied to it, so we don't hear our own responses
+//#define SERIAL_RS485
+
+#if defined(SERIAL_FLOW_CONTROL) && defined(SERIAL_RS485)
+#error "Flow control is not available on RS-485 bus"
+#endif
+
+#define SERIAL_DEFAULT_BAUDRATE 115200
+#define SERIAL_MIN_BAUDRATE     9600
 
 typedef enum {
   SERIAL_TX             = 0x01,
@@ -15,12 +34,58 @@ struct __FILE {
 
 
 // TX
+#define SERIAL_BULK_FRAME_MAX_PAYLOAD (255 - 4)
+
+// There are two TX channels sharing the UART: control (responses, events, printf) and bulk (telemetry).
+// Bulk data goes out only while the control channel is empty, so it can't delay or push out a response.
+// Both are written from the main loop only (TX interrupts just drain them).
+
+// Reserves contiguous space in control TX buffer for writing up to "length" bytes directly (no intermediate copy).
+// Returns NULL (and reports TX overflow) if there is no such space.
+// Reservation must be followed by Serial_TxCommit before any other TX write.
+uint8_t * Serial_TxReserve(uint32_t length);
+// Sends "length" bytes written into the reserved space, with a single DMA transfer kick.
+void Serial_TxCommit(uint32_t length);
+// The same for bulk TX buffer, but the overflow is not reported (the data is supposed to be just dropped).
+uint8_t * Serial_TxBulkReserve(uint32_t length);
+void Serial_TxBulkCommit(uint32_t length);
+// Sends a dump piece as a bulk frame (up to SERIAL_BULK_FRAME_MAX_PAYLOAD bytes), the layout is:
+//   uint8_t sync, uint8_t length (bytes from "offset" till the end of the payload), uint32_t offset (little-endian),
+//   payload, uint8_t checksum (8-bit sum of all the preceding frame bytes, including sync).
+// Returns false if there is no bulk TX space for it (nothing is sent, the piece goes on the next attempt).
+bool Serial_SendBulkFrame(uint8_t sync, uint32_t offset, const void * payload, uint32_t length);
+
 void Serial_WriteBytes(uint8_t * data, uint32_t length);
 void Serial_WriteString(char * str);
 void Serial_WriteInt(int32_t i);
 void Serial_ExecutePendingTransmits(void);
 
+// BAUD RATE
+
+// Switches UART to the new baud rate (limited to SERIAL_MIN_BAUDRATE .. PCLK1/8) once all queued TX data is sent.
+// Returns the baud rate which is going to be applied.
+// Unless confirmed by Serial_ConfirmBaudRate in 2 seconds, UART falls back to SERIAL_DEFAULT_BAUDRATE.
+uint32_t Serial_SetBaudRate(uint32_t baudRate);
+// Returns the closest supported baud rate
+uint32_t Serial_LimitBaudRate(uint32_t baudRate);
+uint32_t Serial_GetBaudRate(void);
+void Serial_ConfirmBaudRate(void);
+// Must be invoked periodically (from main loop)
+void Serial_CheckBaudRateFallback(void);
+
+// FLOW CONTROL CREDITS
+
+// Number of bytes the host may send without risk of RX buffer overrun
+uint32_t Serial_GetRxFree(void);
+// Number of bytes which may be written to control TX buffer without overflow
+uint32_t Serial_GetTxFree(void);
+
 // RX
+// Bytes are received by circular DMA, interrupts never decode them (nor execute the commands),
+// so they can't add latency to the steppers timers. 
 void Serial_InitRxSequence(void);
-void Serial_CheckRxTimeout(void);
+void Serial_RxIdleCallback(void);
+// Feeds everything received so far to Serial_RxCallback, must be invoked from the main loop.
+// Returns the number of bytes fed.
+uint32_t Serial_ProcessReceived(void);
 void Serial_RxCallback(uint8_t byte);
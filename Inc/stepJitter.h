@@ -0,0 +1,52 @@
+#ifndef __STEPJITTER_H
+#define __STEPJITTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stm32f4xx_hal.h"
+#include "stepperController.h"
+
+// Uncomment to measure the step pulse spacing (see "jitter" request in stepperCommands.c).
+// The step pin of the measured stepper must be wired to PC6 (TIM8_CH1), e.g. X step (PA10) jumpered to PC6.
+// TIM8 captures the rising edges at HCLK (the same clock as the step timers) and DMA2 Stream2 stores them.
+//#define STEP_JITTER
+
+#define JITTER_MAX_SAMPLES      1024
+#define JITTER_DEFAULT_SAMPLES  256
+
+typedef struct {
+  char      stepper;
+  // periods requested, and captured (less when the stepper has left the cruise speed before the capture is done)
+  uint32_t  requested;
+  uint32_t  count;
+  // capture timer clock, commanded speed, and the step period the step timer is programmed for (timer ticks)
+  uint32_t  clock;
+  uint32_t  sps;
+  uint32_t  period;
+  // measured periods (timer ticks), mean and standard deviation are in 1/100 of a tick
+  uint32_t  minPeriod;
+  uint32_t  maxPeriod;
+  uint32_t  meanPeriodX100;
+  uint32_t  stddevX100;
+  // every captured period minus the commanded one (timer ticks)
+  const int16_t * deviations;
+} jitter_result;
+
+#if defined(STEP_JITTER)
+
+// Configures TIM8 input capture and its DMA stream, the capture is not running until Jitter_Start.
+void Jitter_Init(void);
+// Arms the capture of the next periods of the stepper (the previous capture is dropped).
+// The capture runs only while the stepper is at its maxSPS, so only the cruise is measured.
+stepper_error Jitter_Start(char stepperName, uint32_t samples);
+// Starts the armed capture once the stepper is at the cruise speed, and stops it as soon as the stepper leaves it,
+// must be invoked right after Stepper_ExecuteAllControllers (from the controller timer interrupt).
+void Jitter_ControllerTick(void);
+// Completes the stopped or full capture (the statistics), must be invoked periodically (from main loop).
+void Jitter_Poll(void);
+// Takes the completed capture, the deviations stay valid until the next Jitter_Start.
+bool Jitter_TakeResult(jitter_result * result);
+
+#endif
+
+#endif /* __STEPJITTER_H */
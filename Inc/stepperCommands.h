@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdbool.h>
+#include "stepperController.h"
 
 typedef enum {
   CMD_UNKNOWN   = 0,
@@ -7,7 +8,20 @@ typedef enum {
   CMD_GET       = 2,
   CMD_SET       = 3,
   CMD_RESET     = 4,
-  __CMD_COUNT     = 5
+  CMD_BEGIN     = 5,
+  CMD_COMMIT    = 6,
+  CMD_BAUD      = 7,
+  CMD_SUBSCRIBE = 8,
+  CMD_SYNC      = 9,
+  CMD_ADDRESS   = 10,
+  CMD_SAVE      = 11,
+  CMD_PROFILE   = 12,
+  CMD_ISR       = 13,
+  CMD_JITTER    = 14,
+  CMD_LOAD      = 15,
+  CMD_TRACE     = 16,
+  CMD_CAPTURE   = 17,
+  __CMD_COUNT     = 18
 } request_commands;
 
 typedef enum {
@@ -31,6 +45,85 @@ typedef struct {
   volatile request_params     parameter;
   volatile int64_t            value;
   volatile bool               isNegativeValue;
+  // ":" separator has been received (the value may be 0)
+  volatile bool               hasValue;
+  // optional request tag, echoed in the response
+  volatile bool               hasId;
+  volatile uint32_t           id;
+  // optional bus address of the hub the request goes to, or broadcast to all of them
+  volatile bool               hasAddress;
+  volatile bool               isBroadcast;
+  volatile uint32_t           address;
 } stepper_request;
 
-void ExecuteRequest(stepper_request * r);
+typedef enum {
+  REQ_FIELD_CMD       = 0,
+  REQ_FIELD_STEPPER   = 1,
+  REQ_FIELD_PARAM     = 2,
+  REQ_FIELD_VALUE     = 3,
+  REQ_FIELD_ID        = 4,
+  REQ_FIELD_ADDRESS   = 5
+} request_fields;
+
+// The link commands come from and responses go to (USART2, another UART, CAN, etc.)
+typedef struct {
+  // Response TX, the same contract as Serial_TxReserve/Serial_TxCommit
+  uint8_t * (*TxReserve)(uint32_t length);
+  void      (*TxCommit)(uint32_t length);
+  // Flow control credits reported by "sync" (NULL - reported as 0)
+  uint32_t  (*GetRxFree)(void);
+  uint32_t  (*GetTxFree)(void);
+  // Baud rate negotiation, see Serial_SetBaudRate (NULL - "baud" is not supported by the link)
+  uint32_t  (*SetBaudRate)(uint32_t baudRate);
+  uint32_t  (*LimitBaudRate)(uint32_t baudRate);
+  uint32_t  (*GetBaudRate)(void);
+  void      (*ConfirmBaudRate)(void);
+} command_transport;
+
+// Decoder and execution state of a single link, so every link has its own request being decoded,
+// its own transaction and request tags, and may feed the commands concurrently with the others.
+typedef struct {
+  const command_transport * transport;
+  
+  volatile request_fields currentReqField;
+  // current trie node for CMD/PARAM fields, chars counter for VALUE field
+  volatile int32_t        currentReqFieldIndex;
+  // request being decoded
+  stepper_request         req;
+  
+  // Tag of the request being executed (echoed in its response), and of the last executed one (reported by "sync")
+  bool      currentRequestHasId;
+  uint32_t  currentRequestId;
+  uint32_t  lastExecutedId;
+  // Broadcast requests are executed, but never answered (all the hubs would talk at once)
+  bool      currentRequestIsBroadcast;
+  
+  // Transaction buffer, one staged target position per stepper (the last written wins)
+  bool      transactionActive;
+  bool      transactionFailed;
+  int32_t   transactionCount;
+  char      transactionSteppers[MAX_STEPPERS_COUNT];
+  int32_t   transactionTargets[MAX_STEPPERS_COUNT];
+  // Targets of the committed transaction, till the controller latches them
+  stepper_targets committedTargets;
+} command_channel;
+
+// USART2 channel, fed by Serial_RxCallback
+extern command_channel serialChannel;
+
+// Prepares the channel to decode the commands, responses go to the transport.
+// Returns false if there are too many channels to commit transactions (MAX_REGISTERED_TARGETS).
+bool CommandChannel_Init(command_channel * ch, const command_transport * transport);
+// Decodes (and executes) the commands from the received bytes.
+// Channels are independent, but the bytes of a single channel must not be fed concurrently.
+void CommandChannel_Receive(command_channel * ch, const uint8_t * data, uint32_t length);
+
+void ExecuteRequest(command_channel * ch, stepper_request * r);
+
+// Sends asynchronous notifications (e.g. "X.stop:100") to the channel, must be invoked periodically (from main loop)
+// Notifications are kept till there is TX space for them. Returns true if there has been anything to report.
+bool ReportStepperEvents(command_channel * ch);
+
+// Initializes the serial channel (the decoding tables are const, see stepperKeywordTries.h),
+// must be invoked before any data is received
+void InitDecoder(void);
@@ -1,3 +1,7 @@
+#ifndef __STEPPERCONTROLLER_H
+#define __STEPPERCONTROLLER_H
+
+#include <stdbool.h>
 #include "stm32f4xx_hal.h"
 
 
@@ -8,6 +12,13 @@
 #define ACCSPS_TO_MINSPS_RATIO   0.8f
 #define DEFAULT_MIN_SPS 1
 #define DEFAULT_MAX_SPS 400000
+// Config changes are written to FLASH by the main loop, once there were no more changes for this long
+#define CONFIG_SAVE_DELAY_MS     2000
+#define CONFIG_SAVE_DELAY_MAX_MS 60000
+// Motion profiles (MinSPS/MaxSPS/AccSPS/AccPrescaler sets) per stepper, e.g. for light and heavy payload
+#define CONFIG_PROFILES_COUNT    4
+// Command channels which may commit targets (see Stepper_RegisterTargets)
+#define MAX_REGISTERED_TARGETS   4
 
 typedef enum {
     SS_UNDEFINED         = 0x00,
@@ -68,13 +79,35 @@ typedef struct {
     // where do we go?
     volatile int32_t     targetPosition;
     
+    // counts direct target changes (set, reset), so a committed target which is not latched yet gets dropped
+    // by the later direct set (see stepper_targets)
+    volatile uint32_t    targetSetCount;
+    
     // where we are?
     volatile int32_t     currentPosition;
     
     // are we rolling or chilling?
     volatile stepper_status  status;
+    
+    // set by the step timer when the stepper stops at its target, 
+    // the ".stop" event is reported later from the main loop (see Stepper_TakeStopEvent)
+    volatile bool        stopEventPending;
+    volatile int32_t     stopEventPosition;
 } stepper_state;
 
+// Target positions committed together (a transaction of a command channel), see Stepper_CommitTargets.
+// Written by the committing side only, the controller just latches them and clears "pending".
+typedef struct {
+    volatile int32_t     count;
+    volatile char        steppers[MAX_STEPPERS_COUNT];
+    volatile int32_t     targets[MAX_STEPPERS_COUNT];
+    // targetSetCount of the stepper at commit
+    volatile uint32_t    setCounts[MAX_STEPPERS_COUNT];
+    volatile bool        pending;
+    // the commit is being merged, controller must not latch it yet
+    volatile bool        updating;
+} stepper_targets;
+
 extern uint32_t STEP_TIMER_CLOCK;
 extern uint32_t STEP_CONTROLLER_PERIOD_US;
 
@@ -91,12 +124,35 @@ stepper_error Stepper_InitDefaultState(char stepperName);
 void Stepper_ExecuteAllControllers(void);
 void Stepper_PulseTimerUpdate(char stepperName);
 
+// Number of Stepper_ExecuteAllControllers passes since reset (wraps around).
+// THREAD-SAFE (may be invoked at any time)
+uint32_t Stepper_GetControllerTick(void);
+
+// Name of the stepper initialized index-th (0..MAX_STEPPERS_COUNT-1), '\0' if there is no such one.
+// THREAD-SAFE (may be invoked at any time)
+char Stepper_GetName(int32_t index);
+
+// Returns true (and clears it) if there is a stop event pending for any of the steppers,
+// stepperName and position are filled with the stepper which has stopped and where.
+bool Stepper_TakeStopEvent(char * stepperName, int32_t * position);
+
 // Sets the new target position (step number) of the motor (where it should rotate to).
 // THREAD-SAFE (may be invoked at any time)
 // If stepper_status is SS_RUNNING the motor will adjust its state to get to the new target in fastest possible way
 // So, if needed - the motor will break to the full stop and immediatelly will start rotating in oposite direction.
 stepper_error Stepper_SetTargetPosition(char stepperName, int32_t value);
 
+// Makes the controller latch the targets committed to this batch (every command channel has its own one).
+// NOT THREAD-SAFE (invoked once per batch at startup)
+stepper_error Stepper_RegisterTargets(stepper_targets * committed);
+
+// Commits the target positions to the registered batch, they are applied all at once
+// at the beginning of the next Stepper_ExecuteAllControllers() pass.
+// So all affected steppers start (or get retargeted) on the same controller tick.
+// If the previous commit of the batch is not latched yet, the new targets are merged into it (the last written wins).
+// THREAD-SAFE (may be invoked at any time, but not concurrently for the same batch)
+stepper_error Stepper_CommitTargets(stepper_targets * committed, int32_t count, const char * stepperNames, const int32_t * values);
+
 // Sets the new value for the current possion of the stepper. 
 // So it becomes a new reference point for target value.
 // The same value will be assigned to target position - otherwise the mottor will start moving.
@@ -145,6 +201,10 @@ int32_t Stepper_GetMaxSPS(char stepperName);
 // THREAD-SAFE (may be called at any time)
 int32_t Stepper_GetCurrentSPS(char stepperName);
 
+// Gets the step period the step timer is programmed for ((ARR + 1) * (PSC + 1) ticks of STEP_TIMER_CLOCK), 0 if there is no timer.
+// THREAD-SAFE (may be called at any time, but the period is consistent only when the controller doesn't change it meanwhile)
+uint32_t Stepper_GetStepPeriod(char stepperName);
+
 // Gets the acceleration, as factor of (STEP_CONTROLLER_PERIOD_US*10^6) steps/second^2.
 // THREAD-SAFE (may be called at any time)
 int32_t Stepper_GetAccSPS(char stepperName);
@@ -158,11 +218,50 @@ int32_t Stepper_GetAccPrescaler(char stepperName);
 stepper_status Stepper_GetStatus(char stepperName);
 
 // Loads configuration of all steppers (MinSPS/Max/AccSPS/AccPrescaler) 
-// from FLASH memeory (Sector 1)
-void Stepper_LoadConfig(void);
+// from FLASH memeory (Sector 3), all the profiles are loaded and profile 0 gets active.
+// Returns false if there is no stored configuration for some of the steppers (they should be initialized with defaults).
+bool Stepper_LoadConfig(void);
+
+// Saves configuration of all steppers (MinSPS/Max/AccSPS/AccPrescaler), all the profiles
+// to FLASH memeory (Sector 3). Every record is CRC protected.
+// Only the values changed since the last save are appended to the config log (two FLASH word programs each),
+// the sector gets erased only when the log is full.
+// Blocks (and stalls FLASH fetches, so the interrupts too) while programming - must be invoked from the main loop only,
+// setters use Stepper_ScheduleConfigSave() instead.
+void Stepper_SaveConfig(void);
+
+// Marks the configuration as changed, so Stepper_SavePendingConfig() writes it later.
+// Every change restarts the delay, so a burst of changes is written once.
+// immediately - skip the delay (still deferred to the main loop).
+// THREAD-SAFE (may be invoked at any time)
+void Stepper_ScheduleConfigSave(bool immediately);
+
+// Writes scheduled config changes when the delay has passed and all the steppers are STOPPED 
+// (FLASH programming stalls the controller, the motors would overshoot).
+// Should be invoked from the main loop, returns true if the config has been written.
+bool Stepper_SavePendingConfig(void);
+
+// Delay (ms) between the last config change and the FLASH write. Not stored, CONFIG_SAVE_DELAY_MS after reset.
+// Returns SERR_LIMIT if the value has been limited to 0..CONFIG_SAVE_DELAY_MAX_MS.
+stepper_error Stepper_SetConfigSaveDelay(int32_t delayMs);
+uint32_t Stepper_GetConfigSaveDelay(void);
+
+// Switches all the steppers to another motion profile (0..CONFIG_PROFILES_COUNT-1), FLASH is not touched.
+// Setters (and "reset") change the active profile only. Profile which has never been set starts as a copy of the active one.
+// Profile 0 is active after reset.
+// Returns SERR_LIMIT if there is no such profile (nothing changes).
+// NOT THREAD-SAFE (all the steppers must be SS_STOPPED, SERR_MUSTBESTOPPED is returned otherwise).
+stepper_error Stepper_SelectProfile(int32_t profile);
+uint8_t Stepper_GetProfile(void);
 
-// Saves configuration of all steppers (MinSPS/Max/AccSPS/AccPrescaler) 
-// to FLASH memeory (Sector 1)
-void Stepper_SaveConfig(void);  
+// Gets the motion parameters of the profile (the active profile gives the current values of the stepper).
+// Returns false if there is no such stepper or profile, or the profile has never been set (nothing is written then).
+// NOT THREAD-SAFE (invoked from main loop, the same as the setters and the profile switch)
+bool Stepper_GetProfileParams(char stepperName, int32_t profile, int32_t * minSPS, int32_t * maxSPS, int32_t * accSPS, int32_t * accPrescaler);
 
+// RS-485 bus address of the hub, stored in FLASH along with the steppers configuration.
+// 0 - the hub is the only device on the line (point-to-point), requests addressing is not used.
+uint8_t Stepper_GetHubAddress(void);
+void Stepper_SetHubAddress(uint8_t address);  
 
+#endif /* __STEPPERCONTROLLER_H */
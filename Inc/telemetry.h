@@ -0,0 +1,58 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+// Telemetry frames are binary, so they start with a byte which never appears in ASCII responses
+#define TELEMETRY_FRAME_SYNC      0xA5
+#define TELEMETRY_MAX_FRAME_SIZE  128
+#define TELEMETRY_MIN_PERIOD_MS   1
+#define TELEMETRY_DEFAULT_PERIOD_MS 100
+
+typedef enum {
+  TF_NONE       = 0x00,
+  TF_POSITION   = 0x01,   // int32_t currentPosition
+  TF_SPS        = 0x02,   // int32_t currentSPS
+  TF_STATUS     = 0x04,   // uint8_t stepper_status
+  TF_ALL        = 0x07
+} telemetry_fields;
+
+/*
+FRAME STRUCTURE (little-endian)
+
+    uint8_t   sync          - TELEMETRY_FRAME_SYNC
+    uint8_t   length        - number of bytes from "tick" till the end of the last stepper record
+    uint32_t  tick          - controller timer tick when the snapshot has been taken
+    uint16_t  dropped       - total number of frames dropped because of TX saturation (wraps around)
+    
+    for each subscribed stepper:
+      char      stepper
+      uint8_t   fields      - telemetry_fields mask, defines which of the following values are present
+      int32_t   position    (TF_POSITION)
+      int32_t   sps         (TF_SPS)
+      uint8_t   status      (TF_STATUS)
+      
+    uint8_t   checksum      - 8-bit sum of all the preceding frame bytes (including sync)
+*/
+
+// Adds (subscribe = true) or removes the fields from the stepper telemetry. Returns resulting stepper fields mask.
+// Returns TF_NONE when subscribing a new stepper while all MAX_STEPPERS_COUNT slots are in use.
+telemetry_fields Telemetry_Subscribe(char stepper, telemetry_fields fields, bool subscribe);
+
+// Sets telemetry period in milliseconds (rounded to controller timer period), returns the value being set.
+// The period is kept while nothing is subscribed, there are no frames at all then.
+uint32_t Telemetry_SetPeriod(uint32_t periodMs);
+uint32_t Telemetry_GetPeriod(void);
+
+// Number of frames dropped since power-on.
+uint32_t Telemetry_GetDroppedFrames(void);
+
+// Gets the subscription record (the records go in the order the steppers have been subscribed first, and are never removed,
+// the unsubscribed ones have no fields). Returns false past the last record.
+bool Telemetry_GetSubscription(int32_t index, char * stepper, telemetry_fields * fields);
+
+// Invoked on every stepper controller timer tick (right after Stepper_ExecuteAllControllers),
+// takes the snapshot when it's time to.
+void Telemetry_ControllerTick(void);
+
+// Invoked from main loop, puts the snapshot frame into bulk TX buffer (if there is a space, otherwise drops it).
+// Returns true if there has been a frame.
+bool Telemetry_SendPendingFrame(void);
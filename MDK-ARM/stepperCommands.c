@@ -2,6 +2,11 @@
 #include "stepperCommands.h"
 #include "stepperController.h"
 #include "serial.h"
+#include "telemetry.h"
+#include "isrProfiler.h"
+#include "stepJitter.h"
+#include "controlTrace.h"
+#include "rxCapture.h"
 
 /*
 REQUEST STRUCTURE
@@ -10,8 +15,18 @@ REQUEST STRUCTURE
     
   where
 
-    <command>     : add | set | reset | get
+    <command>     : add | set | reset | get | subscribe | jitter
     
+                    begin | commit  - transaction brackets, go without <stepper> and everything else
+                    baud            - goes without <stepper> and [.parameter], but with [:value] (see BAUD RATE below)
+                    address         - the same as baud (see BUS ADDRESSING below)
+                    save            - the same as baud (see CONFIG SAVING below)
+                    profile         - the same as baud (see MOTION PROFILES below)
+                    isr             - the same as baud (see ISR PROFILING below)
+                    load            - the same as baud (see CPU LOAD below)
+                    trace           - the same as baud (see CONTROLLER TRACE below)
+                    capture         - the same as baud (see RX CAPTURE below)
+                    
     <stepper>     : X | Y | Z (or whatever single-letter names will be added in the future)
     
     [.parameter]  : parameter name (the field of the stepper_state structure)
@@ -52,6 +67,164 @@ RESPONSE STRUCTURE
     <status>  : OK | LIMIT | ERROR
     <info>    : command confirmation info (in case of successful "OK", or error code and description in case of error)
   
+TRANSACTIONS
+
+    begin<request>[<request>...]commit
+    
+  All "set" and "add" requests of targetPosition between "begin" and "commit" are buffered, nothing gets executed and no response is sent.
+  On "commit" all buffered target positions are latched together at the beginning of a single Stepper_ExecuteAllControllers pass,
+  so all the affected steppers start (or get retargeted) on the very same controller tick. Single combined response is sent.
+  "get" requests are executed immediately, while any other request (or an error) fails the whole transaction - nothing is applied on "commit".
+  A direct "set"/"reset" of a stepper after "commit" wins over its committed target, even if it gets there before the latching pass.
+  
+BAUD RATE
+
+    baud[:value]
+    
+  Switches UART to the new baud rate (9600 .. 6250000) right after the response is sent (at the old rate).
+  The host must switch as well and send any valid request within 2 seconds, otherwise we fall back to 115200.
+  The rate is never stored, so every reset starts at 115200. "baud" with no value just returns the current rate.
+  Terminate the request (e.g. with '\r') - otherwise it is executed only when the next byte arrives.
+  
+TELEMETRY
+
+    subscribe<stepper>[.parameter][:value]
+    
+  Adds the stepper [.parameter] to the periodic binary telemetry frames (see telemetry.h for the frame structure).
+  [.parameter] may be .currentPosition, .currentSPS or .status, and .all (default) for all three.
+  [:value] is the period of telemetry frames in milliseconds (the same for all the steppers), with no value the current one is kept
+  (TELEMETRY_DEFAULT_PERIOD_MS until set). 0 removes the [.parameter] from telemetry (the period is not changed in this case),
+  the frames stop once nothing is subscribed.
+  Frames are taken as snapshots on the controller timer, and dropped (with a counter) if TX is saturated.
+  
+REQUEST TAGS
+
+    #<id><request>
+    
+  Any request may be prefixed with a tag - unsigned 32-bit integer after "#". The tag goes first in the response, e.g. "#17 OK - X.targetPosition:100".
+  So the host may have many requests in flight, and match the responses even if some of them get lost (e.g. TX overflow).
+  "sync" (which is also may be tagged) returns the tag of the last executed request, 
+  followed by flow control credits: free RX buffer space (bytes the host may send after "sync" without overrun)
+  and free TX buffer space (response bytes we may queue), e.g. "OK - SYNC = 17 RX = 8150 TX = 8000".
+  
+FLOW CONTROL
+
+  Credits are reported by "sync" only, the other responses don't carry them - the host has to poll.
+  To stream at the link speed with no RTS/CTS the host sends "sync" along with the other requests (e.g. every RX/4 bytes), 
+  and never has more than the RX credit of the last answered "sync" sent after that "sync" (till the next credit comes).
+  The TX credit is there for the host to keep the responses it asks for within it (e.g. "get<stepper>.all" takes ~200 bytes).
+  With SERIAL_FLOW_CONTROL (serial.h) the hub holds the host by RTS once RX buffer is more than half full,
+  and releases it when it's drained down to a quarter, so the host may just stream.
+  
+BUS ADDRESSING
+
+    @<address><request>
+    @*<request>
+    
+  Many hubs may share a single half-duplex RS-485 bus (see SERIAL_RS485 in serial.h).
+  Each of them should get its own address (1..255) with "address:<address>", it is stored in FLASH.
+  Address 0 (default) means point-to-point link - all requests are executed, no matter what the prefix is.
+  On the bus (non-zero address) the hub executes only the requests prefixed with its address, 
+  and the responses are prefixed with it as well, e.g. "@3 #17 OK - X.targetPosition:100".
+  "@*" requests are executed by all the hubs, and never answered (use "sync" on each of them to check).
+  E.g. "@*begin" ... "@*commit" starts the staged moves on all the hubs at once (within one controller tick).
+  There are no unsolicited transmits on the bus: stop events are not reported, and telemetry is not available.
+  "address" with no [:value] returns the current address.
+  Out of range address is limited to 0..255, e.g. "address:300" -> "LIMIT - ADDRESS = 255".
+  
+CONFIG SAVING
+
+    save[:value]
+    
+  minSPS/maxSPS changes (and the bus address) are not written to FLASH right away - FLASH programming stalls the CPU.
+  The main loop writes them once there were no changes for the save delay (2000ms by default) and all the steppers are STOPPED,
+  so a script setting dozens of parameters causes a single write.
+  "save" with no value writes the pending changes as soon as all the steppers are STOPPED, 
+  "save:<value>" sets the save delay in milliseconds (0..60000, not stored). Both return the current delay, e.g. "OK - SAVE = 2000".
+  Terminate the request (e.g. with '\r') - otherwise it is executed only when the next byte arrives.
+  
+MOTION PROFILES
+
+    profile[:value]
+    
+  Every stepper has 4 sets (0..3) of minSPS/maxSPS/accSPS/accPrescaller, e.g. 0 - light payload, 1 - heavy payload.
+  "profile:<value>" switches all the steppers to another set at once (all of them must be STOPPED), FLASH is not touched.
+  "set"/"reset" change the active profile only, a profile which has never been set starts as a copy of the active one.
+  All the profiles are stored, profile 0 is active after reset. "profile" with no value returns the active profile.
+  
+ISR PROFILING
+
+    isr[:value]
+    
+  With ISR_PROFILING defined (see isrProfiler.h) every interrupt handler is measured with DWT cycle counter.
+  "isr" returns the statistics, a line per handler: number of calls, max latency and duration, 
+  and log-scale histograms of both (bucket lower bound in CPU cycles : count, empty buckets are skipped), e.g.
+  
+      OK - ISR CLOCK = 200000000
+          TIM1 N = 1000 LAT.MAX = 40 DUR.MAX = 130 LAT = 16:980 32:20 DUR = 64:700 128:300
+          
+  Latency is the time since the timer update event, so it is known for the timers only.
+  A step timer update which comes when the controller has already loaded the next period may be left out of the latency histogram.
+  Duration includes the higher priority handlers which have preempted the measured one.
+  "isr:<value>" (any value) resets the statistics.
+  
+CPU LOAD
+
+    load[:value]
+    
+  With ISR_PROFILING defined every handler also sums up its own CPU cycles (without the higher priority handlers preempting it),
+  and the main loop sums up the calls which have done something (DECODE - requests, MAIN - events, telemetry, config saving),
+  the rest of the time the main loop is polling for nothing - IDLE. "load" returns the percentages of the time since the last reset
+  (MS milliseconds), grouped by subsystem, followed by a line per handler, e.g.
+  
+      OK - LOAD MS = 5000 STEP = 18.40 CONTROLLER = 4.10 SERIAL = 0.30 DECODE = 1.20 MAIN = 0.10 IDLE = 75.90
+          ISR TIM1 = 6.20 TIM2 = 6.10 TIM3 = 6.10 TIM14 = 4.10 DMA.RX = 0.00 DMA.TX = 0.10 USART2 = 0.20
+          
+  "load:<value>" (any value) starts a new window. "isr:<value>" resets both.
+  
+CONTROLLER TRACE
+
+    trace[:value]
+    
+  With CONTROL_TRACE defined (see controlTrace.h) every stepper controller decision (start, speed increment/decrement,
+  braking and its correction) is logged into RAM ring of the last TRACE_RECORDS records: tick, stepper, status transition, 
+  currentSPS, steps to target, and estimated vs required time the braking decision is based on.
+  "trace" stops the recording and answers with the number of records to be sent, and the number recorded since the trace has been cleared,
+  e.g. "OK - TRACE = 512 TOTAL = 1840", then the records go as binary frames (see controlTrace.h) along with telemetry.
+  The recording resumes once they are all sent. "trace:<value>" (any value) clears the trace.
+  Not available on the bus.
+  
+RX CAPTURE
+
+    capture[:value]
+    
+  With RX_CAPTURE defined (see rxCapture.h) the received bytes can be recorded into RAM along with the controller tick
+  they have been decoded at, so a session can be replayed on the host (Host/ReplaySimulator.cpp) through the same decoder
+  and stepper controller, tick by tick, giving the same step timeline every time.
+  "capture:1" snapshots the steppers (position and motion parameters of every profile), telemetry subscriptions and the transaction
+  state, then starts the recording, all the steppers must be STOPPED.
+  "capture:0" stops it (the bytes of this request are the last ones recorded). Recording stops by itself when the buffer is full.
+  "capture" stops the recording too and answers with the capture length, the number of bytes received and whether it's been cut,
+  e.g. "OK - CAPTURE = 3120 RX = 2790", or "OK - CAPTURE = 8464 RX = 7012 FULL",
+  then the capture goes as binary frames (see rxCapture.h) along with telemetry.
+  Not available on the bus.
+  
+STEP JITTER
+
+    jitter<stepper>[:value]
+    
+  With STEP_JITTER defined (see stepJitter.h) and the stepper's step pin wired to PC6, TIM8 timestamps the step pulses.
+  "jitter<stepper>:<value>" arms the capture of <value> step periods (256 by default, 1024 at most),
+  it starts once the stepper reaches its maxSPS and lasts till all the periods are taken, or the stepper leaves the cruise.
+  The request is answered right away ("OK - X.JITTER = 256"), the result comes as an event (not on the bus), e.g.
+  
+      X.jitter: N = 256 REQUESTED = 256 CLOCK = 200000000 SPS = 400000 PERIOD = 500 MIN = 500 MAX = 502 MEAN = 501.02 STDDEV = 0.14
+          1 1 1 2 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1 1
+          ...
+          
+  PERIOD is the commanded one (CLOCK / SPS), MIN/MAX/MEAN/STDDEV - measured, all in CLOCK ticks.
+  Continuation lines (32 per line) carry every captured period minus PERIOD, so the host may analyze the whole capture.
+  
 EXAMPLES
 
   -------------------------------------------
@@ -116,6 +289,15 @@ EXAMPLES
               .currentPostion:2000
               .targetPosition:-150
               .status:1(RUNNING_BACKWARD)
+  -------------------------------------------
+    REQUEST  
+              beginsetX:1000setY:-500addZ:200commit
+    RESPONSE (assuming that old Z.targetPosition:125, the target lines start with a tab)
+              OK - BEGIN
+              OK - COMMIT
+                  X.TARGETPOSITION = 1000
+                  Y.TARGETPOSITION = -500
+                  Z.TARGETPOSITION = 325
               
 
 ============================================
@@ -123,28 +305,41 @@ EXAMPLES
 ============================================
 
 Request decoding happens on the fly, with every new received byte (we are not wating for request termination char(s), like '\r', '\n' or '\r\n')
-This is preferable way. Since it distributes computation which required for the whole request decoding over the time (we don't do everyting in a single interrupt handler).
+This is preferable way. Since it distributes computation which required for the whole request decoding over the time (we don't do everyting in a single main loop pass).
 While the decoding alghoritm itself is a little more complex - less CPU time required when the last request symbol arrives, 
 the beginning of request, all the previous content, has been already decoded by this moment.
 Since no requst termination chars required - you may write a set of commands in one line, without spaces or anything (data bandwidth utilized more efficiently).
-But the only disadvantage is that there are ceratin limitations to the request fileds content:
 
-  1. Neither of <command>   is allowed to be a substring of any another <command>.
-  2. Neither of <parameter> is allowed to be a substring of any another <parameter>.
+<command> and <parameter> names are decoded with keyword tries (state-transition tables), so every byte costs a single table lookup.
+The tables are generated from request_commands_arry/request_params_arry by Host/KeywordTries.c (Inc/stepperKeywordTries.h), so they are const.
+A keyword may be a prefix of another keyword, in such case it gets accepted only when the next byte doesn't continue the longer one.
+
+Every link (command_channel) has its own decoder state, request tags and transaction, so several links may feed the commands at the same time.
+The only shared things are the steppers themselves, the hub address and telemetry (which goes to the serial link).
+
+Line noise can't get the decoder stuck: every field is bounded (keywords by the tries, value by 12 chars, tag by UINT32_MAX, address by 3 digits),
+and a line end ('\r' or '\n') always brings it back to the initial state within that single byte (a partial request gets executed or dropped).
+So after a garbage the host just needs to send a line end before the next request (e.g. "\n#99sync") to be sure it's decoded as sent.
   
 */
 
 
-static char * request_commands_arry[__CMD_COUNT] = {"UNKNOWN", "ADD", "GET", "SET", "RESET"};
-static char * request_params_arry[__PARAM_COUNT] = {"UNDEFINED", "ALL", "TARGETPOSITION", "CURRENTPOSITION", "MINSPS", "MAXSPS", "CURRENTSPS", "ACCSPS", "ACCPRESCALER", "STATUS"};
+// Worst case response length ("get<stepper>.all"), 
+// responses are formatted directly into TX buffer space reserved for this size
+#define MAX_RESPONSE_LENGTH 384
+// Single line responses (acks, errors, a parameter) reserve just this much, 
+// so they still get through when TX buffer is almost full. Hub address and request tag prefixes included.
+#define LINE_RESPONSE_LENGTH 96
+// "\t<stepper>.TARGETPOSITION = <value>\r\n" line of "commit" response
+#define TARGET_LINE_LENGTH 40
+// "isr" response line: handler name, 3 counters and two histograms
+#define ISR_REPORT_LINE_LENGTH (64 + 2 * ISR_HISTOGRAM_BUCKETS * 20)
+// Step period deviations per "jitter" event continuation line
+#define JITTER_VALUES_PER_LINE 32
 
+char * request_commands_arry[__CMD_COUNT] = {"UNKNOWN", "ADD", "GET", "SET", "RESET", "BEGIN", "COMMIT", "BAUD", "SUBSCRIBE", "SYNC", "ADDRESS", "SAVE", "PROFILE", "ISR", "JITTER", "LOAD", "TRACE", "CAPTURE"};
+char * request_params_arry[__PARAM_COUNT] = {"UNDEFINED", "ALL", "TARGETPOSITION", "CURRENTPOSITION", "MINSPS", "MAXSPS", "CURRENTSPS", "ACCSPS", "ACCPRESCALER", "STATUS"};
 
-typedef enum {
-  REQ_FIELD_CMD       = 0,
-  REQ_FIELD_STEPPER   = 1,
-  REQ_FIELD_PARAM     = 2,
-  REQ_FIELD_VALUE     = 3
-} request_fields;
 
 typedef enum {
  SCERR_OK               = 0,
@@ -152,22 +347,49 @@ typedef enum {
  SCERR_MUSTBESTOPPED    = 2,
  SCERR_STEPPERNOTFOUND  = 3,
  SCERR_INVALIDCMDPARAM  = 4,
- SCERR_UNKNONWERROR     = 5
+ SCERR_UNKNONWERROR     = 5,
+ SCERR_NOTRANSACTION    = 6,
+ SCERR_TRANSACTIONFAILED= 7,
+ SCERR_BUSMODE          = 8
 }  stepper_command_error;
 
 
-static volatile request_fields currentReqField = REQ_FIELD_CMD;
-static volatile int32_t currentReqFieldIndex = 0;
-// this holds the list of options left to decode filtered by icomming data
-// every new byte which doesn't fit the possible decoded option will reset corresponding bit-flag
-static uint32_t filteredItems = UINT32_MAX;
-// Global decoded request from UART stream
-static stepper_request req = {'\0', CMD_UNKNOWN, PARAM_UNDEFINED, 0, false};
+// Keyword trie, every node has a transition per keyword symbol (0 - no transition).
+// Node 0 is never a valid transition target, so it's reserved, and TRIE_ROOT goes next.
+#define TRIE_ROOT           1
+// 'A'..'Z' and '_', symbol 0 is for everything else (never has transitions)
+#define TRIE_SYMBOLS_COUNT  28
+
+typedef struct {
+  const uint8_t (* next)[TRIE_SYMBOLS_COUNT];
+  // keyword (request_commands or request_params) which ends at the node, 0 - none
+  const uint8_t * keyword;
+  // there are longer keywords going through the node
+  const bool    * hasNext;
+} keyword_trie;
+
+// The tables are generated from request_commands_arry/request_params_arry by Host/KeywordTries.c (FLASH, nothing is built at startup).
+// They must be regenerated whenever the names change, a different number of keywords stops the build here.
+#include "stepperKeywordTries.h"
+typedef char commandsTrieIsOutOfDate[(COMMANDS_TRIE_KEYWORDS == __CMD_COUNT) ? 1 : -1];
+typedef char paramsTrieIsOutOfDate[(PARAMS_TRIE_KEYWORDS == __PARAM_COUNT) ? 1 : -1];
+
+static const keyword_trie commandsTrie = { commandsTrieNext, commandsTrieKeyword, commandsTrieHasNext };
+static const keyword_trie paramsTrie = { paramsTrieNext, paramsTrieKeyword, paramsTrieHasNext };
 
-void DecodeCmd(uint8_t data);
-void DecodeStepper(uint8_t data);
-void DecodeParam(uint8_t data);
-void DecodeValue(uint8_t data);
+static const command_transport serialTransport = {
+  Serial_TxReserve, Serial_TxCommit,
+  Serial_GetRxFree, Serial_GetTxFree,
+  Serial_SetBaudRate, Serial_LimitBaudRate, Serial_GetBaudRate, Serial_ConfirmBaudRate
+};
+
+command_channel serialChannel;
+
+void Decode(command_channel * ch, uint8_t data);
+void DecodeCmd(command_channel * ch, uint8_t data);
+void DecodeStepper(command_channel * ch, uint8_t data);
+void DecodeParam(command_channel * ch, uint8_t data);
+void DecodeValue(command_channel * ch, uint8_t data);
 
 int32_t GetParamValue(char stepper, request_params param) {
     switch (param) {
@@ -193,49 +415,865 @@ stepper_error SetParamValue(char stepper, request_params param, int32_t value) {
     }
 }
 
-void PrintStepperStatusStr(stepper_status status) {
+// ========================================== //
+//    RESPONSE BUILDER                        //
+// ========================================== //
+// Allocation-free formatting straight into the reserved TX buffer space, 
+// every Append... writes at "out" and returns the pointer right after the written data.
+
+#define AppendLiteral(out, str) AppendBytes((out), (str), sizeof(str) - 1)
+
+char * AppendBytes(char * out, const char * data, uint32_t length) {
+  memcpy(out, data, length);
+  return out + length;
+}
+
+char * AppendChar(char * out, char c) {
+  *out++ = c;
+  return out;
+}
+
+char * AppendStr(char * out, const char * str) {
+  while (*str)
+    *out++ = *str++;
+  return out;
+}
+
+char * AppendUInt32(char * out, uint32_t value) {
+  char digits[10];
+  char * p = digits;
+  
+  do {
+    *p++ = '0' + value % 10;
+    value /= 10;
+  } while (value);
+  
+  while (p > digits)
+    *out++ = *--p;
+  return out;
+}
+
+char * AppendInt32(char * out, int32_t value) {
+  if (value < 0) {
+    *out++ = '-';
+    // keep it correct for INT32_MIN
+    return AppendUInt32(out, 0u - (uint32_t)value);
+  }
+  return AppendUInt32(out, (uint32_t)value);
+}
+
+char * AppendInt64(char * out, int64_t value) {
+  char digits[20];
+  char * p = digits;
+  uint64_t magnitude = (uint64_t)value;
+  
+  // 64-bit division goes through library call on Cortex-M4, so avoid it when value fits
+  if (value >= INT32_MIN && value <= INT32_MAX)
+    return AppendInt32(out, (int32_t)value);
+  
+  if (value < 0) {
+    *out++ = '-';
+    magnitude = 0u - magnitude;
+  }
+  do {
+    *p++ = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude);
+  
+  while (p > digits)
+    *out++ = *--p;
+  return out;
+}
+
+// Uppercase hex digits without "0x" prefix, zero padded to minDigits (like "%.2X")
+char * AppendHex(char * out, uint32_t value, int32_t minDigits) {
+  static const char hexDigits[] = "0123456789ABCDEF";
+  char digits[8];
+  char * p = digits;
+  
+  do {
+    *p++ = hexDigits[value & 0xF];
+    value >>= 4;
+  } while (value || p - digits < minDigits);
+  
+  while (p > digits)
+    *out++ = *--p;
+  return out;
+}
+
+// Fixed point value given in 1/100, e.g. "501.02"
+char * AppendFixed2(char * out, uint32_t valueX100) {
+  out = AppendUInt32(out, valueX100 / 100);
+  out = AppendChar(out, '.');
+  out = AppendChar(out, '0' + (valueX100 / 10) % 10);
+  return AppendChar(out, '0' + valueX100 % 10);
+}
+
+char * AppendError(char * out, stepper_command_error error, const char * errorStr) {
+  out = AppendLiteral(out, "ERROR - ");
+  out = AppendInt32(out, error);
+  out = AppendChar(out, ' ');
+  out = AppendStr(out, errorStr);
+  return AppendLiteral(out, "\r\n");
+}
+
+char * PrintStepperStatusStr(char * out, stepper_status status);
+
+// Reserves TX space for the whole response (up to "length" bytes) and starts it with the hub address (on the bus) and the request tag (if any).
+// Returns NULL if there is no space in TX buffer, or the request is broadcast.
+// The request must have been executed by then - it's done no matter whether the response goes out.
+char * ReserveResponse(command_channel * ch, char ** response, uint32_t length) {
+  uint8_t hubAddress = Stepper_GetHubAddress();
+  char * out;
+  
+  if (ch->currentRequestIsBroadcast) {
+    *response = NULL;
+    return NULL;
+  }
+  
+  out = (char *)ch->transport->TxReserve(length);
+  *response = out;
+  if (out != NULL && hubAddress != 0) {
+    // tell the host which of the hubs on the bus answers
+    out = AppendChar(out, '@');
+    out = AppendUInt32(out, hubAddress);
+    out = AppendChar(out, ' ');
+  }
+  if (out != NULL && ch->currentRequestHasId) {
+    out = AppendChar(out, '#');
+    out = AppendUInt32(out, ch->currentRequestId);
+    out = AppendChar(out, ' ');
+  }
+  return out;
+}
+
+// ".<PARAM> = <value>\r\n", status goes as hex value followed by flag names
+char * AppendParamValue(char * out, request_params param, int32_t value) {
+  out = AppendChar(out, '.');
+  out = AppendStr(out, request_params_arry[param]);
+  out = AppendLiteral(out, " = ");
+  if (param == PARAM_STATUS) {
+    out = AppendLiteral(out, "0x");
+    out = AppendHex(out, (uint32_t)value, 2);
+    out = AppendChar(out, ' ');
+    out = PrintStepperStatusStr(out, (stepper_status)value);
+  } else {
+    out = AppendInt32(out, value);
+  }
+  return AppendLiteral(out, "\r\n");
+}
+
+char * PrintStepperStatusStr(char * out, stepper_status status) {
   char * separator = "";
   if (status & SS_STOPPED) {
-    printf("STOPPED");
+    out = AppendLiteral(out, "STOPPED");
     separator = " | ";
   }
   if (status & SS_BREAKING) {
-    printf("%sBREAKING", separator);
+    out = AppendStr(AppendStr(out, separator), "BREAKING");
     separator = " | ";
   }
   if (status & SS_BREAKCORRECTION) {
-    printf("%sBREAKCORRECTION", separator);
+    out = AppendStr(AppendStr(out, separator), "BREAKCORRECTION");
     separator = " | ";
   }
   if (status & SS_STARTING) {
-    printf("%sSTARTING", separator);
+    out = AppendStr(AppendStr(out, separator), "STARTING");
     separator = " | ";
   }
   if (status & SS_RUNNING_BACKWARD) {
-    printf("%sRUNNING_BACKWARD", separator);
+    out = AppendStr(AppendStr(out, separator), "RUNNING_BACKWARD");
     separator = " | ";
   }
   if (status & SS_RUNNING_FORWARD) {
-    printf("%sRUNNING_FORWARD", separator);
+    out = AppendStr(AppendStr(out, separator), "RUNNING_FORWARD");
   }
   if (status == 0x00) {
-    printf("UNDEFINED");
+    out = AppendLiteral(out, "UNDEFINED");
+  }
+  return out;
+}
+
+void ExecuteTransactionRequest(command_channel * ch, request_commands command) {
+  stepper_command_error error = SCERR_OK;
+  int32_t i;
+  char * response;
+  char * out;
+  
+  if (command == CMD_BEGIN) {
+    // nested "begin" just drops everything collected so far
+    ch->transactionActive = true;
+    ch->transactionFailed = false;
+    ch->transactionCount  = 0;
+  } else if (!ch->transactionActive) {
+    error = SCERR_NOTRANSACTION;
+  } else {
+    ch->transactionActive = false;
+    if (ch->transactionFailed) {
+      error = SCERR_TRANSACTIONFAILED;
+    } else if (Stepper_CommitTargets(&ch->committedTargets, ch->transactionCount, ch->transactionSteppers, ch->transactionTargets) != SERR_OK) {
+      error = SCERR_TRANSACTIONFAILED;
+    }
+  }
+  
+  // "commit" lists the targets, a line per stepper
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH + ((command == CMD_COMMIT) ? ch->transactionCount * TARGET_LINE_LENGTH : 0));
+  if (out == NULL)
+    return;
+  
+  if (error == SCERR_NOTRANSACTION) {
+    out = AppendError(out, SCERR_NOTRANSACTION, "No transaction to commit.");
+  } else if (error == SCERR_TRANSACTIONFAILED) {
+    out = AppendError(out, SCERR_TRANSACTIONFAILED, "Transaction failed, nothing applied.");
+  } else if (command == CMD_BEGIN) {
+    out = AppendLiteral(out, "OK - BEGIN\r\n");
+  } else {
+    out = AppendLiteral(out, "OK - COMMIT\r\n");
+    for (i = 0; i < ch->transactionCount; i++)
+    {
+      out = AppendChar(out, '\t');
+      out = AppendChar(out, ch->transactionSteppers[i]);
+      out = AppendParamValue(out, PARAM_TARGETPOSITION, ch->transactionTargets[i]);
+    }
+  }
+  ch->transport->TxCommit(out - response);
+}
+
+bool StageTransactionRequest(command_channel * ch, char stepper, request_commands command, request_params parameter, int64_t value) {
+  int32_t i = 0;
+  
+  if (parameter != PARAM_UNDEFINED && parameter != PARAM_TARGETPOSITION)
+    return false;
+  
+  while (i < ch->transactionCount && ch->transactionSteppers[i] != stepper)
+    i++;
+  
+  if (command == CMD_ADD)
+    value += (i < ch->transactionCount) ? ch->transactionTargets[i] : Stepper_GetTargetPosition(stepper);
+  
+  if (value < INT32_MIN || value > INT32_MAX)
+    return false;
+  
+  if (i == ch->transactionCount) {
+    if (ch->transactionCount == MAX_STEPPERS_COUNT)
+      return false;
+    ch->transactionSteppers[ch->transactionCount++] = stepper;
+  }
+  ch->transactionTargets[i] = (int32_t)value;
+  return true;
+}
+
+void ExecuteBaudRateRequest(command_channel * ch, int64_t value) {
+  const command_transport * transport = ch->transport;
+  char * response;
+  char * out;
+  uint32_t baudRate = 0;
+  
+  if (transport->SetBaudRate != NULL)
+    baudRate = (value == 0) ? transport->GetBaudRate() : transport->LimitBaudRate((value > UINT32_MAX) ? UINT32_MAX : (value < 0) ? 0 : (uint32_t)value);
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out != NULL) {
+    if (transport->SetBaudRate == NULL) {
+      out = AppendError(out, SCERR_INVALIDCMDPARAM, "Invalid command parameter.");
+    } else {
+      out = AppendStr(out, (value == 0 || baudRate == value) ? "OK - BAUD = " : "LIMIT - BAUD = ");
+      out = AppendUInt32(out, baudRate);
+      out = AppendLiteral(out, "\r\n");
+    }
+    transport->TxCommit(out - response);
+  }
+  
+  // switch after the response, so it still goes out at the old rate
+  if (value != 0 && transport->SetBaudRate != NULL)
+    transport->SetBaudRate(baudRate);
+}
+
+void ExecuteSubscribeRequest(command_channel * ch, char stepper, request_params parameter, bool hasValue, int64_t value) {
+  stepper_command_error error = SCERR_OK;
+  bool busMode = Stepper_GetHubAddress() != 0;
+  char * response;
+  char * out;
+  telemetry_fields fields;
+  
+  switch (parameter) {
+    case PARAM_UNDEFINED:
+    case PARAM_ALL:             fields = TF_ALL; break;
+    case PARAM_CURRENTPOSITION: fields = TF_POSITION; break;
+    case PARAM_CURRENTSPS:      fields = TF_SPS; break;
+    case PARAM_STATUS:          fields = TF_STATUS; break;
+    default:                    fields = TF_NONE; break;
+  }
+  
+  if (busMode) {
+    error = SCERR_BUSMODE;
+  } else if (fields == TF_NONE) {
+    error = SCERR_INVALIDCMDPARAM;
+  } else {
+    if (value > 0)
+      Telemetry_SetPeriod((value > UINT32_MAX/1000) ? UINT32_MAX/1000 : (uint32_t)value);
+    // a bare "subscribe" keeps the current period
+    fields = Telemetry_Subscribe(stepper, fields, !hasValue || value > 0);
+  }
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+  if (error == SCERR_BUSMODE) {
+    out = AppendError(out, SCERR_BUSMODE, "Not available on the bus.");
+  } else if (error == SCERR_INVALIDCMDPARAM) {
+    out = AppendError(out, SCERR_INVALIDCMDPARAM, "Invalid command parameter.");
+  } else {
+    out = AppendLiteral(out, "OK - ");
+    out = AppendChar(out, stepper);
+    out = AppendLiteral(out, ".TELEMETRY = 0x");
+    out = AppendHex(out, fields, 2);
+    out = AppendLiteral(out, " / ");
+    out = AppendUInt32(out, Telemetry_GetPeriod());
+    out = AppendLiteral(out, " ms\r\n");
+  }
+  ch->transport->TxCommit(out - response);
+}
+
+void ExecuteAddressRequest(command_channel * ch, bool hasValue, int64_t value) {
+  char * response;
+  char * out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  bool limited = false;
+  
+  if (hasValue && (value < 0 || value > 0xFF)) {
+    value = (value < 0) ? 0 : 0xFF;
+    limited = true;
+  }
+  
+  if (out != NULL) {
+    out = AppendStr(out, limited ? "LIMIT - ADDRESS = " : "OK - ADDRESS = ");
+    out = AppendUInt32(out, hasValue ? (uint32_t)value : Stepper_GetHubAddress());
+    out = AppendLiteral(out, "\r\n");
+    // the response still goes with the old address, since the host has used it
+    ch->transport->TxCommit(out - response);
+  }
+  
+  if (hasValue)
+    Stepper_SetHubAddress((uint8_t)value);
+}
+
+void ExecuteSaveRequest(command_channel * ch, bool hasValue, int64_t value) {
+  stepper_error result = SERR_OK;
+  char * response;
+  char * out;
+  
+  if (hasValue)
+    result = Stepper_SetConfigSaveDelay((value > INT32_MAX) ? INT32_MAX : (value < INT32_MIN) ? INT32_MIN : (int32_t)value);
+  else
+    Stepper_ScheduleConfigSave(true);
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+  out = AppendStr(out, (result == SERR_OK) ? "OK - SAVE = " : "LIMIT - SAVE = ");
+  out = AppendUInt32(out, Stepper_GetConfigSaveDelay());
+  out = AppendLiteral(out, "\r\n");
+  ch->transport->TxCommit(out - response);
+}
+
+void ExecuteProfileRequest(command_channel * ch, bool hasValue, int64_t value) {
+  stepper_error result = SERR_OK;
+  char * response;
+  char * out;
+  
+  if (hasValue)
+    result = Stepper_SelectProfile((value > INT32_MAX || value < 0) ? -1 : (int32_t)value);
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+  if (result == SERR_LIMIT) {
+    out = AppendError(out, SCERR_VALUELIMIT, "No such profile.");
+  } else if (result == SERR_MUSTBESTOPPED) {
+    out = AppendError(out, SCERR_MUSTBESTOPPED, "Stepper must be STOPPED to execute this command.");
+  } else {
+    out = AppendLiteral(out, "OK - PROFILE = ");
+    out = AppendUInt32(out, Stepper_GetProfile());
+    out = AppendLiteral(out, "\r\n");
+  }
+  ch->transport->TxCommit(out - response);
+}
+
+#if defined(ISR_PROFILING)
+// "<bucket>:<count>" for every non-empty histogram bucket
+char * AppendHistogram(char * out, const uint32_t * histogram) {
+  int32_t i;
+  for (i=0; i < ISR_HISTOGRAM_BUCKETS; i++) {
+    if (histogram[i] == 0)
+      continue;
+    out = AppendChar(out, ' ');
+    out = AppendUInt32(out, (i == 0) ? 0 : 1U << (i - 1));
+    out = AppendChar(out, ':');
+    out = AppendUInt32(out, histogram[i]);
+  }
+  return out;
+}
+#endif
+
+void ExecuteIsrRequest(command_channel * ch, bool hasValue) {
+  char * response;
+  char * out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+#if defined(ISR_PROFILING)
+  isr_source source;
+  const isr_stats * stats;
+#endif
+  
+  if (out == NULL) {
+#if defined(ISR_PROFILING)
+    if (hasValue)
+      IsrProfiler_Reset();
+#endif
+    return;
+  }
+  
+#if defined(ISR_PROFILING)
+  if (hasValue) {
+    IsrProfiler_Reset();
+    out = AppendLiteral(out, "OK - ISR RESET\r\n");
+    ch->transport->TxCommit(out - response);
+    return;
+  }
+  
+  out = AppendLiteral(out, "OK - ISR CLOCK = ");
+  out = AppendUInt32(out, HAL_RCC_GetHCLKFreq());
+  out = AppendLiteral(out, "\r\n");
+  ch->transport->TxCommit(out - response);
+  
+  // too long for a single response buffer - a line per handler (the main loop is the only TX writer, so they go together)
+  for (source = ISR_TIM1; source < __ISR_COUNT; source++) {
+    out = (char *)ch->transport->TxReserve(ISR_REPORT_LINE_LENGTH);
+    if (out == NULL)
+      return;
+    response = out;
+    stats = IsrProfiler_GetStats(source);
+    out = AppendChar(out, '\t');
+    out = AppendStr(out, IsrProfiler_GetName(source));
+    out = AppendLiteral(out, " N = ");
+    out = AppendUInt32(out, stats->count);
+    out = AppendLiteral(out, " LAT.MAX = ");
+    out = AppendUInt32(out, stats->maxLatency);
+    out = AppendLiteral(out, " DUR.MAX = ");
+    out = AppendUInt32(out, stats->maxDuration);
+    out = AppendLiteral(out, " LAT =");
+    out = AppendHistogram(out, stats->latency);
+    out = AppendLiteral(out, " DUR =");
+    out = AppendHistogram(out, stats->duration);
+    out = AppendLiteral(out, "\r\n");
+    ch->transport->TxCommit(out - response);
+  }
+#else
+  out = AppendError(out, SCERR_INVALIDCMDPARAM, "ISR profiling is not enabled.");
+  ch->transport->TxCommit(out - response);
+#endif
+}
+
+#if defined(ISR_PROFILING)
+// " <name> = <percent of the window>"
+char * AppendLoad(char * out, const char * name, uint64_t cycles, uint64_t window) {
+  out = AppendChar(out, ' ');
+  out = AppendStr(out, name);
+  out = AppendLiteral(out, " = ");
+  return AppendFixed2(out, (window == 0) ? 0 : (uint32_t)((cycles * 10000 + window / 2) / window));
+}
+#endif
+
+void ExecuteLoadRequest(command_channel * ch, bool hasValue) {
+  char * response;
+  char * out = ReserveResponse(ch, &response, MAX_RESPONSE_LENGTH);
+#if defined(ISR_PROFILING)
+  const cpu_load * load;
+  uint64_t cycles[__ISR_COUNT];
+  uint64_t busy = 0;
+  isr_source source;
+#endif
+  
+  if (out == NULL) {
+#if defined(ISR_PROFILING)
+    if (hasValue)
+      IsrProfiler_ResetLoad();
+#endif
+    return;
+  }
+  
+#if defined(ISR_PROFILING)
+  if (hasValue) {
+    IsrProfiler_ResetLoad();
+    out = AppendLiteral(out, "OK - LOAD RESET\r\n");
+    ch->transport->TxCommit(out - response);
+    return;
+  }
+  
+  load = IsrProfiler_GetLoad();
+  for (source = ISR_TIM1; source < __ISR_COUNT; source++) {
+    cycles[source] = IsrProfiler_GetStats(source)->cycles;
+    busy += cycles[source];
+  }
+  busy += load->main[MAIN_DECODE] + load->main[MAIN_OTHER];
+  
+  out = AppendLiteral(out, "OK - LOAD MS = ");
+  out = AppendUInt32(out, (uint32_t)(load->window / (HAL_RCC_GetHCLKFreq() / 1000)));
+  out = AppendLoad(out, "STEP", cycles[ISR_TIM1] + cycles[ISR_TIM2] + cycles[ISR_TIM3], load->window);
+  out = AppendLoad(out, "CONTROLLER", cycles[ISR_TIM14], load->window);
+  out = AppendLoad(out, "SERIAL", cycles[ISR_DMA_RX] + cycles[ISR_DMA_TX] + cycles[ISR_USART2], load->window);
+  out = AppendLoad(out, "DECODE", load->main[MAIN_DECODE], load->window);
+  out = AppendLoad(out, "MAIN", load->main[MAIN_OTHER], load->window);
+  out = AppendLoad(out, "IDLE", (busy < load->window) ? load->window - busy : 0, load->window);
+  // per handler
+  out = AppendLiteral(out, "\r\n\tISR");
+  for (source = ISR_TIM1; source < __ISR_COUNT; source++)
+    out = AppendLoad(out, IsrProfiler_GetName(source), cycles[source], load->window);
+  out = AppendLiteral(out, "\r\n");
+#else
+  out = AppendError(out, SCERR_INVALIDCMDPARAM, "ISR profiling is not enabled.");
+#endif
+  ch->transport->TxCommit(out - response);
+}
+
+void ExecuteTraceRequest(command_channel * ch, bool hasValue) {
+  char * response;
+  char * out;
+#if defined(CONTROL_TRACE)
+  uint32_t count;
+  uint32_t total;
+  
+  if (hasValue)
+    ControlTrace_Clear();
+#endif
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+#if defined(CONTROL_TRACE)
+  if (hasValue) {
+    out = AppendLiteral(out, "OK - TRACE RESET\r\n");
+  } else if (Stepper_GetHubAddress() != 0) {
+    out = AppendError(out, SCERR_BUSMODE, "Not available on the bus.");
+  } else {
+    // the frames go through the bulk channel, so the response goes first
+    count = ControlTrace_StartDump(&total);
+    out = AppendLiteral(out, "OK - TRACE = ");
+    out = AppendUInt32(out, count);
+    out = AppendLiteral(out, " TOTAL = ");
+    out = AppendUInt32(out, total);
+    out = AppendLiteral(out, "\r\n");
+  }
+#else
+  out = AppendError(out, SCERR_INVALIDCMDPARAM, "Controller trace is not enabled.");
+#endif
+  ch->transport->TxCommit(out - response);
+}
+
+void ExecuteCaptureRequest(command_channel * ch, bool hasValue, int64_t value) {
+  char * response;
+  char * out;
+#if defined(RX_CAPTURE)
+  stepper_error result = SERR_OK;
+  uint32_t length = 0;
+  bool busMode = Stepper_GetHubAddress() != 0;
+  
+  if (!busMode) {
+    if (!hasValue)
+      length = RxCapture_StartDump();
+    else if (value != 0)
+      result = RxCapture_Start();
+    else
+      RxCapture_Stop();
+  }
+#endif
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+#if defined(RX_CAPTURE)
+  if (busMode) {
+    out = AppendError(out, SCERR_BUSMODE, "Not available on the bus.");
+  } else if (result == SERR_MUSTBESTOPPED) {
+    out = AppendError(out, SCERR_MUSTBESTOPPED, "Stepper must be STOPPED to execute this command.");
+  } else if (hasValue) {
+    if (value != 0)
+      out = AppendLiteral(out, "OK - CAPTURE ON\r\n");
+    else
+      out = AppendLiteral(out, "OK - CAPTURE OFF\r\n");
+  } else {
+    // the frames go through the bulk channel, so the response goes first
+    out = AppendLiteral(out, "OK - CAPTURE = ");
+    out = AppendUInt32(out, length);
+    out = AppendLiteral(out, " RX = ");
+    out = AppendUInt32(out, RxCapture_GetRxBytes());
+    if (RxCapture_IsFull())
+      out = AppendLiteral(out, " FULL");
+    out = AppendLiteral(out, "\r\n");
+  }
+#else
+  out = AppendError(out, SCERR_INVALIDCMDPARAM, "RX capture is not enabled.");
+#endif
+  ch->transport->TxCommit(out - response);
+}
+
+void ExecuteJitterRequest(command_channel * ch, char stepper, int64_t value) {
+  char * response;
+  char * out;
+#if defined(STEP_JITTER)
+  stepper_error error = SERR_OK;
+  uint32_t samples = (value < 0) ? 0 : (value > JITTER_MAX_SAMPLES) ? JITTER_MAX_SAMPLES + 1 : (uint32_t)value;
+  
+  // the result is reported as an event, so there is no point to arm it on the bus
+  if (Stepper_GetHubAddress() == 0)
+    error = Jitter_Start(stepper, samples);
+#endif
+  
+  out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+#if defined(STEP_JITTER)
+  if (Stepper_GetHubAddress() != 0) {
+    out = AppendError(out, SCERR_BUSMODE, "Not available on the bus.");
+  } else if (error == SERR_STATENOTFOUND) {
+    out = AppendError(out, SCERR_STEPPERNOTFOUND, "No stepper with specified label.");
+  } else {
+    if (error == SERR_LIMIT)
+      out = AppendLiteral(out, "LIMIT - ");
+    else
+      out = AppendLiteral(out, "OK - ");
+    out = AppendChar(out, stepper);
+    out = AppendLiteral(out, ".JITTER = ");
+    out = AppendUInt32(out, (samples == 0) ? JITTER_DEFAULT_SAMPLES : (samples > JITTER_MAX_SAMPLES) ? JITTER_MAX_SAMPLES : samples);
+    out = AppendLiteral(out, "\r\n");
+  }
+#else
+  out = AppendError(out, SCERR_INVALIDCMDPARAM, "Step jitter capture is not enabled.");
+#endif
+  ch->transport->TxCommit(out - response);
+}
+
+#if defined(STEP_JITTER)
+void ReportJitter(command_channel * ch, const jitter_result * r) {
+  char * response;
+  char * out = (char *)ch->transport->TxReserve(MAX_RESPONSE_LENGTH);
+  uint32_t i;
+  
+  if (out == NULL)
+    return;
+  response = out;
+  out = AppendChar(out, r->stepper);
+  out = AppendLiteral(out, ".jitter: N = ");
+  out = AppendUInt32(out, r->count);
+  out = AppendLiteral(out, " REQUESTED = ");
+  out = AppendUInt32(out, r->requested);
+  out = AppendLiteral(out, " CLOCK = ");
+  out = AppendUInt32(out, r->clock);
+  out = AppendLiteral(out, " SPS = ");
+  out = AppendUInt32(out, r->sps);
+  out = AppendLiteral(out, " PERIOD = ");
+  out = AppendUInt32(out, r->period);
+  out = AppendLiteral(out, " MIN = ");
+  out = AppendUInt32(out, r->minPeriod);
+  out = AppendLiteral(out, " MAX = ");
+  out = AppendUInt32(out, r->maxPeriod);
+  out = AppendLiteral(out, " MEAN = ");
+  out = AppendFixed2(out, r->meanPeriodX100);
+  out = AppendLiteral(out, " STDDEV = ");
+  out = AppendFixed2(out, r->stddevX100);
+  out = AppendLiteral(out, "\r\n");
+  ch->transport->TxCommit(out - response);
+  
+  // the main loop is the only TX writer, so the lines go together (the rest is dropped if TX is full)
+  for (i = 0; i < r->count; i += JITTER_VALUES_PER_LINE) {
+    uint32_t j;
+    uint32_t last = (i + JITTER_VALUES_PER_LINE < r->count) ? i + JITTER_VALUES_PER_LINE : r->count;
+    out = (char *)ch->transport->TxReserve(MAX_RESPONSE_LENGTH);
+    if (out == NULL)
+      return;
+    response = out;
+    for (j = i; j < last; j++) {
+      out = AppendChar(out, (j == i) ? '\t' : ' ');
+      out = AppendInt32(out, r->deviations[j]);
+    }
+    out = AppendLiteral(out, "\r\n");
+    ch->transport->TxCommit(out - response);
+  }
+}
+#endif
+
+void ExecuteSyncRequest(command_channel * ch) {
+  char * response;
+  char * out = ReserveResponse(ch, &response, LINE_RESPONSE_LENGTH);
+  
+  if (out == NULL)
+    return;
+  
+  out = AppendLiteral(out, "OK - SYNC = ");
+  out = AppendUInt32(out, ch->lastExecutedId);
+  // credits - how many bytes the host may send, and how many response bytes we may buffer
+  out = AppendLiteral(out, " RX = ");
+  out = AppendUInt32(out, (ch->transport->GetRxFree != NULL) ? ch->transport->GetRxFree() : 0);
+  out = AppendLiteral(out, " TX = ");
+  out = AppendUInt32(out, (ch->transport->GetTxFree != NULL) ? ch->transport->GetTxFree() : 0);
+  out = AppendLiteral(out, "\r\n");
+  ch->transport->TxCommit(out - response);
+}
+
+void ExecuteTaggedRequest(command_channel * ch, stepper_request * r);
+
+// Whether an unsolicited line of the length fits into TX now, links with no TX credits getter are just tried
+bool HasTxSpace(command_channel * ch, uint32_t length) {
+  return ch->transport->GetTxFree == NULL || ch->transport->GetTxFree() >= length;
+}
+
+bool ReportStepperEvents(command_channel * ch) {
+  char stepper;
+  int32_t position;
+  char * response;
+  char * out;
+  bool reported = false;
+#if defined(STEP_JITTER)
+  jitter_result jitter;
+#endif
+  
+  // an event is taken only when its line fits, so it stays pending (not lost) while TX is full
+  // (on the bus they are just dropped - no unsolicited transmits, we would talk over the other hubs)
+  while ((Stepper_GetHubAddress() != 0 || HasTxSpace(ch, LINE_RESPONSE_LENGTH)) && Stepper_TakeStopEvent(&stepper, &position)) {
+    reported = true;
+    if (Stepper_GetHubAddress() != 0)
+      continue;
+    // events go through the control channel, so they can't be pushed out by telemetry
+    out = (char *)ch->transport->TxReserve(LINE_RESPONSE_LENGTH);
+    if (out == NULL)
+      break;
+    response = out;
+    out = AppendChar(out, stepper);
+    out = AppendLiteral(out, ".stop:");
+    out = AppendInt32(out, position);
+    out = AppendLiteral(out, "\r\n");
+    ch->transport->TxCommit(out - response);
+  }
+  
+#if defined(STEP_JITTER)
+  // the result is kept till there is TX space for (at least) its summary line
+  if (HasTxSpace(ch, MAX_RESPONSE_LENGTH) && Jitter_TakeResult(&jitter)) {
+    reported = true;
+    if (Stepper_GetHubAddress() == 0)
+      ReportJitter(ch, &jitter);
   }
+#endif
+  return reported;
 }
 
-void ExecuteRequest(stepper_request * r) {
+void ExecuteRequest(command_channel * ch, stepper_request * r) {
+  uint8_t hubAddress = Stepper_GetHubAddress();
+  
+  // on the bus we take only the requests addressed to us (or to everyone)
+  if (hubAddress != 0 && !r->isBroadcast && !(r->hasAddress && r->address == hubAddress))
+    return;
+  
+  ch->currentRequestHasId       = r->hasId;
+  ch->currentRequestId          = r->id;
+  ch->currentRequestIsBroadcast = r->isBroadcast;
+  
+  ExecuteTaggedRequest(ch, r);
+  
+  // staged (transaction) requests count as executed as well
+  if (ch->currentRequestHasId)
+    ch->lastExecutedId = ch->currentRequestId;
+  ch->currentRequestHasId       = false;
+  ch->currentRequestIsBroadcast = false;
+}
+
+void ExecuteTaggedRequest(command_channel * ch, stepper_request * r) {
   stepper_error setResult = SERR_OK;
   stepper_command_error error = SCERR_OK;
+  bool programError = false;
+  char * response;
+  char * out;
   
   char stepper = r->stepper;
   request_commands command = r->command;    
   request_params parameter = r->parameter;
   int64_t value = (r->isNegativeValue) ? -r->value : r->value;
  
+  // any request decoded means that the host talks at our current baud rate
+  if (ch->transport->ConfirmBaudRate != NULL)
+    ch->transport->ConfirmBaudRate();
+  
+  if (command == CMD_BEGIN || command == CMD_COMMIT) {
+    ExecuteTransactionRequest(ch, command);
+    return;
+  }
+  
+  if (command == CMD_BAUD) {
+    ExecuteBaudRateRequest(ch, value);
+    return;
+  }
+  
+  if (command == CMD_SYNC) {
+    ExecuteSyncRequest(ch);
+    return;
+  }
+  
+  if (command == CMD_ADDRESS) {
+    ExecuteAddressRequest(ch, r->hasValue, value);
+    return;
+  }
+  
+  if (command == CMD_SAVE) {
+    ExecuteSaveRequest(ch, r->hasValue, value);
+    return;
+  }
+  
+  if (command == CMD_PROFILE) {
+    ExecuteProfileRequest(ch, r->hasValue, value);
+    return;
+  }
+  
+  if (command == CMD_ISR) {
+    ExecuteIsrRequest(ch, r->hasValue);
+    return;
+  }
+  
+  if (command == CMD_LOAD) {
+    ExecuteLoadRequest(ch, r->hasValue);
+    return;
+  }
+  
+  if (command == CMD_TRACE) {
+    ExecuteTraceRequest(ch, r->hasValue);
+    return;
+  }
+  
+  if (command == CMD_CAPTURE) {
+    ExecuteCaptureRequest(ch, r->hasValue, value);
+    return;
+  }
+  
   // TRY EXECUTE COMMAND
     
-  if (stepper == '\0') {
+  if (ch->transactionActive && command != CMD_GET) {
+    // Stage it silently, a single combined response goes on "commit".
+    // Everything that can't be staged fails the whole transaction.
+    if (stepper != '\0' && (command == CMD_ADD || command == CMD_SET) && 
+        StageTransactionRequest(ch, stepper, command, parameter, value))
+      return;
+    ch->transactionFailed = true;
+    error = (stepper == '\0') ? SCERR_STEPPERNOTFOUND : SCERR_INVALIDCMDPARAM;
+  } else if (stepper == '\0') {
     error = SCERR_STEPPERNOTFOUND;
+  } else if (command == CMD_SUBSCRIBE) {
+    ExecuteSubscribeRequest(ch, stepper, parameter, r->hasValue, value);
+    return;
+  } else if (command == CMD_JITTER) {
+    ExecuteJitterRequest(ch, stepper, value);
+    return;
   } else {
     switch (command) {
       case CMD_ADD:
@@ -284,7 +1322,7 @@ void ExecuteRequest(stepper_request * r) {
         switch (parameter) {
             case PARAM_ALL:
                 setResult = Stepper_InitDefaultState(stepper);
-                Stepper_SaveConfig();
+                Stepper_ScheduleConfigSave(false);
                 break;
             case PARAM_MINSPS:
                 setResult = Stepper_SetMinSPS(stepper, DEFAULT_MIN_SPS);
@@ -314,7 +1352,7 @@ void ExecuteRequest(stepper_request * r) {
         break;
       default:
         // This case should not ever happen.
-        printf("ERROR -  Program error in commands decoder.");
+        programError = true;
         break;
     }
   }
@@ -333,8 +1371,18 @@ void ExecuteRequest(stepper_request * r) {
     default:                    error = SCERR_UNKNONWERROR; break;
   }
   
+  out = ReserveResponse(ch, &response, (parameter == PARAM_ALL || programError) ? MAX_RESPONSE_LENGTH : LINE_RESPONSE_LENGTH);
+  if (out == NULL)
+    return;
+  
+  if (programError) {
+    out = AppendLiteral(out, "ERROR -  Program error in commands decoder.");
+  }
+  
   if (error == SCERR_VALUELIMIT) {
-      printf("LIMIT - %c.%s = %d\r\n", stepper, request_params_arry[parameter], (int32_t)value);
+      out = AppendLiteral(out, "LIMIT - ");
+      out = AppendChar(out, stepper);
+      out = AppendParamValue(out, parameter, (int32_t)value);
   } else if (error) {
     char * errorStr;
     switch(error) {
@@ -343,271 +1391,335 @@ void ExecuteRequest(stepper_request * r) {
         case SCERR_INVALIDCMDPARAM  : errorStr = "Invalid command parameter."; break; 
         default                     : errorStr = "Unknown error."; break;
     }
-    printf("ERROR - %d %s\r\n", error, errorStr);
+    out = AppendError(out, error, errorStr);
   } else {
-    printf("OK - %c", stepper);
+    out = AppendLiteral(out, "OK - ");
+    out = AppendChar(out, stepper);
     if (parameter == PARAM_ALL) {
-        printf("\r\n");
+        out = AppendLiteral(out, "\r\n");
         // start with whatever goes after PARAM_ALL
         request_params param = (request_params)(PARAM_ALL + 1);
         do {
-            value = GetParamValue(stepper, param);
-            if (param == PARAM_STATUS) {
-                printf("\t.%s = 0x%.2X ", request_params_arry[param], (int32_t)value);
-                PrintStepperStatusStr((stepper_status)value);
-                printf("\r\n");
-            } else {
-                printf("\t.%s = %d\r\n", request_params_arry[param], (int32_t)value);
-            }
+            out = AppendChar(out, '\t');
+            out = AppendParamValue(out, param, GetParamValue(stepper, param));
             param++;
         } while (param < __PARAM_COUNT);
     } else {
-        if (parameter == PARAM_STATUS) {
-            printf(".%s = 0x%X2 ", request_params_arry[parameter], (int32_t)value);
-            PrintStepperStatusStr((stepper_status)value);
-            printf("\r\n");
-        } else {
-            printf(".%s = %d\r\n", request_params_arry[parameter], (int32_t)value);
-        }
+        out = AppendParamValue(out, parameter, (int32_t)value);
     }
   }
+  
+  // single DMA transfer for the whole response
+  ch->transport->TxCommit(out - response);
 }
 
-void CleanupDecoder(void) {
+void CleanupDecoder(command_channel * ch) {
       // Prepare to decode next command
-  req.command         = CMD_UNKNOWN;
-  req.stepper         = '\0';
-  req.parameter       = PARAM_UNDEFINED;
-  req.value           = 0;
-  req.isNegativeValue = false;
+  ch->req.command         = CMD_UNKNOWN;
+  ch->req.stepper         = '\0';
+  ch->req.parameter       = PARAM_UNDEFINED;
+  ch->req.value           = 0;
+  ch->req.isNegativeValue = false;
+  ch->req.hasValue        = false;
+  ch->req.hasId           = false;
+  ch->req.id              = 0;
+  ch->req.hasAddress      = false;
+  ch->req.isBroadcast     = false;
+  ch->req.address         = 0;
   
-  currentReqField = REQ_FIELD_CMD;
-  currentReqFieldIndex = 0;
+  ch->currentReqField = REQ_FIELD_CMD;
+  ch->currentReqFieldIndex = 0;
 }
 
-void DecodeCmd(uint8_t data) {
-  int filteredItemsCount = __CMD_COUNT - 1;       // exclude CMD_UNKNOWN from filter
-  request_commands cmd = (request_commands) 1;  // start with whatever CMD goes first (but not CMD_UNKNOWN = 0) 
-  
-  int validCmdLength;
-  request_commands validCmd = CMD_UNKNOWN;
-  
-  if (currentReqFieldIndex == 0) {   
-    filteredItems = UINT32_MAX;
+uint8_t TrieSymbol(uint8_t data) {
+  if (data >= 'A' && data <= 'Z') return data - 'A' + 1;
+  if (data == '_') return TRIE_SYMBOLS_COUNT - 1;
+  return 0;
+}
+
+void InitDecoder(void) {
+  CommandChannel_Init(&serialChannel, &serialTransport);
+}
+
+bool CommandChannel_Init(command_channel * ch, const command_transport * transport) {
+  memset(ch, 0, sizeof(command_channel));
+  ch->transport = transport;
+  CleanupDecoder(ch);
+  return Stepper_RegisterTargets(&ch->committedTargets) == SERR_OK;
+}
+
+void CommandChannel_Receive(command_channel * ch, const uint8_t * data, uint32_t length) {
+  while (length--)
+    Decode(ch, *data++);
+}
+
+void AcceptCmd(command_channel * ch, request_commands cmd) {
+  // remember decoded CMD
+  ch->req.command = cmd;
+  ch->currentReqFieldIndex = 0;
+  // transaction brackets and sync have no other fields - execute immediately
+  if (cmd == CMD_BEGIN || cmd == CMD_COMMIT || cmd == CMD_SYNC) {
+    ExecuteRequest(ch, &ch->req);
+    CleanupDecoder(ch);
+    return;
   }
+  // baud rate, address, save, profile, isr, load, trace and capture have the value only
+  if (cmd == CMD_BAUD || cmd == CMD_ADDRESS || cmd == CMD_SAVE || cmd == CMD_PROFILE || cmd == CMD_ISR || cmd == CMD_LOAD ||
+      cmd == CMD_TRACE || cmd == CMD_CAPTURE) {
+    ch->currentReqField = REQ_FIELD_VALUE;
+    return;
+  }
+  // goto STEPPER decoding
+  ch->currentReqField = REQ_FIELD_STEPPER;
+}
+
+void DecodeCmd(command_channel * ch, uint8_t data) {
+  uint8_t node = (ch->currentReqFieldIndex == 0) ? TRIE_ROOT : ch->currentReqFieldIndex;
+  uint8_t next = commandsTrie.next[node][TrieSymbol(data)];
   
-  do {
-    if (filteredItems & (1u << cmd)) {
-      char * cmdStr = request_commands_arry[cmd];
-      int cmdLength = strlen(cmdStr);  
-      if (cmdLength > currentReqFieldIndex && cmdStr[currentReqFieldIndex] == data) {
-        validCmd = cmd;
-        validCmdLength = cmdLength;
-      } else {
-        filteredItems &= ~(1 << cmd);
-        filteredItemsCount --;
-      }
+  if (next) {
+    if (!commandsTrie.hasNext[next]) {
+      // the only possible keyword is complete
+      AcceptCmd(ch, (request_commands)commandsTrie.keyword[next]);
     } else {
-      // CMD has been filtered earlier
-      filteredItemsCount --;
+      // Prepare to validate next char of the command name
+      ch->currentReqFieldIndex = next;
     }
-    cmd++;
-  } while (cmd < __CMD_COUNT);
+    return;
+  }
   
-  // nothing found, everything has been filtered out
-  if (filteredItemsCount == 0) {
-    
-    // we were at the begining of CMD decoding,
-    // but data character doesn't go as first symbol of any known command
-    // so we just keep looking for the one which fits.
-    
-    if (currentReqFieldIndex > 0) {
-      // if we passed thorugh a symbol or two - it could be some data loss
-      // the current symbol might be the begining of new command
-      // try recursively recognize it
-      currentReqFieldIndex = 0;
-      DecodeCmd(data);
+  if (node == TRIE_ROOT) {
+    // optional request tag goes before the command
+    if (data == '#') {
+      ch->req.hasId = true;
+      ch->req.id = 0;
+      ch->currentReqField = REQ_FIELD_ID;
+      return;
     }
-    
+    // optional hub address goes before the command as well
+    if (data == '@') {
+      ch->req.hasAddress = true;
+      ch->req.address = 0;
+      ch->currentReqField = REQ_FIELD_ADDRESS;
+      ch->currentReqFieldIndex = 0;
+      return;
+    }
+    // request never spans lines, so the tag and address (if any) can't belong to the next one
+    if (data == '\r' || data == '\n') {
+      CleanupDecoder(ch);
+      return;
+    }
+    // data character doesn't go as first symbol of any known command
+    // so we just keep looking for the one which fits.
     return;
-  } else if (filteredItemsCount == 1 && validCmdLength - 1 == currentReqFieldIndex) {
-    // remember decoded CMD
-    req.command = validCmd;
-    // goto STEPPER decoding
-    currentReqField = REQ_FIELD_STEPPER;
-    currentReqFieldIndex = 0;
-  } else {
-    // Prepare to validate next char of the parameter name
-    currentReqFieldIndex++;
   }
+  
+  if (commandsTrie.keyword[node]) {
+    // shorter keyword is complete, and the data is not a continuation of the longer one
+    AcceptCmd(ch, (request_commands)commandsTrie.keyword[node]);
+    Decode(ch, data);
+    return;
+  }
+  
+  // if we passed thorugh a symbol or two - it could be some data loss
+  // the current symbol might be the begining of new command
+  // try recursively recognize it
+  ch->currentReqFieldIndex = 0;
+  DecodeCmd(ch, data);
 }
 
-void DecodeStepper(uint8_t data) {
+void DecodeStepper(command_channel * ch, uint8_t data) {
   if (Stepper_GetStatus(data) == SS_UNDEFINED) {
     // There is no such stepper found
     // So return error immediately
-    ExecuteRequest(&req);
-    CleanupDecoder();
+    ExecuteRequest(ch, &ch->req);
+    CleanupDecoder(ch);
     // So, now we might be looking also on the very forst char of the next command
-    DecodeCmd(data); 
+    DecodeCmd(ch, data); 
     return;
   }
   // remember it and continue if everything is good 
-  req.stepper = data;
+  ch->req.stepper = data;
   // Goto PARAM decoding
-  currentReqField = REQ_FIELD_PARAM;
-  currentReqFieldIndex = 0;
+  ch->currentReqField = REQ_FIELD_PARAM;
+  ch->currentReqFieldIndex = 0;
 }
 
-void DecodeParam(uint8_t data) {
-  int filteredItemsCount = __PARAM_COUNT - 1;   // exclude PARAM_UNDEFINED from filter
-  request_params param = (request_params) 1;  // start with whatever PARAM goes first (but not PARAM_UNDEFINED = 0) 
-  
-  int validParamLength;
-  request_params validParam = PARAM_UNDEFINED;
-  
-  int charIndex = currentReqFieldIndex - 1;
+void DecodeParam(command_channel * ch, uint8_t data) {
+  uint8_t node = ch->currentReqFieldIndex;
+  uint8_t next;
   
-  if (currentReqFieldIndex == 0) {   
+  if (node == 0) {   
     // the first symbol should go "." separator
     if (data == '.') {
-      filteredItems = UINT32_MAX;
-      currentReqFieldIndex++;
+      ch->currentReqFieldIndex = TRIE_ROOT;
       return;
     } 
     
     // Missing expected parameter separator
     // goto VALUE decoding, which might go next
-    currentReqField = REQ_FIELD_VALUE;
+    ch->currentReqField = REQ_FIELD_VALUE;
     // and we might look at the first value char at the moment - so go for it
-    DecodeValue(data);
+    DecodeValue(ch, data);
     return;
   }
   
-  do {
-    // filter check to avoid excessive calculations
-    if (filteredItems & (1 << param)) {
-      char * paramStr = request_params_arry[param];
-      int paramLength = strlen(paramStr); 
-      if (paramLength > charIndex && paramStr[charIndex] == data) {
-        validParam = param;
-        validParamLength = paramLength;
-      } else {
-        filteredItems &= ~(1 << param);
-        filteredItemsCount --;
-      }
+  next = paramsTrie.next[node][TrieSymbol(data)];
+  
+  if (next) {
+    if (!paramsTrie.hasNext[next]) {
+      // the only possible parameter is complete, remember it and goto value decoding
+      ch->req.parameter = (request_params)paramsTrie.keyword[next];
+      ch->currentReqField = REQ_FIELD_VALUE;
+      ch->currentReqFieldIndex = 0;
     } else {
-      // PARAM has been filtered earlier
-      filteredItemsCount --;
+      // Prepare to validate next char of the parameter name
+      ch->currentReqFieldIndex = next;
     }
-    param++;
-  } while (param < __PARAM_COUNT);
-  
-  // if we have only one item in the filtered list and we reached its end - we are done with PARAM decoding
-  if (filteredItemsCount == 1 && validParamLength == charIndex+1) {
-    // remember decoded PARAM
-    req.parameter = validParam;
-    // goto value decoding
-    currentReqField = REQ_FIELD_VALUE;
-    currentReqFieldIndex = 0;
-    return;
-  }
-
-  // if all params have been filtered out - the data character might belong to, 
-  // the REQ_FIELD_VALUE or the begining of next command (REQ_FIELD_CMD).
-  if (filteredItemsCount == 0) {
-    // goto value decoding
-    currentReqField = REQ_FIELD_VALUE;
-    currentReqFieldIndex = 0;
-    // and we might look at the first value char at the moment - so go for it
-    DecodeValue(data);
     return;
   }
   
-  // Prepare to validate next char of the parameter name
-  currentReqFieldIndex++;
+  // shorter parameter might be complete, while the data is not a continuation of the longer one
+  ch->req.parameter = (request_params)paramsTrie.keyword[node];
+  
+  // the data character might belong to, 
+  // the REQ_FIELD_VALUE or the begining of next command (REQ_FIELD_CMD).
+  ch->currentReqField = REQ_FIELD_VALUE;
+  ch->currentReqFieldIndex = 0;
+  // and we might look at the first value char at the moment - so go for it
+  DecodeValue(ch, data);
 }
 
-void DecodeValue(uint8_t data) {
-  if (currentReqFieldIndex == 0) {
+void DecodeValue(command_channel * ch, uint8_t data) {
+  if (ch->currentReqFieldIndex == 0) {
     // the first symbol should go ":" separator
     if (data == ':') {
-      currentReqFieldIndex++;
+      ch->req.hasValue = true;
+      ch->currentReqFieldIndex++;
       return;
     } 
     
     // Missing expected parameter separator
     // maybe there are no optional value provided
     // so execute whatever we got
-    ExecuteRequest(&req);
-    CleanupDecoder();
+    ExecuteRequest(ch, &ch->req);
+    CleanupDecoder(ch);
     // and we might be looking at the first char of the next command
     // so - go for it!
-    DecodeCmd(data);
+    DecodeCmd(ch, data);
     return;
   }
   
-  if (currentReqFieldIndex == 1) {
+  if (ch->currentReqFieldIndex == 1) {
     // Remember that we are decoding negative value, e.g. "setX:-2131"
     if (data == '-') {
-      req.isNegativeValue = true;
-      currentReqFieldIndex++;
+      ch->req.isNegativeValue = true;
+      ch->currentReqFieldIndex++;
       return;
     }
     
     // Just skip in case of there is a positive sign, e.g. "setX:+2131"
     if (data == '+') {
-      currentReqFieldIndex++;
+      ch->currentReqFieldIndex++;
       return;
     }
   }
   
   // This is the number of chars we have with ":", sign specifier "+/-" and the actual 10 digits for int32
   // ":-2147483648" to ":+2147483647"
-  // so, maximum currentReqFieldIndex value is 11
+  // so, maximum ch->currentReqFieldIndex value is 11
   // to detect the OVERFLOW error we should catch at least 12 chars (if there are more than 11). 
 
   static const int INT32_OVERFLOW = 12;
     
-  if (data>='0' && data<='9' && currentReqFieldIndex <= INT32_OVERFLOW) {
-    req.value *= 10;
-    req.value += data - '0'; 
-    currentReqFieldIndex++;
+  if (data>='0' && data<='9' && ch->currentReqFieldIndex <= INT32_OVERFLOW) {
+    ch->req.value *= 10;
+    ch->req.value += data - '0'; 
+    ch->currentReqFieldIndex++;
   }
   else {
-    ExecuteRequest(&req);
-    CleanupDecoder();
+    ExecuteRequest(ch, &ch->req);
+    CleanupDecoder(ch);
     // and we might be looking at the first char of the next command
     // so - go for it!
-    DecodeCmd(data);
+    DecodeCmd(ch, data);
+  }
+}
+
+void DecodeId(command_channel * ch, uint8_t data) {
+  if (data>='0' && data<='9') {
+    uint64_t id = (uint64_t)ch->req.id * 10 + (data - '0');
+    if (id > UINT32_MAX) {
+      // it's not a tag - line noise, so drop everything we've got
+      // (digits are ignored by the command decoder, so we are back in sync at the next command)
+      CleanupDecoder(ch);
+      return;
+    }
+    ch->req.id = (uint32_t)id;
+    return;
   }
+  // tag is done, go for the command
+  ch->currentReqField = REQ_FIELD_CMD;
+  ch->currentReqFieldIndex = 0;
+  DecodeCmd(ch, data);
 }
 
-void Decode(uint8_t data) {
+void DecodeAddress(command_channel * ch, uint8_t data) {
+  if (data == '*' && ch->currentReqFieldIndex == 0) {
+    ch->req.isBroadcast = true;
+    ch->currentReqFieldIndex++;
+    return;
+  }
+  if (data>='0' && data<='9' && !ch->req.isBroadcast) {
+    // up to 3 digits, anything longer is line noise (the same as with the tag)
+    if (ch->currentReqFieldIndex == 3) {
+      CleanupDecoder(ch);
+      return;
+    }
+    ch->req.address = ch->req.address * 10 + (data - '0');
+    ch->currentReqFieldIndex++;
+    return;
+  }
+  // address is done, go for the command
+  ch->currentReqField = REQ_FIELD_CMD;
+  ch->currentReqFieldIndex = 0;
+  DecodeCmd(ch, data);
+}
+
+void Decode(command_channel * ch, uint8_t data) {
   // to upper
   if (data >= 'a' && data <= 'z') {
     data -= ('a' - 'A');
   }
 
-  switch (currentReqField){
+  switch (ch->currentReqField){
     case REQ_FIELD_CMD:
-      DecodeCmd(data);
+      DecodeCmd(ch, data);
       break;
     case REQ_FIELD_STEPPER:
-      DecodeStepper(data);
+      DecodeStepper(ch, data);
       break;
     case REQ_FIELD_PARAM:
-      DecodeParam(data);
+      DecodeParam(ch, data);
       break;
     case REQ_FIELD_VALUE:
-      DecodeValue(data);
+      DecodeValue(ch, data);
+      break;
+    case REQ_FIELD_ID:
+      DecodeId(ch, data);
+      break;
+    case REQ_FIELD_ADDRESS:
+      DecodeAddress(ch, data);
       break;
   }
 }
 
-// Override serial interface callback
-// TODO: Implement other interfaces in future if needed (I2C, CAN, etc) 
+// Override serial interface callback (invoked from the main loop by Serial_ProcessReceived),
+// other interfaces (I2C, CAN, etc) should have their own command_channel and feed it with CommandChannel_Receive
 void Serial_RxCallback(uint8_t data) {
-   Decode(data);
+#if defined(RX_CAPTURE)
+   RxCapture_Record(data);
+#endif
+   Decode(&serialChannel, data);
 }
 
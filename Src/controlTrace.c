@@ -0,0 +1,87 @@
+#include <string.h>
+#include "controlTrace.h"
+#include "serial.h"
+
+#if defined(CONTROL_TRACE)
+
+// Stepper_GetControllerTick() when the trace has been cleared, records have the ticks since then
+static volatile uint32_t baseTick;
+
+static trace_record records[TRACE_RECORDS];
+// records written since the trace has been cleared (the ring keeps the last TRACE_RECORDS of them)
+static volatile uint32_t recordsCount;
+// set by the main loop only, the controller interrupt doesn't record while the ring is being sent
+static volatile bool frozen;
+static uint32_t dumpNext;
+static uint32_t dumpEnd;
+
+void ControlTrace_Init(void) {
+  ControlTrace_Clear();
+}
+
+void ControlTrace_Record(stepper_state * stepper, trace_event event, uint8_t fromStatus, float estimatedTime, float requiredTime) {
+  trace_record * r;
+
+  if (frozen)
+    return;
+
+  r = &records[recordsCount & (TRACE_RECORDS - 1)];
+  r->tick           = Stepper_GetControllerTick() - baseTick;
+  r->stepper        = stepper->name;
+  r->event          = event;
+  r->fromStatus     = fromStatus;
+  r->toStatus       = stepper->status;
+  r->currentSPS     = stepper->currentSPS;
+  r->stepsToTarget  = stepper->targetPosition - stepper->currentPosition;
+  if (stepper->status & SS_RUNNING_BACKWARD)
+    r->stepsToTarget = -r->stepsToTarget;
+  r->estimatedTime  = estimatedTime;
+  r->requiredTime   = requiredTime;
+  recordsCount++;
+}
+
+uint32_t ControlTrace_StartDump(uint32_t * total) {
+  // the controller interrupt preempts the main loop, so once it's frozen the ring doesn't change
+  frozen = true;
+  dumpEnd = recordsCount;
+  dumpNext = (dumpEnd > TRACE_RECORDS) ? dumpEnd - TRACE_RECORDS : 0;
+  *total = dumpEnd;
+  return dumpEnd - dumpNext;
+}
+
+bool ControlTrace_SendPending(void) {
+  uint32_t count;
+  uint32_t first;
+  bool sent = false;
+
+  if (!frozen)
+    return false;
+
+  while (dumpNext != dumpEnd) {
+    count = dumpEnd - dumpNext;
+    if (count > TRACE_RECORDS_PER_FRAME)
+      count = TRACE_RECORDS_PER_FRAME;
+    // a frame doesn't go across the ring end, so its records are contiguous
+    first = dumpNext & (TRACE_RECORDS - 1);
+    if (count > TRACE_RECORDS - first)
+      count = TRACE_RECORDS - first;
+    // the offset is the index of the first record
+    if (!Serial_SendBulkFrame(TRACE_FRAME_SYNC, dumpNext, &records[first], count * sizeof(trace_record)))
+      return sent;
+    dumpNext += count;
+    sent = true;
+  }
+
+  frozen = false;
+  return true;
+}
+
+void ControlTrace_Clear(void) {
+  frozen = true;
+  recordsCount = 0;
+  baseTick = Stepper_GetControllerTick();
+  dumpNext = dumpEnd = 0;
+  frozen = false;
+}
+
+#endif
@@ -0,0 +1,86 @@
+#include <string.h>
+#include "isrProfiler.h"
+
+#if defined(ISR_PROFILING)
+
+static const char * isrNames[__ISR_COUNT] = { "TIM1", "TIM2", "TIM3", "TIM14", "DMA.RX", "DMA.TX", "USART2" };
+static isr_stats isrStats[__ISR_COUNT];
+static cpu_load load;
+static uint32_t windowStart;
+
+volatile uint32_t isrProfileCycles;
+
+uint32_t HistogramBucket(uint32_t value) {
+  uint32_t bucket = 32 - __CLZ(value);
+  return (bucket < ISR_HISTOGRAM_BUCKETS) ? bucket : ISR_HISTOGRAM_BUCKETS - 1;
+}
+
+void IsrProfiler_Init(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  IsrProfiler_Reset();
+}
+
+void IsrProfiler_Record(isr_source source, uint32_t latency, uint32_t start, uint32_t preempted) {
+  isr_stats * stats = &isrStats[source];
+  uint32_t total;
+  uint32_t duration;
+  
+  // The handlers which have preempted this one added their time to isrProfileCycles, our own time goes instead of theirs.
+  // If one more preempts us right here, the exclusive store fails, and the duration is taken again.
+  do {
+    total = __LDREXW(&isrProfileCycles);
+    duration = DWT->CYCCNT - start;
+  } while (__STREXW(preempted + duration, &isrProfileCycles));
+  stats->cycles += duration - (total - preempted);
+  
+  stats->count++;
+  if (latency != ISR_LATENCY_UNKNOWN) {
+    stats->latency[HistogramBucket(latency)]++;
+    if (latency > stats->maxLatency)
+      stats->maxLatency = latency;
+  }
+  stats->duration[HistogramBucket(duration)]++;
+  if (duration > stats->maxDuration)
+    stats->maxDuration = duration;
+}
+
+void IsrProfiler_RecordMain(main_section section, uint32_t start, uint32_t preempted) {
+  uint32_t duration = DWT->CYCCNT - start;
+  load.main[section] += duration - (isrProfileCycles - preempted);
+}
+
+void IsrProfiler_UpdateWindow(void) {
+  uint32_t now = DWT->CYCCNT;
+  load.window += now - windowStart;
+  windowStart = now;
+}
+
+const cpu_load * IsrProfiler_GetLoad(void) {
+  IsrProfiler_UpdateWindow();
+  return &load;
+}
+
+const isr_stats * IsrProfiler_GetStats(isr_source source) {
+  return &isrStats[source];
+}
+
+const char * IsrProfiler_GetName(isr_source source) {
+  return isrNames[source];
+}
+
+void IsrProfiler_Reset(void) {
+  memset(isrStats, 0, sizeof(isrStats));
+  IsrProfiler_ResetLoad();
+}
+
+void IsrProfiler_ResetLoad(void) {
+  isr_source source;
+  for (source = ISR_TIM1; source < __ISR_COUNT; source++)
+    isrStats[source].cycles = 0;
+  memset(&load, 0, sizeof(load));
+  windowStart = DWT->CYCCNT;
+}
+
+#endif
@@ -38,6 +38,12 @@
 #include "stepperController.h"
 #include "stepperCommands.h"
 #include "serial.h"
+#include "telemetry.h"
+#include "positionJournal.h"
+#include "isrProfiler.h"
+#include "stepJitter.h"
+#include "controlTrace.h"
+#include "rxCapture.h"
 //#define TEST
 
 /* USER CODE END Includes */
@@ -79,6 +85,18 @@ void HAL_TIM_MspPostInit(TIM_HandleTypeDef *htim);
 
 /* USER CODE BEGIN 0 */
 
+#if defined(POSITION_JOURNAL)
+void RestorePosition(char stepper) {
+  int32_t position;
+  if (Journal_RestorePosition(stepper, &position)) {
+    Stepper_SetCurrentPosition(stepper, position);
+    printf("  %c = %d\r\n", stepper, position);
+  } else {
+    printf("  %c - unknown, must be homed\r\n", stepper);
+  }
+}
+#endif
+
 /* USER CODE END 0 */
 
 int main(void)
@@ -113,6 +131,13 @@ int main(void)
   STEP_TIMER_CLOCK = HAL_RCC_GetHCLKFreq();
   STEP_CONTROLLER_PERIOD_US =  1000000U /(HAL_RCC_GetHCLKFreq() / htim14.Init.Period);
   
+#if defined(ISR_PROFILING)
+  IsrProfiler_Init();
+#endif
+#if defined(CONTROL_TRACE)
+  ControlTrace_Init();
+#endif
+  
   
   printf("\r\n");
   printf ("============== Stepper Hub ==============\r\n");
@@ -123,10 +148,13 @@ int main(void)
   Stepper_SetupPeripherals('Y', &htim2, TIM_CHANNEL_2, GPIOB, GPIO_PIN_10);
   Stepper_SetupPeripherals('Z', &htim3, TIM_CHANNEL_2, GPIOA, GPIO_PIN_8);
   
-  printf("Reading settings from internal storage...\r\n");
-  Stepper_LoadConfig();
+#if defined(POSITION_JOURNAL)
+  // before the config, the defaults of a clean storage are journaled as well
+  Journal_Init();
+#endif
   
-  if (Stepper_GetAccPrescaler('Z') == 0xFFFFFFFF) {
+  printf("Reading settings from internal storage...\r\n");
+  if (!Stepper_LoadConfig()) {
     printf("Storage is clean, initializing defaults ...\r\n");
     Stepper_InitDefaultState('X');
     Stepper_InitDefaultState('Y');
@@ -135,10 +163,23 @@ int main(void)
   }
   printf("DONE!\r\n\r\n");
   
+#if defined(POSITION_JOURNAL)
+  printf("Restoring positions from backup SRAM...\r\n");
+  RestorePosition('X');
+  RestorePosition('Y');
+  RestorePosition('Z');
+  printf("DONE!\r\n\r\n");
+#endif
+  
+#if defined(STEP_JITTER)
+  Jitter_Init();
+#endif
+  
   __HAL_TIM_ENABLE_IT(&htim1, TIM_IT_UPDATE);
   __HAL_TIM_ENABLE_IT(&htim2, TIM_IT_UPDATE);
   __HAL_TIM_ENABLE_IT(&htim3, TIM_IT_UPDATE);
 
+  InitDecoder();
   Serial_InitRxSequence();
 
   HAL_Delay(1);
@@ -148,11 +189,11 @@ int main(void)
 
   // TODO: load settingsfrom FLASH
   stReq.stepper = 'X';
-  ExecuteRequest(&stReq);
+  ExecuteRequest(&serialChannel, &stReq);
   stReq.stepper = 'Y';
-  ExecuteRequest(&stReq);
+  ExecuteRequest(&serialChannel, &stReq);
   stReq.stepper = 'Z';
-  ExecuteRequest(&stReq);
+  ExecuteRequest(&serialChannel, &stReq);
 #if defined (TEST) 
 
   Stepper_SetTargetPosition('X',10);
@@ -181,6 +222,23 @@ int main(void)
     printf("PF %d\r\n", i++);
 #endif
 
+    MAIN_PROFILE_PASS();
+    // requests are decoded and executed here, never in interrupts
+    MAIN_PROFILE(MAIN_DECODE, Serial_ProcessReceived() != 0);
+    Serial_CheckBaudRateFallback();
+    MAIN_PROFILE(MAIN_OTHER, Stepper_SavePendingConfig());
+#if defined(STEP_JITTER)
+    Jitter_Poll();
+#endif
+    MAIN_PROFILE(MAIN_OTHER, ReportStepperEvents(&serialChannel));
+    MAIN_PROFILE(MAIN_OTHER, Telemetry_SendPendingFrame());
+#if defined(CONTROL_TRACE)
+    MAIN_PROFILE(MAIN_OTHER, ControlTrace_SendPending());
+#endif
+#if defined(RX_CAPTURE)
+    MAIN_PROFILE(MAIN_OTHER, RxCapture_SendPending());
+#endif
+
   /* USER CODE END WHILE */
 
   /* USER CODE BEGIN 3 */
@@ -391,7 +449,7 @@ void MX_DMA_Init(void)
 
   /* DMA interrupt init */
   /* DMA1_Stream5_IRQn interrupt configuration */
-  HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 3, 0);
+  HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 4, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
   /* DMA1_Stream6_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA1_Stream6_IRQn, 4, 0);
@@ -459,6 +517,7 @@ void MX_GPIO_Init(void)
 
 void TIM1_UP_TIM10_IRQHandler(void)
 {
+  ISR_PROFILE_BEGIN(IsrProfiler_DownCounterLatency(htim1.Instance));
   if (__HAL_TIM_GET_FLAG(&htim1, TIM_FLAG_UPDATE))
   {
     if (__HAL_TIM_GET_ITSTATUS(&htim1, TIM_IT_UPDATE))
@@ -467,6 +526,7 @@ void TIM1_UP_TIM10_IRQHandler(void)
       __HAL_TIM_CLEAR_FLAG(&htim1, TIM_FLAG_UPDATE);
       Stepper_PulseTimerUpdate('X');
       //HAL_GPIO_WritePin(GPIOB, GPIO_PIN_4, GPIO_PIN_RESET);
+      ISR_PROFILE_END(ISR_TIM1);
     }
   }
 }
@@ -474,6 +534,7 @@ void TIM1_UP_TIM10_IRQHandler(void)
 
 void TIM2_IRQHandler(void)
 {
+  ISR_PROFILE_BEGIN(IsrProfiler_DownCounterLatency(htim2.Instance));
   if (__HAL_TIM_GET_FLAG(&htim2, TIM_FLAG_UPDATE))
   {
     if (__HAL_TIM_GET_ITSTATUS(&htim2, TIM_IT_UPDATE))
@@ -482,12 +543,14 @@ void TIM2_IRQHandler(void)
       __HAL_TIM_CLEAR_FLAG(&htim2, TIM_FLAG_UPDATE);
       Stepper_PulseTimerUpdate('Y');
       //HAL_GPIO_WritePin(GPIOB, GPIO_PIN_10, GPIO_PIN_RESET);
+      ISR_PROFILE_END(ISR_TIM2);
     }
   }
 }
 
 void TIM3_IRQHandler(void)
 {
+  ISR_PROFILE_BEGIN(IsrProfiler_DownCounterLatency(htim3.Instance));
   if (__HAL_TIM_GET_FLAG(&htim3, TIM_FLAG_UPDATE))
   {
     if (__HAL_TIM_GET_ITSTATUS(&htim3, TIM_IT_UPDATE))
@@ -496,12 +559,14 @@ void TIM3_IRQHandler(void)
       __HAL_TIM_CLEAR_FLAG(&htim3, TIM_FLAG_UPDATE);
       Stepper_PulseTimerUpdate('Z');
       //HAL_GPIO_WritePin(GPIOA, GPIO_PIN_8, GPIO_PIN_RESET);
+      ISR_PROFILE_END(ISR_TIM3);
     }
   }
 }
 
 void TIM8_TRG_COM_TIM14_IRQHandler(void)
 {
+  ISR_PROFILE_BEGIN(IsrProfiler_UpCounterLatency(htim14.Instance));
   if (__HAL_TIM_GET_FLAG(&htim14, TIM_FLAG_UPDATE))
   {
     if (__HAL_TIM_GET_ITSTATUS(&htim14, TIM_IT_UPDATE))
@@ -510,9 +575,13 @@ void TIM8_TRG_COM_TIM14_IRQHandler(void)
       __HAL_TIM_CLEAR_FLAG(&htim14, TIM_FLAG_UPDATE);
       
       Stepper_ExecuteAllControllers();
-      Serial_CheckRxTimeout();
+      Telemetry_ControllerTick();
+#if defined(STEP_JITTER)
+      Jitter_ControllerTick();
+#endif
       
       HAL_GPIO_WritePin(GPIOA, LED_Pin, GPIO_PIN_RESET);
+      ISR_PROFILE_END(ISR_TIM14);
     }
   }
 }
@@ -0,0 +1,104 @@
+#include "stm32f4xx_hal.h"
+#include "stepperController.h"
+#include "positionJournal.h"
+
+#define JOURNAL_MAGIC         (0x4A4E0000 | MAX_STEPPERS_COUNT)   // "JN" + entries count
+#define JOURNAL_ENTRY_MARK    0x5A0000
+#define JOURNAL_CHECK_SEED    0xC3A5965A
+
+typedef enum {
+  JS_STOPPED  = 0x01,
+  JS_MOVING   = 0x02
+} journal_state;
+
+typedef struct {
+  volatile uint32_t tag;
+  volatile int32_t  position;
+  volatile uint32_t check;
+} journal_entry;
+
+typedef struct {
+  volatile uint32_t magic;
+  journal_entry     entries[MAX_STEPPERS_COUNT];
+} journal;
+
+static journal * const bkpJournal = (journal *)BKPSRAM_BASE;
+
+// Entry of the stepper, or a free one if there is no entry yet (NULL if all are taken)
+journal_entry * GetEntry(char stepper) {
+  journal_entry * freeEntry = NULL;
+  int32_t i;
+  
+  for (i=0; i < MAX_STEPPERS_COUNT; i++) {
+    uint32_t tag = bkpJournal->entries[i].tag;
+    if ((tag & 0xFF) == (uint8_t)stepper)
+      return &bkpJournal->entries[i];
+    if (tag == 0 && freeEntry == NULL)
+      freeEntry = &bkpJournal->entries[i];
+  }
+  return freeEntry;
+}
+
+void WriteEntry(char stepper, journal_state state, int32_t position) {
+  journal_entry * entry = GetEntry(stepper);
+  uint32_t tag = JOURNAL_ENTRY_MARK | (state << 8) | (uint8_t)stepper;
+  
+  if (entry == NULL)
+    return;
+  // check goes last - an entry torn by power loss doesn't pass it
+  entry->check    = 0;
+  entry->tag      = tag;
+  entry->position = position;
+  entry->check    = tag ^ (uint32_t)position ^ JOURNAL_CHECK_SEED;
+}
+
+void Journal_Init(void) {
+  int32_t i;
+  
+  __HAL_RCC_PWR_CLK_ENABLE();
+  HAL_PWR_EnableBkUpAccess();
+  __HAL_RCC_BKPSRAM_CLK_ENABLE();
+  // backup regulator keeps BKPSRAM powered from VBAT
+  HAL_PWREx_EnableBkUpReg();
+  
+  if (bkpJournal->magic == JOURNAL_MAGIC)
+    return;
+  
+  // first power-up on the battery (or another firmware layout) - the content is random
+  for (i=0; i < MAX_STEPPERS_COUNT; i++) {
+    bkpJournal->entries[i].tag      = 0;
+    bkpJournal->entries[i].position = 0;
+    bkpJournal->entries[i].check    = 0;
+  }
+  bkpJournal->magic = JOURNAL_MAGIC;
+}
+
+void Journal_RecordStopped(char stepper, int32_t position) {
+  WriteEntry(stepper, JS_STOPPED, position);
+}
+
+void Journal_RecordMoving(char stepper) {
+  WriteEntry(stepper, JS_MOVING, 0);
+}
+
+bool Journal_RestorePosition(char stepper, int32_t * position) {
+  journal_entry * entry = GetEntry(stepper);
+  uint32_t tag;
+  
+  if (entry == NULL)
+    return false;
+  
+  tag = entry->tag;
+  if (tag == 0) {
+    // take the entry now, so the interrupts never race for a free one
+    WriteEntry(stepper, JS_MOVING, 0);
+    return false;
+  }
+  if (tag != (JOURNAL_ENTRY_MARK | (JS_STOPPED << 8) | (uint8_t)stepper))
+    return false;
+  if (entry->check != (tag ^ (uint32_t)entry->position ^ JOURNAL_CHECK_SEED))
+    return false;
+  
+  *position = entry->position;
+  return true;
+}
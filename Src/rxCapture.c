@@ -0,0 +1,170 @@
+#include <string.h>
+#include "rxCapture.h"
+#include "stepperCommands.h"
+#include "telemetry.h"
+#include "serial.h"
+
+#if defined(RX_CAPTURE)
+
+// escape + 5 varint bytes of the tick delta, and the byte itself (escaped in the worst case)
+#define CAPTURE_MAX_RECORD        (1 + 5 + 2)
+
+typedef enum {
+  CS_IDLE       = 0,
+  CS_RECORDING  = 1,
+  CS_DUMPING    = 2
+} capture_state;
+
+// written by the main loop only
+static capture_state state = CS_IDLE;
+static struct {
+  capture_header  header;
+  uint8_t         stream[RX_CAPTURE_SIZE];
+} capture;
+static uint32_t lastTick;
+static uint32_t dumpNext;
+static uint32_t dumpEnd;
+
+stepper_error RxCapture_Start(void) {
+  capture_stepper * snapshot;
+  capture_profile * profile;
+  stepper_targets * committed = &serialChannel.committedTargets;
+  telemetry_fields fields;
+  char name;
+  int32_t i;
+  int32_t p;
+
+  for (i = 0; (name = Stepper_GetName(i)) != '\0'; i++) {
+    if (!(Stepper_GetStatus(name) & SS_STOPPED))
+      return SERR_MUSTBESTOPPED;
+  }
+
+  memset(&capture.header, 0, sizeof(capture.header));
+  capture.header.magic              = RX_CAPTURE_MAGIC;
+  capture.header.clock              = STEP_TIMER_CLOCK;
+  capture.header.controllerPeriodUs = STEP_CONTROLLER_PERIOD_US;
+  // TIM14 runs at the step timers clock too (TIMPRE is activated)
+  capture.header.controllerCycles   = (TIM14->ARR + 1) * (TIM14->PSC + 1);
+  capture.header.hubAddress         = Stepper_GetHubAddress();
+  capture.header.profile            = Stepper_GetProfile();
+
+  for (i = 0; (name = Stepper_GetName(i)) != '\0'; i++) {
+    snapshot = &capture.header.steppers[i];
+    snapshot->name          = name;
+    snapshot->position      = Stepper_GetCurrentPosition(name);
+    for (p = 0; p < CONFIG_PROFILES_COUNT; p++) {
+      profile = &snapshot->profiles[p];
+      if (Stepper_GetProfileParams(name, p, &profile->minSPS, &profile->maxSPS, &profile->accSPS, &profile->accPrescaler))
+        snapshot->profilesSet |= 1 << p;
+    }
+  }
+  capture.header.steppersCount = (uint8_t)i;
+
+  capture.header.telemetryPeriodMs = Telemetry_GetPeriod();
+  for (i = 0; Telemetry_GetSubscription(i, &name, &fields); i++) {
+    capture.header.subscriptions[i].stepper = name;
+    capture.header.subscriptions[i].fields  = (uint8_t)fields;
+  }
+  capture.header.subscriptionsCount = (uint8_t)i;
+
+  // the capture request itself goes through the serial channel, so its transaction is not changing meanwhile
+  if (serialChannel.transactionActive)
+    capture.header.flags |= RX_CAPTURE_FLAG_TRANSACTION;
+  if (serialChannel.transactionFailed)
+    capture.header.flags |= RX_CAPTURE_FLAG_FAILED;
+  capture.header.stagedCount = (uint8_t)serialChannel.transactionCount;
+  memcpy(capture.header.stagedSteppers, serialChannel.transactionSteppers, sizeof(capture.header.stagedSteppers));
+  memcpy(capture.header.stagedTargets, serialChannel.transactionTargets, sizeof(capture.header.stagedTargets));
+  // committed by this main loop pass, the steppers start on the next controller tick
+  if (committed->pending) {
+    for (i = 0; i < committed->count; i++) {
+      capture.header.committedSteppers[i] = committed->steppers[i];
+      capture.header.committedTargets[i]  = committed->targets[i];
+    }
+    capture.header.committedCount = (uint8_t)i;
+  }
+
+  lastTick = capture.header.startTick = Stepper_GetControllerTick();
+  state = CS_RECORDING;
+  return SERR_OK;
+}
+
+void RxCapture_Stop(void) {
+  if (state != CS_RECORDING)
+    return;
+  capture.header.ticks = Stepper_GetControllerTick() - capture.header.startTick;
+  state = CS_IDLE;
+}
+
+void RxCapture_Record(uint8_t data) {
+  uint32_t tick;
+  uint32_t delta;
+  uint8_t * out;
+
+  if (state != CS_RECORDING || (capture.header.flags & RX_CAPTURE_FLAG_FULL))
+    return;
+
+  if (capture.header.streamLength + CAPTURE_MAX_RECORD > RX_CAPTURE_SIZE) {
+    // cut here, so the replay never gets a part of what has been received
+    capture.header.flags |= RX_CAPTURE_FLAG_FULL;
+    return;
+  }
+
+  out = &capture.stream[capture.header.streamLength];
+  tick = Stepper_GetControllerTick();
+  delta = tick - lastTick;
+  if (delta != 0) {
+    *out++ = RX_CAPTURE_ESCAPE;
+    do {
+      *out++ = (uint8_t)((delta & 0x7F) | ((delta > 0x7F) ? 0x80 : 0));
+      delta >>= 7;
+    } while (delta != 0);
+    lastTick = tick;
+  }
+  *out++ = data;
+  if (data == RX_CAPTURE_ESCAPE)
+    *out++ = 0;
+
+  capture.header.streamLength = out - capture.stream;
+  capture.header.rxBytes++;
+}
+
+uint32_t RxCapture_StartDump(void) {
+  RxCapture_Stop();
+  dumpNext = 0;
+  dumpEnd = (capture.header.magic == RX_CAPTURE_MAGIC) ? sizeof(capture.header) + capture.header.streamLength : 0;
+  state = CS_DUMPING;
+  return dumpEnd;
+}
+
+bool RxCapture_SendPending(void) {
+  uint32_t count;
+  bool sent = false;
+
+  if (state != CS_DUMPING)
+    return false;
+
+  while (dumpNext != dumpEnd) {
+    count = dumpEnd - dumpNext;
+    if (count > RX_CAPTURE_BYTES_PER_FRAME)
+      count = RX_CAPTURE_BYTES_PER_FRAME;
+    // telemetry goes the same way, the rest is sent on the next passes
+    if (!Serial_SendBulkFrame(RX_CAPTURE_FRAME_SYNC, dumpNext, (uint8_t *)&capture + dumpNext, count))
+      return sent;
+    dumpNext += count;
+    sent = true;
+  }
+
+  state = CS_IDLE;
+  return true;
+}
+
+uint32_t RxCapture_GetRxBytes(void) {
+  return capture.header.rxBytes;
+}
+
+bool RxCapture_IsFull(void) {
+  return (capture.header.flags & RX_CAPTURE_FLAG_FULL) != 0;
+}
+
+#endif
@@ -1,11 +1,40 @@
 #include <string.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include "stm32f4xx_hal.h"
+#include "mxconstants.h"
 #include "serial.h"
 
 
-#define TX_BUFFER_SIZE (4*1024)
-#define RX_BUFFER_SIZE (4*1024)
+// Sized for multi-megabaud operation: at 6 Mbaud 8 kB RX still gives ~7ms between DMA half-transfer events
+#define TX_BUFFER_SIZE (8*1024)
+#define RX_BUFFER_SIZE (8*1024)
+// Bulk data is only a snapshot of the current state, so there is no point to queue much of it
+#define TX_BULK_BUFFER_SIZE (2*1024)
+
+// RTS holds the host when there are less than this number of free bytes in RX buffer.
+// RX interrupts check it every half of the buffer, so it's the half plus what the host may still send from its FIFO
+// (twice as much as USB-UART bridges usually have).
+#define RX_RTS_FIFO_SLACK       128
+#define RX_RTS_HOLD_THRESHOLD   (RX_BUFFER_SIZE/2 + RX_RTS_FIFO_SLACK)
+// The host is released once the main loop has drained the buffer down to a quarter,
+// so RTS doesn't toggle on every pass while the host streams.
+#define RX_RTS_RELEASE_THRESHOLD (RX_BUFFER_SIZE - RX_BUFFER_SIZE/4)
+
+// USART2 and its DMA streams interrupts priority (see HAL_UART_MspInit and MX_DMA_Init)
+#define SERIAL_IRQ_PRIORITY 4
+
+// The main loop shares TX channels and serialStatus with TX complete interrupt, so it masks the serial interrupts
+// (but not the steppers and controller timers) while it updates them. Does nothing inside the serial interrupts themselves.
+// Host builds (Host/SerialStressTest.c) have no interrupts to mask, they define both empty.
+#ifndef SERIAL_LOCK
+#define SERIAL_LOCK()   uint32_t basepri = __get_BASEPRI(); __set_BASEPRI_MAX(SERIAL_IRQ_PRIORITY << (8 - __NVIC_PRIO_BITS))
+#define SERIAL_UNLOCK() __set_BASEPRI(basepri)
+#endif
+
+// Baud rate switched by Serial_SetBaudRate must be confirmed by any valid request at the new rate
+// within this timeout, otherwise we fall back to SERIAL_DEFAULT_BAUDRATE (the host might not follow)
+#define BAUDRATE_CONFIRM_TIMEOUT_MS 2000
 
 char * TX_OVERFLOW_MSG = "!!! TX BUFFER OVERFLOW !!!";
 
@@ -15,28 +44,64 @@ FILE __stdout;
 
 extern UART_HandleTypeDef huart2;
 
-static uint8_t txBuffer[TX_BUFFER_SIZE];
+static uint8_t txControlBuffer[TX_BUFFER_SIZE];
+static uint8_t txBulkBuffer[TX_BULK_BUFFER_SIZE];
 static uint8_t rxBuffer[RX_BUFFER_SIZE];
 
 
-static volatile int32_t syncLock;
+typedef struct {
+  uint8_t * buffer;
+  uint32_t  size;
+  // Pointer for TX buffer reads by DMA
+  volatile uint8_t * outPtr;
+  // Pointer for TX buffer writes
+  volatile uint8_t * inPtr;
+  // Pointer for TX buffer writes on the moment of last DMA transfer has been started
+  volatile uint8_t * inSnapshot;
+  // End of valid data in the buffer tail, it is below the buffer end 
+  // only when reservation had to skip the tail to get contiguous space at the buffer beginning
+  volatile uint8_t * endPtr;
+  // Space handed out by reservation and not committed yet
+  uint8_t * reservedPtr;
+} tx_channel;
+
+// Responses and events - never dropped silently, the overflow is reported to the host
+static tx_channel txControl = { txControlBuffer, TX_BUFFER_SIZE, txControlBuffer, txControlBuffer, NULL, txControlBuffer + TX_BUFFER_SIZE, NULL };
+// Telemetry and other bulk data - sent only when there is nothing in the control channel, dropped when full
+static tx_channel txBulk = { txBulkBuffer, TX_BULK_BUFFER_SIZE, txBulkBuffer, txBulkBuffer, NULL, txBulkBuffer + TX_BULK_BUFFER_SIZE, NULL };
+// Channel of the DMA transfer in progress (NULL - overflow message only)
+static tx_channel * txActive = &txControl;
+
+// Index of the next RX buffer byte to be decoded (DMA write index is derived from NDTR)
+static volatile uint32_t rxOutIdx;
 
-// Pointer for TX buffer reads by DMA
-static volatile uint8_t * txOutPtr = txBuffer;
-// Pointer for TX buffer writes
-static volatile uint8_t * txInPtr = txBuffer;
-// Pointer for TX buffer writes on the moment of last DMA transfer has been started
-static volatile uint8_t * txInSnapshot;
+static volatile serial_status serialStatus;
 
-static volatile uint8_t * rxPtr = rxBuffer;
+// Baud rate to be applied as soon as TX gets idle (0 - nothing to apply)
+static volatile uint32_t pendingBaudRate;
+// HAL tick of the last baud rate switch, while waiting for the confirmation
+static volatile uint32_t baudRateSwitchTick;
+static volatile bool     baudRateConfirmPending;
 
-static volatile serial_status serialStatus;
+void StartPendingTransmit(void);
 
 // ========================================== //
 //    TRANSMITTER                              //
 // ========================================== //
 
+#ifdef SERIAL_RS485
+// Drive the bus only while DMA transfers are chained, TX complete callback comes
+// when the last stop bit is out, so the bus gets released right after our last byte.
+#define BusAcquire() (UART_DE_GPIO_Port->BSRR = UART_DE_Pin)
+#define BusRelease() (UART_DE_GPIO_Port->BSRR = (uint32_t)UART_DE_Pin << 16u)
+#else
+#define BusAcquire()
+#define BusRelease()
+#endif
+
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
+  tx_channel * ch = txActive;
+  
   if (huart != &huart2)
     return;
   
@@ -44,7 +109,7 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
       
       if (serialStatus & SERIAL_TXOVERFLOWMSG) {
         serialStatus &= ~(SERIAL_TXOVERFLOW | SERIAL_TXOVERFLOWMSG);
-      } else {
+      } else if (ch == &txControl) {
         serialStatus |= SERIAL_TXOVERFLOWMSG;
         while(HAL_UART_Transmit_DMA(&huart2, (uint8_t *)TX_OVERFLOW_MSG, strlen(TX_OVERFLOW_MSG)) == HAL_BUSY) { __HAL_UNLOCK(&huart2); }
         return;
@@ -53,79 +118,231 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart){
   
   serialStatus &= ~SERIAL_TX;
 
-  txOutPtr = (txInSnapshot > txOutPtr) ? txInSnapshot : txBuffer;
+  if (ch == NULL) {
+    // that was the overflow message alone, no channel data has been sent
+  } else if (ch->inSnapshot > ch->outPtr) {
+    ch->outPtr = ch->inSnapshot;
+  } else {
+    // we've sent everything till the end of buffer tail
+    ch->outPtr = ch->buffer;
+    ch->endPtr = ch->buffer + ch->size;
+  }
   
-  Serial_ExecutePendingTransmits();
+  // nothing preempts us here (see SERIAL_LOCK)
+  StartPendingTransmit();
 }
 
-void Serial_ExecutePendingTransmits(void) {
-  // Transfer is already in progress
+void ApplyBaudRate(void) {
+  uint32_t pclk = HAL_RCC_GetPCLK1Freq();
+  uint32_t baudRate = pendingBaudRate;
   
-  syncLock++;
+  pendingBaudRate = 0;
   
-  if (syncLock > 1) {
-    syncLock--;
-    return;
+  __HAL_UART_DISABLE(&huart2);
+  // 16x oversampling gives better noise immunity, so use 8x only when the rate is not reachable otherwise
+  if (baudRate > pclk / 16) {
+    huart2.Init.OverSampling = UART_OVERSAMPLING_8;
+    huart2.Instance->CR1 |= USART_CR1_OVER8;
+    huart2.Instance->BRR = UART_BRR_SAMPLING8(pclk, baudRate);
+  } else {
+    huart2.Init.OverSampling = UART_OVERSAMPLING_16;
+    huart2.Instance->CR1 &= ~USART_CR1_OVER8;
+    huart2.Instance->BRR = UART_BRR_SAMPLING16(pclk, baudRate);
   }
+  huart2.Init.BaudRate = baudRate;
+  // RX DMA request (CR3) is preserved, so circular reception just continues at the new rate
+  __HAL_UART_ENABLE(&huart2);
   
-  if (serialStatus & SERIAL_TX)  {
-    syncLock--;
+  baudRateSwitchTick = HAL_GetTick();
+  baudRateConfirmPending = (baudRate != SERIAL_DEFAULT_BAUDRATE);
+}
+
+// Must be invoked with serial interrupts masked (or from them)
+void StartPendingTransmit(void) {
+  tx_channel * ch;
+  
+  // Transfer is already in progress
+  if (serialStatus & SERIAL_TX)
     return;
-  }
 
-  // We have no new data
-  if (txInPtr == txOutPtr && (serialStatus & SERIAL_TXOVERFLOW)==0) {
-    syncLock--;
+  // Control channel always goes first, bulk data only fills the gaps between responses
+  if (txControl.inPtr != txControl.outPtr) {
+    ch = &txControl;
+  } else if (serialStatus & SERIAL_TXOVERFLOW) {
+    // control data has been sent already, so the overflow message goes on its own
+    txActive = NULL;
+    serialStatus |= SERIAL_TXOVERFLOWMSG | SERIAL_TX;
+    BusAcquire();
+    while(HAL_UART_Transmit_DMA(&huart2, (uint8_t *)TX_OVERFLOW_MSG, strlen(TX_OVERFLOW_MSG)) == HAL_BUSY) { __HAL_UNLOCK(&huart2); }
     return;
+  } else if (txBulk.inPtr != txBulk.outPtr) {
+    ch = &txBulk;
+  } else {
+    // We have no new data
+    BusRelease();
+    // TX is idle and the last byte is out (TX complete) - safe to switch baud rate
+    if (pendingBaudRate)
+      ApplyBaudRate();
+    return;
+  }
+  
+  // the buffer tail has been skipped by reservation, and we've sent everything before it
+  if (ch->outPtr == ch->endPtr) {
+    ch->outPtr = ch->buffer;
+    ch->endPtr = ch->buffer + ch->size;
   }
   
-  txInSnapshot = txInPtr;    
-  // we should send to DMA all the recently written data, or till the end of the circular buffer
-  uint16_t txLength = (txInSnapshot > txOutPtr) ?  (txInSnapshot - txOutPtr) : (TX_BUFFER_SIZE - (txOutPtr-txBuffer));
+  ch->inSnapshot = ch->inPtr;    
+  // we should send to DMA all the recently written data, or till the end of the buffer tail
+  uint16_t txLength = (ch->inSnapshot > ch->outPtr) ?  (ch->inSnapshot - ch->outPtr) : (ch->endPtr - ch->outPtr);
 
-  while(HAL_UART_Transmit_DMA(&huart2, (uint8_t *)txOutPtr, txLength) == HAL_BUSY) { __HAL_UNLOCK(&huart2); }
+  txActive = ch;
+  BusAcquire();
+  while(HAL_UART_Transmit_DMA(&huart2, (uint8_t *)ch->outPtr, txLength) == HAL_BUSY) { __HAL_UNLOCK(&huart2); }
   serialStatus |= SERIAL_TX;
+}
 
-  syncLock--;
+void Serial_ExecutePendingTransmits(void) {
+  SERIAL_LOCK();
+  StartPendingTransmit();
+  SERIAL_UNLOCK();
 }
 
 /* C printf(...) support */
 int fputc(int ch, FILE *f) {
-  if (serialStatus & SERIAL_TXOVERFLOW) return -1;
+  uint8_t * dst = Serial_TxReserve(1);
+  if (dst == NULL) return -1;
+  
+  *dst = (uint8_t)ch;
   
-  *txInPtr = (uint8_t)ch;
-  txInPtr++;
-  if (txInPtr == txBuffer+TX_BUFFER_SIZE) txInPtr = txBuffer;
-  if (txInPtr == txOutPtr) {
-    serialStatus |= SERIAL_TXOVERFLOW;
-  }
-
   // Having this here means - that we might start separate DMA transfers to UART for each written bit separatelly
   // so for better performance - don't user printf(..), but use Serial_Write... methods
   // The use DMA ore efficiently, invoking it after the whole string has been put into the buffer
-  Serial_ExecutePendingTransmits();
+  Serial_TxCommit(1);
 
   return ch;
 }
 
+uint8_t * ChannelReserve(tx_channel * ch, uint32_t length) {
+  // take a snapshot, DMA may only move outPtr forward (free more space) meanwhile
+  uint8_t * in  = (uint8_t *)ch->inPtr;
+  uint8_t * out = (uint8_t *)ch->outPtr;
+  uint8_t * end = ch->buffer + ch->size;
+  uint32_t space;
+  
+  ch->reservedPtr = NULL;
+  
+  // we always keep at least one byte gap between inPtr and outPtr,
+  // since inPtr == outPtr means that there is nothing to send
+  if (in >= out) {
+    space = end - in;
+    if (out == ch->buffer) space--;
+    if (space >= length) {
+      ch->reservedPtr = in;
+    } else if (out - ch->buffer > length) {
+      // not enough space in the buffer tail - take it from the beginning
+      ch->reservedPtr = ch->buffer;
+    }
+  } else if (out - in > length) {
+    ch->reservedPtr = in;
+  }
+  
+  return ch->reservedPtr;
+}
+
+void ChannelCommit(tx_channel * ch, uint32_t length) {
+  uint8_t * in = ch->reservedPtr;
+  
+  if (in == NULL || length == 0)
+    return;
+  
+  SERIAL_LOCK();
+  if (in != ch->inPtr) {
+    // reserved space is at the buffer beginning, so the data ends where the tail has been skipped
+    ch->endPtr = ch->inPtr;
+  }
+  
+  in += length;
+  if (in == ch->buffer + ch->size) in = ch->buffer;
+  ch->inPtr = in;
+  ch->reservedPtr = NULL;
+  
+  StartPendingTransmit();
+  SERIAL_UNLOCK();
+}
+
+uint32_t ChannelFree(tx_channel * ch) {
+  uint8_t * in  = (uint8_t *)ch->inPtr;
+  uint8_t * out = (uint8_t *)ch->outPtr;
+  return (in >= out) ? (ch->size - (in - out) - 1) : (out - in - 1);
+}
+
+uint8_t * Serial_TxReserve(uint32_t length) {
+  // everything gets rejected until the overflow message is sent, so the host sees where the gap is
+  if (serialStatus & SERIAL_TXOVERFLOW) {
+    txControl.reservedPtr = NULL;
+    return NULL;
+  }
+  
+  if (ChannelReserve(&txControl, length) == NULL) {
+    SERIAL_LOCK();
+    serialStatus |= SERIAL_TXOVERFLOW;
+    StartPendingTransmit();
+    SERIAL_UNLOCK();
+  }
+  return txControl.reservedPtr;
+}
+
+void Serial_TxCommit(uint32_t length) {
+  ChannelCommit(&txControl, length);
+}
+
+uint8_t * Serial_TxBulkReserve(uint32_t length) {
+  return ChannelReserve(&txBulk, length);
+}
+
+void Serial_TxBulkCommit(uint32_t length) {
+  ChannelCommit(&txBulk, length);
+}
+
+bool Serial_SendBulkFrame(uint8_t sync, uint32_t offset, const void * payload, uint32_t length) {
+  uint32_t frameLength = 2 + 4 + length + 1;
+  uint8_t * frame = Serial_TxBulkReserve(frameLength);
+  uint8_t * out = frame;
+  uint8_t checksum = 0;
+  uint32_t i;
+  
+  if (frame == NULL)
+    return false;
+  
+  *out++ = sync;
+  *out++ = (uint8_t)(4 + length);
+  *out++ = (uint8_t)(offset);
+  *out++ = (uint8_t)(offset >> 8);
+  *out++ = (uint8_t)(offset >> 16);
+  *out++ = (uint8_t)(offset >> 24);
+  memcpy(out, payload, length);
+  out += length;
+  for (i = 0; i < frameLength - 1; i++)
+    checksum += frame[i];
+  *out = checksum;
+  
+  Serial_TxBulkCommit(frameLength);
+  return true;
+}
+
 void Serial_WriteBytes(uint8_t * data, uint32_t length) {
-  if (serialStatus & SERIAL_TXOVERFLOW) return;
+  uint8_t * dst;
   
-  uint8_t * limit = data + length;
   if (length == 0)
     return;
-
-  do {
-    *txInPtr = *data;
-    txInPtr++;
-    if (txInPtr >= txBuffer+TX_BUFFER_SIZE) txInPtr = txBuffer;
-    if (txInPtr == txOutPtr) {
-      serialStatus |= SERIAL_TXOVERFLOW;
-      break;
-    }
-  } while(++data < limit);
   
-  Serial_ExecutePendingTransmits();
+  dst = Serial_TxReserve(length);
+  if (dst == NULL)
+    return;
+
+  memcpy(dst, data, length);
+  Serial_TxCommit(length);
 }
 
 void Serial_WriteString(char * str){
@@ -159,46 +376,141 @@ void Serial_WriteInt(int32_t i) {
     Serial_WriteString(p);
 }
 
+// ========================================== //
+//    BAUD RATE                               //
+// ========================================== //
+
+uint32_t Serial_LimitBaudRate(uint32_t baudRate) {
+  // 8x oversampling gives us up to PCLK1/8 (6.25 Mbaud at 50 MHz APB1)
+  uint32_t maxBaudRate = HAL_RCC_GetPCLK1Freq() / 8;
+  
+  if (baudRate > maxBaudRate) return maxBaudRate;
+  if (baudRate < SERIAL_MIN_BAUDRATE) return SERIAL_MIN_BAUDRATE;
+  return baudRate;
+}
+
+uint32_t Serial_SetBaudRate(uint32_t baudRate) {
+  baudRate = Serial_LimitBaudRate(baudRate);
+  
+  // will be applied once everything queued so far (including the response) has been sent
+  pendingBaudRate = baudRate;
+  Serial_ExecutePendingTransmits();
+  
+  return baudRate;
+}
+
+uint32_t Serial_GetBaudRate(void) {
+  return huart2.Init.BaudRate;
+}
+
+void Serial_ConfirmBaudRate(void) {
+  baudRateConfirmPending = false;
+}
+
+void Serial_CheckBaudRateFallback(void) {
+  if (baudRateConfirmPending && (HAL_GetTick() - baudRateSwitchTick) > BAUDRATE_CONFIRM_TIMEOUT_MS) {
+    baudRateConfirmPending = false;
+    Serial_SetBaudRate(SERIAL_DEFAULT_BAUDRATE);
+  }
+}
+
 // ========================================== //
 //    RECEIVER                                //
 // ========================================== //
 
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+uint32_t GetRxInIdx(void) {
+  // DMA runs in circular mode and never stops, NDTR counts down to 0 and gets reloaded with RX_BUFFER_SIZE
+  // so the DMA write index follows it
+  uint32_t rxInIdx = RX_BUFFER_SIZE - huart2.hdmarx->Instance->NDTR;
+  return (rxInIdx >= RX_BUFFER_SIZE) ? 0 : rxInIdx;
+}
+
+uint32_t Serial_GetRxFree(void) {
+  uint32_t pending = (GetRxInIdx() + RX_BUFFER_SIZE - rxOutIdx) % RX_BUFFER_SIZE;
+  return RX_BUFFER_SIZE - 1 - pending;
+}
+
+uint32_t Serial_GetTxFree(void) {
+  return ChannelFree(&txControl);
+}
+
+#ifdef SERIAL_FLOW_CONTROL
+// RX interrupts only hold the host off (RTS) when the buffer is getting full, the main loop may be busy for a while
+void HoldRxIfFull(void) {
+  if (Serial_GetRxFree() < RX_RTS_HOLD_THRESHOLD)
+    HAL_GPIO_WritePin(UART_RTS_GPIO_Port, UART_RTS_Pin, GPIO_PIN_SET);
+}
+#else
+#define HoldRxIfFull()
+#endif
+
+uint32_t Serial_ProcessReceived(void) {
+  uint32_t rxInIdx = GetRxInIdx();
+  uint32_t count = 0;
+#ifdef SERIAL_FLOW_CONTROL
+  uint32_t rxFree;
+#endif
+  
+  // just catch up with DMA (wrapping at the buffer end)
+  while(rxOutIdx != rxInIdx) {
+    Serial_RxCallback(rxBuffer[rxOutIdx++]);
+    if (rxOutIdx == RX_BUFFER_SIZE) rxOutIdx = 0;
+    count++;
+  }
+  
+#ifdef SERIAL_FLOW_CONTROL
+  // the main loop checks much more often than RX interrupts do, between the thresholds RTS stays as it is
+  rxFree = Serial_GetRxFree();
+  if (rxFree < RX_RTS_HOLD_THRESHOLD)
+    HAL_GPIO_WritePin(UART_RTS_GPIO_Port, UART_RTS_Pin, GPIO_PIN_SET);
+  else if (rxFree >= RX_RTS_RELEASE_THRESHOLD)
+    HAL_GPIO_WritePin(UART_RTS_GPIO_Port, UART_RTS_Pin, GPIO_PIN_RESET);
+#endif
+  return count;
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
   if (huart != &huart2)
     return;
   
-  serialStatus &= ~SERIAL_RX;
+  HoldRxIfFull();
+}
 
-  while(rxPtr < rxBuffer+RX_BUFFER_SIZE) {
-    Serial_RxCallback(*rxPtr++);
-  }
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+  if (huart != &huart2)
+    return;
   
-  rxPtr = rxBuffer;
-
-  Serial_InitRxSequence();
+  // Circular DMA has just wrapped to the buffer beginning, it keeps receiving - no restart required
+  HoldRxIfFull();
 }
 
 void Serial_InitRxSequence(void) {
-  while(HAL_UART_Receive_DMA(&huart2, rxBuffer, RX_BUFFER_SIZE) == HAL_BUSY) { __HAL_UNLOCK(&huart2); }
+  // Started once, RX DMA stream is configured in circular mode
+  if (HAL_UART_Receive_DMA(&huart2, rxBuffer, RX_BUFFER_SIZE) != HAL_OK)
+    return;
+  SERIAL_LOCK();
   serialStatus |= SERIAL_RX;
+  SERIAL_UNLOCK();
+  
+#ifdef SERIAL_FLOW_CONTROL
+  // CTS pin is configured in HAL_UART_MspInit, TX DMA just waits while CTS is high
+  huart2.Init.HwFlowCtl = UART_HWCONTROL_CTS;
+  huart2.Instance->CR3 |= USART_CR3_CTSE;
+  HAL_GPIO_WritePin(UART_RTS_GPIO_Port, UART_RTS_Pin, GPIO_PIN_RESET);
+  
+  // IDLE line event (the host has paused) is one more chance to check the RX space
+  __HAL_UART_ENABLE_IT(&huart2, UART_IT_IDLE);
+#endif
 }
 
-void Serial_CheckRxTimeout(void) {
-  // WARNING
-  // This one executed by e timer with higher priority then DMA and UART interrupts
-  // This might be invoked nested in HAL_UART_RxCpltCallback
-
-  int32_t bytesTransfered;
-  // we should not do anuthing if transmition stopped in HAL_UART_RxCpltCallback
+void Serial_RxIdleCallback(void) {
+  // Invoked from USART2 interrupt, which runs at the same priority as RX DMA interrupt,
+  // so it never gets nested into DMA transfer callbacks (and both never preempt the controller timer).
   if (!(serialStatus & SERIAL_RX)) {
     return;
   }
 
-  bytesTransfered = (RX_BUFFER_SIZE - huart2.hdmarx->Instance->NDTR);
-
-  while(rxPtr < rxBuffer+bytesTransfered) {
-    Serial_RxCallback(*rxPtr++);
-  }
+  HoldRxIfFull();
 }
 
 __weak void Serial_RxCallback(uint8_t byte) {
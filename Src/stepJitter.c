@@ -0,0 +1,169 @@
+#include <math.h>
+#include "stepJitter.h"
+
+#if defined(STEP_JITTER)
+
+typedef enum {
+  JS_IDLE       = 0,
+  JS_ARMED      = 1,    // waiting for the stepper to reach the cruise speed
+  JS_CAPTURING  = 2,
+  JS_CLOSED     = 3,    // the stepper has left the cruise speed, the capture is stopped
+  JS_DONE       = 4
+} jitter_state;
+
+// changed by the controller tick (ARMED -> CAPTURING -> CLOSED) and the main loop (the rest)
+static volatile jitter_state state = JS_IDLE;
+static jitter_result result;
+// TIM8 is 16-bit, so the captures are turned into the deviations from the commanded period in place:
+// (uint16_t) difference is exact as long as the period deviates by less than 32768 ticks (164 us at 200 MHz)
+static uint16_t captures[JITTER_MAX_SAMPLES + 1];
+
+void Jitter_Init(void) {
+  GPIO_InitTypeDef GPIO_InitStruct;
+
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+  __HAL_RCC_TIM8_CLK_ENABLE();
+  __HAL_RCC_DMA2_CLK_ENABLE();
+
+  /**TIM8 GPIO Configuration
+  PC6     ------> TIM8_CH1
+  */
+  GPIO_InitStruct.Pin = GPIO_PIN_6;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Pull = GPIO_PULLDOWN;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_VERY_HIGH;
+  GPIO_InitStruct.Alternate = GPIO_AF3_TIM8;
+  HAL_GPIO_Init(GPIOC, &GPIO_InitStruct);
+
+  // free running at HCLK (TIMPRE is activated), CH1 captures TI1 rising edges and requests DMA
+  TIM8->PSC   = 0;
+  TIM8->ARR   = 0xFFFF;
+  TIM8->CCMR1 = TIM_CCMR1_CC1S_0;
+  TIM8->CCER  = 0;
+  TIM8->DIER  = TIM_DIER_CC1DE;
+  TIM8->EGR   = TIM_EGR_UG;
+  TIM8->CR1   = TIM_CR1_CEN;
+
+  // DMA2 Stream2 Channel7 - TIM8_CH1
+  DMA2_Stream2->CR   = 0;
+  DMA2_Stream2->PAR  = (uint32_t)&TIM8->CCR1;
+  DMA2_Stream2->M0AR = (uint32_t)captures;
+}
+
+void StopCapture(void) {
+  TIM8->CCER &= ~TIM_CCER_CC1E;
+  DMA2_Stream2->CR &= ~DMA_SxCR_EN;
+  while (DMA2_Stream2->CR & DMA_SxCR_EN);
+}
+
+void StartCapture(uint32_t count) {
+  StopCapture();
+  DMA2->LIFCR = DMA_LIFCR_CTCIF2 | DMA_LIFCR_CHTIF2 | DMA_LIFCR_CTEIF2 | DMA_LIFCR_CDMEIF2 | DMA_LIFCR_CFEIF2;
+  DMA2_Stream2->NDTR = count;
+  DMA2_Stream2->CR = DMA_CHANNEL_7 | DMA_PERIPH_TO_MEMORY | DMA_MINC_ENABLE |
+                     DMA_PDATAALIGN_HALFWORD | DMA_MDATAALIGN_HALFWORD | DMA_PRIORITY_VERY_HIGH;
+  DMA2_Stream2->CR |= DMA_SxCR_EN;
+  // drop the stale capture, so the first request comes with the next edge
+  TIM8->SR = ~TIM_SR_CC1IF;
+  TIM8->CCER |= TIM_CCER_CC1E;
+}
+
+void CompleteCapture(void) {
+  uint32_t captured = result.requested + 1 - DMA2_Stream2->NDTR;
+  int16_t * deviations = (int16_t *)captures;
+  uint16_t period = (uint16_t)result.period;
+  uint16_t previous = captures[0];
+  int64_t sum = 0;
+  int64_t sumSq = 0;
+  int32_t minDeviation = INT16_MAX;
+  int32_t maxDeviation = INT16_MIN;
+  int32_t deviation;
+  uint32_t i;
+
+  StopCapture();
+  result.count = (captured > 1) ? captured - 1 : 0;
+
+  for (i = 0; i < result.count; i++) {
+    deviation = (int16_t)(uint16_t)(captures[i + 1] - previous - period);
+    previous = captures[i + 1];
+    deviations[i] = (int16_t)deviation;
+    sum += deviation;
+    sumSq += deviation * deviation;
+    if (deviation < minDeviation)
+      minDeviation = deviation;
+    if (deviation > maxDeviation)
+      maxDeviation = deviation;
+  }
+
+  if (result.count > 0) {
+    result.minPeriod = result.period + minDeviation;
+    result.maxPeriod = result.period + maxDeviation;
+    result.meanPeriodX100 = (uint32_t)((int64_t)result.period * 100 + (sum * 100 + (int64_t)result.count / 2) / (int64_t)result.count);
+    // n*sum(d^2) - sum(d)^2 is exact in integers, only the root goes to float
+    result.stddevX100 = (uint32_t)(sqrtf((float)(sumSq * (int64_t)result.count - sum * sum)) * 100.0f / result.count + 0.5f);
+  } else {
+    result.minPeriod = result.maxPeriod = result.meanPeriodX100 = result.stddevX100 = 0;
+  }
+  result.deviations = deviations;
+  state = JS_DONE;
+}
+
+stepper_error Jitter_Start(char stepperName, uint32_t samples) {
+  if (Stepper_GetMaxSPS(stepperName) == 0)
+    return SERR_STATENOTFOUND;
+
+  // the controller tick leaves the capture alone from now on
+  state = JS_IDLE;
+  StopCapture();
+  result.stepper = stepperName;
+  result.requested = (samples == 0) ? JITTER_DEFAULT_SAMPLES : (samples > JITTER_MAX_SAMPLES) ? JITTER_MAX_SAMPLES : samples;
+  result.count = 0;
+  result.clock = STEP_TIMER_CLOCK;
+  state = JS_ARMED;
+
+  return (samples > JITTER_MAX_SAMPLES) ? SERR_LIMIT : SERR_OK;
+}
+
+void Jitter_ControllerTick(void) {
+  stepper_status status;
+  int32_t sps;
+
+  if (state != JS_ARMED && state != JS_CAPTURING)
+    return;
+
+  status = Stepper_GetStatus(result.stepper);
+  sps = Stepper_GetCurrentSPS(result.stepper);
+
+  if (state == JS_ARMED) {
+    if (status == SS_STOPPED || sps < Stepper_GetMaxSPS(result.stepper))
+      return;
+    // the period the step timer really runs (ARR and PSC are truncated), not the one the speed asks for
+    result.sps = sps;
+    result.period = Stepper_GetStepPeriod(result.stepper);
+    // one more edge than the periods requested
+    StartCapture(result.requested + 1);
+    state = JS_CAPTURING;
+    return;
+  }
+
+  // braking has started: the new period is only preloaded, so the edges captured so far are all of the cruise
+  if (status == SS_STOPPED || sps != (int32_t)result.sps) {
+    TIM8->CCER &= ~TIM_CCER_CC1E;
+    state = JS_CLOSED;
+  }
+}
+
+void Jitter_Poll(void) {
+  if (state == JS_CLOSED || (state == JS_CAPTURING && DMA2_Stream2->NDTR == 0))
+    CompleteCapture();
+}
+
+bool Jitter_TakeResult(jitter_result * taken) {
+  if (state != JS_DONE)
+    return false;
+  *taken = result;
+  state = JS_IDLE;
+  return true;
+}
+
+#endif
@@ -1,8 +1,22 @@
 #include <string.h>
 #include "stepperController.h"
+#include "positionJournal.h"
+#include "controlTrace.h"
 
 static stepper_state steppers[MAX_STEPPERS_COUNT];
 static int32_t initializedSteppersCount;
+// committed targets of every command channel (see Stepper_RegisterTargets), latched by the controller passes
+static stepper_targets * registeredTargets[MAX_REGISTERED_TARGETS];
+static int32_t registeredTargetsCount;
+// RS-485 bus address of this hub (0 - point-to-point link, no addressing)
+static uint8_t hubAddress;
+// config changes waiting for Stepper_SavePendingConfig()
+static volatile bool configSavePending;
+static volatile bool configSaveImmediately;
+static volatile uint32_t configChangeTick;
+static uint32_t configSaveDelayMs = CONFIG_SAVE_DELAY_MS;
+// Stepper_ExecuteAllControllers passes since reset
+static volatile uint32_t controllerTick;
 
 void SetAccelerationByMinSPS(stepper_state * stepper) {
     // MinSPS - is a maximum possible starting stepper speed, so it also defines maximum possible acceleration
@@ -136,8 +150,12 @@ stepper_error Stepper_InitDefaultState(char stepperName) {
 
     // zero service fields
     stepper -> targetPosition           = 0;
+    stepper -> targetSetCount++;
     stepper -> currentPosition          = 0;
     stepper -> breakInitiationSPS       = stepper -> maxSPS;
+#if defined(POSITION_JOURNAL)
+    Journal_RecordStopped(stepper -> name, 0);
+#endif
 
     SetAccelerationByMinSPS(stepper);
     SetStepTimerByCurrentSPS(stepper);
@@ -147,11 +165,20 @@ stepper_error Stepper_InitDefaultState(char stepperName) {
 
 void ExecuteController(stepper_state * stepper){
   stepper_status status = stepper -> status;
+  float estimatedTimeToTarget = 0.0f;
+  float timeToReduceSpeed     = 0.0f;
+#if defined(CONTROL_TRACE)
+  int32_t sps = stepper -> currentSPS;
+#endif
 
   if (status & SS_STOPPED) { 
     if (stepper->targetPosition != stepper->currentPosition) {
      stepper->stepCtrlPrescallerTicks = stepper->stepCtrlPrescaller;
      stepper->status = SS_STARTING;
+     TRACE_DECISION(stepper, TE_START, status, 0.0f, 0.0f);
+#if defined(POSITION_JOURNAL)
+     Journal_RecordMoving(stepper->name);
+#endif
      stepper->STEP_TIMER->Instance->EGR = TIM_EGR_UG;
      HAL_TIM_PWM_Start(stepper->STEP_TIMER, stepper->STEP_CHANNEL);
     }
@@ -170,9 +197,9 @@ void ExecuteController(stepper_state * stepper){
     // and using it to calculate how much time left to the stopping point 
  
     // Steps to target deevided by average speed.
-    float estimatedTimeToTarget = 2.0f * GetStepsToTarget(stepper) / (stepper->currentSPS + stepper->minSPS);
     int32_t spsSwitches        = (stepper->currentSPS - stepper->minSPS) / stepper->accelerationSPS;
-    float timeToReduceSpeed     =
+    estimatedTimeToTarget      = 2.0f * GetStepsToTarget(stepper) / (stepper->currentSPS + stepper->minSPS);
+    timeToReduceSpeed          =
         (((float)STEP_CONTROLLER_PERIOD_US)/ 1000000.0f) *
         ((int64_t)(stepper->stepCtrlPrescaller) * spsSwitches + stepper->stepCtrlPrescallerTicks);
 
@@ -184,6 +211,7 @@ void ExecuteController(stepper_state * stepper){
         stepper->status |= SS_BREAKING;
         
         DecrementSPS(stepper);
+        TRACE_DECISION(stepper, TE_BRAKE, status, estimatedTimeToTarget, timeToReduceSpeed);
 
         // So we terminated onging acceleration, or immidiately switched back from top speed        
         if (stepper->stepCtrlPrescallerTicks == 0)
@@ -211,9 +239,20 @@ void ExecuteController(stepper_state * stepper){
 
         // we still have to execute breaking transition here
         DecrementSPS(stepper);
+#if defined(CONTROL_TRACE)
+        if (stepper->status & SS_BREAKCORRECTION)
+          TRACE_DECISION(stepper, TE_BRAKECORRECTION, status, estimatedTimeToTarget, timeToReduceSpeed);
+        else if (stepper->currentSPS != sps)
+          TRACE_DECISION(stepper, TE_DECELERATE, status, estimatedTimeToTarget, timeToReduceSpeed);
+#endif
     }
     else if (!(status & SS_BREAKCORRECTION)){
         IncrementSPS(stepper);
+#if defined(CONTROL_TRACE)
+        // at maxSPS already - nothing has been decided
+        if (stepper->currentSPS != sps)
+          TRACE_DECISION(stepper, TE_ACCELERATE, status, estimatedTimeToTarget, timeToReduceSpeed);
+#endif
     }
     stepper->stepCtrlPrescallerTicks = stepper->stepCtrlPrescaller;
   }
@@ -235,6 +274,9 @@ void Stepper_PulseTimerUpdate(char stepperName){
       } else if (stepper->currentPosition == stepper->targetPosition) {
           stepper->status = SS_STOPPED;
           HAL_TIM_PWM_Stop(stepper->STEP_TIMER, stepper->STEP_CHANNEL);
+#if defined(POSITION_JOURNAL)
+          Journal_RecordStopped(stepper->name, stepper->currentPosition);
+#endif
       }
       break;   
     case SS_RUNNING_FORWARD:
@@ -245,16 +287,66 @@ void Stepper_PulseTimerUpdate(char stepperName){
           // We reached or passed through our target position at the stopping speed
           stepper->status = SS_STOPPED;
           HAL_TIM_PWM_Stop(stepper->STEP_TIMER, stepper->STEP_CHANNEL);
-          printf("%c.stop:%d\r\n", stepper->name, stepper->currentPosition);
+          // no TX from here - it would block the step timers and may get into the middle of a response
+          stepper->stopEventPosition = stepper->currentPosition;
+          stepper->stopEventPending = true;
+#if defined(POSITION_JOURNAL)
+          Journal_RecordStopped(stepper->name, stepper->currentPosition);
+#endif
       }}
       break;
   }
 }
 
+uint32_t Stepper_GetControllerTick(void){
+  return controllerTick;
+}
+
+char Stepper_GetName(int32_t index){
+  return (index >= 0 && index < initializedSteppersCount) ? steppers[index].name : '\0';
+}
+
+bool Stepper_TakeStopEvent(char * stepperName, int32_t * position){
+  int32_t i = initializedSteppersCount;
+  while(i--) {
+    if (steppers[i].stopEventPending) {
+      steppers[i].stopEventPending = false;
+      *stepperName = steppers[i].name;
+      *position = steppers[i].stopEventPosition;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ApplyCommittedTargets(void){
+  stepper_targets * committed;
+  stepper_state * stepper;
+  int32_t r;
+  int32_t i;
+  for (r = 0; r < registeredTargetsCount; r++) {
+    committed = registeredTargets[r];
+    // the main loop is merging the next commit into them, they go on the next pass
+    if (!committed->pending || committed->updating)
+      continue;
+    for (i = 0; i < committed->count; i++) {
+      stepper = GetState(committed->steppers[i]);
+      // a direct set (or reset) since the commit wins
+      if (stepper != NULL && stepper->targetSetCount == committed->setCounts[i])
+        stepper->targetPosition = committed->targets[i];
+    }
+    committed->pending = false;
+  }
+}
+
 void Stepper_ExecuteAllControllers(void){
   int32_t i = initializedSteppersCount;
+  controllerTick++;
   if (i==0)
     return;
+  // latch all transaction targets before any controller runs,
+  // so every affected stepper gets started/retargeted within this very pass
+  ApplyCommittedTargets();
   while(i--)  
     ExecuteController(&steppers[i]);
 }
@@ -267,10 +359,56 @@ stepper_error Stepper_SetTargetPosition(char stepperName, int32_t value){
   stepper_state * stepper = GetState(stepperName);
   if (stepper == NULL)
     return SERR_STATENOTFOUND;
+  // a direct set wins over the target committed earlier, but not latched yet
+  stepper->targetSetCount++;
   stepper->targetPosition = value;
   return SERR_OK;
 }
 
+// Makes the controller latch the targets committed to this batch (every command channel has its own one).
+// NOT THREAD-SAFE (invoked once per batch at startup)
+stepper_error Stepper_RegisterTargets(stepper_targets * committed){
+  int32_t r;
+  for (r = 0; r < registeredTargetsCount; r++) {
+    if (registeredTargets[r] == committed)
+      return SERR_OK;
+  }
+  if (registeredTargetsCount == MAX_REGISTERED_TARGETS)
+    return SERR_NOMORESTATESAVAILABLE;
+  registeredTargets[registeredTargetsCount++] = committed;
+  return SERR_OK;
+}
+
+// Commits the target positions to the registered batch, they are applied all at once
+// at the beginning of the next Stepper_ExecuteAllControllers() pass.
+// If the previous commit of the batch is not latched yet, the new targets are merged into it (the last written wins).
+// THREAD-SAFE (may be invoked at any time, but not concurrently for the same batch)
+stepper_error Stepper_CommitTargets(stepper_targets * committed, int32_t count, const char * stepperNames, const int32_t * values){
+  stepper_state * stepper;
+  int32_t i;
+  int32_t j;
+  for (i = 0; i < count; i++) {
+    if (GetState(stepperNames[i]) == NULL)
+      return SERR_STATENOTFOUND;
+  }
+  // the controller leaves the batch alone while it's updated
+  committed->updating = true;
+  if (!committed->pending)
+    committed->count = 0;
+  for (i = 0; i < count; i++) {
+    stepper = GetState(stepperNames[i]);
+    for (j = 0; j < committed->count && committed->steppers[j] != stepperNames[i]; j++);
+    committed->steppers[j]  = stepperNames[i];
+    committed->targets[j]   = values[i];
+    committed->setCounts[j] = stepper->targetSetCount;
+    if (j == committed->count)
+      committed->count++;
+  }
+  committed->pending  = true;
+  committed->updating = false;
+  return SERR_OK;
+}
+
 // Sets the new value for the current possion of the stepper. 
 // So it becomes a new reference point for target value.
 // The same value will be assigned to target position - otherwise the mottor will start moving.
@@ -280,8 +418,12 @@ stepper_error Stepper_SetCurrentPosition(char stepperName, int32_t value){
   if (stepper == NULL)
     return SERR_STATENOTFOUND;
   if (stepper->status & SS_STOPPED) {
+    stepper->targetSetCount++;
     stepper->targetPosition  = 
     stepper->currentPosition = value;
+#if defined(POSITION_JOURNAL)
+    Journal_RecordStopped(stepper->name, value);
+#endif
     return SERR_OK;
   }
   return SERR_MUSTBESTOPPED;
@@ -315,7 +457,7 @@ stepper_error Stepper_SetMinSPS(char stepperName, int32_t value){
       SetAccelerationByMinSPS(stepper);
       SetStepTimerByCurrentSPS(stepper);
       
-      Stepper_SaveConfig();
+      Stepper_ScheduleConfigSave(false);
       return result;
   }
   return SERR_MUSTBESTOPPED;
@@ -348,7 +490,7 @@ stepper_error Stepper_SetMaxSPS(char stepperName, int32_t value){
         SetAccelerationByMinSPS(stepper);
         SetStepTimerByCurrentSPS(stepper);
       }
-      Stepper_SaveConfig();
+      Stepper_ScheduleConfigSave(false);
       return result;
   }
   return SERR_MUSTBESTOPPED;
@@ -374,7 +516,7 @@ stepper_error Stepper_SetAccSPS(char stepperName, int32_t value){
     } else {
       stepper->accelerationSPS = value;
     }
-    Stepper_SaveConfig();
+    Stepper_ScheduleConfigSave(false);
     return result;
   }
   return SERR_MUSTBESTOPPED;
@@ -389,7 +531,7 @@ stepper_error Stepper_SetAccPrescaler(char stepperName, int32_t value){
     return SERR_STATENOTFOUND;
   if (stepper->status & SS_STOPPED) {
     stepper->stepCtrlPrescaller = (value < 1) ? 1 : value;
-    Stepper_SaveConfig();
+    Stepper_ScheduleConfigSave(false);
     return  (value < 1) ? SERR_LIMIT : SERR_OK;
   }
   return SERR_MUSTBESTOPPED;
@@ -431,6 +573,17 @@ int32_t Stepper_GetCurrentSPS(char stepperName){
   return  (stepper == NULL) ? 0 : stepper->currentSPS;
 }
 
+// Gets the step period the step timer is programmed for ((ARR + 1) * (PSC + 1) ticks of STEP_TIMER_CLOCK), 0 if there is no timer.
+// THREAD-SAFE (may be called at any time, but the period is consistent only when the controller doesn't change it meanwhile)
+uint32_t Stepper_GetStepPeriod(char stepperName){
+  stepper_state * stepper = GetState(stepperName);
+  TIM_TypeDef * timer;
+  if (stepper == NULL || stepper -> STEP_TIMER == NULL || stepper -> STEP_TIMER -> Instance == NULL)
+    return 0;
+  timer = stepper -> STEP_TIMER -> Instance;
+  return (timer -> ARR + 1) * (timer -> PSC + 1);
+}
+
 // Gets the acceleration, as factor of (STEP_CONTROLLER_PERIOD_US*10^6) steps/second^2.
 // THREAD-SAFE (may be called at any time)
 int32_t Stepper_GetAccSPS(char stepperName){
@@ -452,40 +605,427 @@ stepper_status Stepper_GetStatus(char stepperName) {
   return (stepper == NULL) ? SS_UNDEFINED : stepper->status;
 }
 
-// Read from FLASH
-void Stepper_LoadConfig(void) {
+// ========================================== //
+//    CONFIG STORAGE                          //
+// ========================================== //
+// FLASH_SECTOR_3 is an append-only log of (key, value) records, every change appends a record 
+// and the latest record of a key wins. So a change costs two word programs instead of the sector erase,
+// the sector gets erased (and compacted to the current values) only when it is full.
+//
+//    uint32_t  CONFIG_LOG_MAGIC  - format version
+//    config_record[]             - up to the first erased (0xFFFFFFFF, 0xFFFFFFFF) slot
+//
+// key = crc8 << 24 | profile << 20 | field << 16 | stepper name (0 for the hub settings)
+// CRC-8 covers the rest of the key and the value. Record value is programmed before its key,
+// so a record torn by reset (or damaged) fails the CRC and gets skipped.
+//
+// Older formats (CFG1 log, and the raw layout before it) are loaded into profile 0 and converted on the first boot.
+
+#define CONFIG_SECTOR_SIZE      (16*1024)
+#define CONFIG_LOG_MAGIC        0x32474643    // "CFG2"
+#define CONFIG_LOG_MAGIC_V1     0x31474643    // "CFG1" - no CRC and profiles, mark | field << 16 | stepper name
+#define CONFIG_RECORD_MARK_V1   0x5A000000
+#define CONFIG_RECORD_MARK_MASK 0xFF000000
+#define CONFIG_RECORD_KEY(profile, field, name) (((uint32_t)(profile) << 20) | ((uint32_t)(field) << 16) | (uint8_t)(name))
+#define CONFIG_RECORD_PROFILE(key)  (((key) >> 20) & 0x0F)
+#define CONFIG_RECORD_FIELD(key)    (((key) >> 16) & 0x0F)
+#define CONFIG_RECORD_NAME(key)     ((char)((key) & 0xFF))
+
+// Layout of the config before the log (raw words at the sector start), still readable for migration
+#define LEGACY_HUB_ADDRESS_ADDR (ADDR_FLASH_SECTOR_3 + MAX_STEPPERS_COUNT * 4 * sizeof(int32_t))
+
+typedef enum {
+  CF_MINSPS         = 0,
+  CF_MAXSPS         = 1,
+  CF_ACCSPS         = 2,
+  CF_ACCPRESCALER   = 3,
+  __CF_STEPPER_COUNT= 4,
+  CF_HUBADDRESS     = 4
+} config_field;
+
+#define CONFIG_PROFILE_FIELDS ((1 << __CF_STEPPER_COUNT) - 1)
+
+typedef struct {
+  uint32_t key;
+  int32_t  value;
+} config_record;
+
+static config_record * const configLogBegin = (config_record *)(ADDR_FLASH_SECTOR_3 + sizeof(uint32_t));
+static config_record * const configLogLimit = (config_record *)(ADDR_FLASH_SECTOR_3 + CONFIG_SECTOR_SIZE);
+// next free record slot, NULL - the log has to be (re)created
+static config_record * configLogEnd;
+
+// Motion profiles of every stepper. The active one lives in stepper_state (the table copy is updated on switch/save),
+// a profile which has never been set (not valid) becomes a copy of the active one when it gets used the first time.
+static int32_t profileConfig[MAX_STEPPERS_COUNT][CONFIG_PROFILES_COUNT][__CF_STEPPER_COUNT];
+static uint32_t profileValid[MAX_STEPPERS_COUNT];
+static uint8_t activeProfile;
+
+// values of the latest records, so only the changes get appended
+static int32_t storedConfig[MAX_STEPPERS_COUNT][CONFIG_PROFILES_COUNT][__CF_STEPPER_COUNT];
+// bit (profile * __CF_STEPPER_COUNT + field) is set when there is a record for it
+static uint32_t storedFields[MAX_STEPPERS_COUNT];
+static int32_t storedHubAddress;
+
+int32_t GetConfigValue(stepper_state * stepper, config_field field) {
+  switch (field) {
+    case CF_MINSPS:       return stepper->minSPS;
+    case CF_MAXSPS:       return stepper->maxSPS;
+    case CF_ACCSPS:       return stepper->accelerationSPS;
+    case CF_ACCPRESCALER: return stepper->stepCtrlPrescaller;
+    default:              return 0;
+  }
+}
+
+void SetConfigValue(stepper_state * stepper, config_field field, int32_t value) {
+  switch (field) {
+    case CF_MINSPS:       stepper->minSPS = value; break;
+    case CF_MAXSPS:       stepper->maxSPS = value; break;
+    case CF_ACCSPS:       stepper->accelerationSPS = value; break;
+    case CF_ACCPRESCALER: stepper->stepCtrlPrescaller = value; break;
+    default:              break;
+  }
+}
+
+// CRC-8 (poly 0x07) of the key (without the CRC byte) and the value
+uint8_t ConfigRecordCrc(uint32_t key, int32_t value) {
+  uint8_t data[7] = { key, key >> 8, key >> 16, value, value >> 8, value >> 16, (uint32_t)value >> 24 };
+  uint8_t crc = 0;
+  int32_t i, bit;
+  for (i=0; i < sizeof(data); i++) {
+    crc ^= data[i];
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : (crc << 1);
+  }
+  return crc;
+}
+
+bool IsErased(config_record * record) {
+  return record->key == 0xFFFFFFFF && (uint32_t)record->value == 0xFFFFFFFF;
+}
+
+// Must be invoked with FLASH unlocked
+void ProgramConfigRecord(uint32_t key, int32_t value) {
+  key |= (uint32_t)ConfigRecordCrc(key, value) << 24;
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)(uintptr_t)&configLogEnd->value, value); 
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uint32_t)(uintptr_t)&configLogEnd->key, key); 
+  configLogEnd++;
+}
+
+// Profile table gets the current values of the active profile
+void StoreActiveProfile(void) {
+  int32_t i;
+  config_field field;
+  for (i=0; i < initializedSteppersCount; i++) {
+    for (field = CF_MINSPS; field < __CF_STEPPER_COUNT; field++)
+      profileConfig[i][activeProfile][field] = GetConfigValue(&steppers[i], field);
+    profileValid[i] |= 1 << activeProfile;
+  }
+}
+
+// Applies profile values of the table to the stepper
+void ApplyProfile(stepper_state * stepper, uint8_t profile) {
+  int32_t * values = profileConfig[stepper - steppers][profile];
+  config_field field;
+  for (field = CF_MINSPS; field < __CF_STEPPER_COUNT; field++)
+    SetConfigValue(stepper, field, values[field]);
+  stepper->currentSPS              = stepper->minSPS;
+  stepper->stepCtrlPrescallerTicks = stepper->stepCtrlPrescaller;
+  SetStepTimerByCurrentSPS(stepper);
+}
+
+bool IsConfigRecordChanged(int32_t i, uint8_t profile, config_field field) {
+  return !(storedFields[i] & (1 << (profile * __CF_STEPPER_COUNT + field))) || 
+         storedConfig[i][profile][field] != profileConfig[i][profile][field];
+}
+
+// Must be invoked with FLASH unlocked
+void ProgramProfileRecord(int32_t i, uint8_t profile, config_field field) {
+  storedConfig[i][profile][field] = profileConfig[i][profile][field];
+  storedFields[i] |= 1 << (profile * __CF_STEPPER_COUNT + field);
+  ProgramConfigRecord(CONFIG_RECORD_KEY(profile, field, steppers[i].name), storedConfig[i][profile][field]);
+}
+
+// Erases the sector and writes the current values of everything
+void CompactConfigLog(void) {
+  int32_t i;
+  uint8_t profile;
+  config_field field;
+  
+  HAL_FLASH_Unlock();
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGSERR );
+  FLASH_Erase_Sector(FLASH_SECTOR_3, VOLTAGE_RANGE_3);
+  
+  HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, ADDR_FLASH_SECTOR_3, CONFIG_LOG_MAGIC); 
+  configLogEnd = configLogBegin;
+  
+  for (i=0; i < initializedSteppersCount; i++)  {
+    storedFields[i] = 0;
+    for (profile = 0; profile < CONFIG_PROFILES_COUNT; profile++) {
+      if (!(profileValid[i] & (1 << profile)))
+        continue;
+      for (field = CF_MINSPS; field < __CF_STEPPER_COUNT; field++)
+        ProgramProfileRecord(i, profile, field);
+    }
+  }
+  storedHubAddress = hubAddress;
+  ProgramConfigRecord(CONFIG_RECORD_KEY(0, CF_HUBADDRESS, 0), storedHubAddress);
+  
+  HAL_FLASH_Lock();
+}
+
+void LoadLegacyConfig(void) {
   int32_t * configPtr = (int32_t *)ADDR_FLASH_SECTOR_3;
   int32_t i = 0;
   for (i=0; i < initializedSteppersCount; i++) {
-    steppers[i].currentSPS              =
     steppers[i].minSPS                  = *configPtr++;
     steppers[i].maxSPS                  = *configPtr++;
     steppers[i].accelerationSPS         = *configPtr++;
-    steppers[i].stepCtrlPrescaller      = 
-    steppers[i].stepCtrlPrescallerTicks = *configPtr++;
-    SetStepTimerByCurrentSPS(&steppers[i]);
+    steppers[i].stepCtrlPrescaller      = *configPtr++;
+  }
+  // erased FLASH (0xFFFFFFFF) means that the address has never been assigned
+  i = *(int32_t *)LEGACY_HUB_ADDRESS_ADDR;
+  hubAddress = (i < 0 || i > 0xFF) ? 0 : i;
+}
+
+// Read from FLASH
+bool Stepper_LoadConfig(void) {
+  uint32_t magic = *(uint32_t *)ADDR_FLASH_SECTOR_3;
+  // config fields found for every stepper, bit (profile * __CF_STEPPER_COUNT + field)
+  uint32_t loadedFields[MAX_STEPPERS_COUNT] = { 0 };
+  config_record * record;
+  stepper_state * stepper;
+  config_field field;
+  uint32_t key;
+  uint8_t profile;
+  bool loaded = true;
+  int32_t i;
+  
+  configLogEnd = NULL;
+  activeProfile = 0;
+  memset(profileValid, 0, sizeof(profileValid));
+  memset(storedFields, 0, sizeof(storedFields));
+  
+  if (magic == 0xFFFFFFFF) {
+    // clean storage, the log is created on the first save
+    return false;
   }
+  
+  if (magic != CONFIG_LOG_MAGIC && magic != CONFIG_LOG_MAGIC_V1) {
+    // the raw layout - take it as is into profile 0
+    LoadLegacyConfig();
+    StoreActiveProfile();
+    for (i=0; i < initializedSteppersCount; i++)
+      ApplyProfile(&steppers[i], 0);
+  } else {
+    for (record = configLogBegin; record < configLogLimit && !IsErased(record); record++) {
+      key = record->key;
+      if (magic == CONFIG_LOG_MAGIC_V1) {
+        if ((key & CONFIG_RECORD_MARK_MASK) != CONFIG_RECORD_MARK_V1)
+          continue;   // torn by reset
+        key &= ~CONFIG_RECORD_MARK_MASK;
+      } else {
+        if ((key >> 24) != ConfigRecordCrc(key, record->value))
+          continue;   // torn by reset, or damaged
+      }
+      
+      profile = CONFIG_RECORD_PROFILE(key);
+      field = (config_field)CONFIG_RECORD_FIELD(key);
+      if (field == CF_HUBADDRESS) {
+        hubAddress = storedHubAddress = (uint8_t)record->value;
+        continue;
+      }
+      
+      stepper = GetState(CONFIG_RECORD_NAME(key));
+      if (stepper == NULL || field >= __CF_STEPPER_COUNT || profile >= CONFIG_PROFILES_COUNT)
+        continue;   // the stepper is not set up anymore
+      
+      i = stepper - steppers;
+      profileConfig[i][profile][field] = storedConfig[i][profile][field] = record->value;
+      loadedFields[i] |= 1 << (profile * __CF_STEPPER_COUNT + field);
+    }
+    configLogEnd = (record < configLogLimit) ? record : NULL;
+    
+    for (i=0; i < initializedSteppersCount; i++) {
+      storedFields[i] = loadedFields[i];
+      // partially stored profile (damaged records) is dropped, it is recreated from the active one when used
+      for (profile = 0; profile < CONFIG_PROFILES_COUNT; profile++) {
+        if (((loadedFields[i] >> (profile * __CF_STEPPER_COUNT)) & CONFIG_PROFILE_FIELDS) == CONFIG_PROFILE_FIELDS)
+          profileValid[i] |= 1 << profile;
+      }
+      if (!(profileValid[i] & 1)) {
+        loaded = false;
+        continue;
+      }
+      ApplyProfile(&steppers[i], 0);
+    }
+  }
+  
+  if (magic != CONFIG_LOG_MAGIC) {
+    // older format - convert to the current one right away (or on the first save, if defaults are needed)
+    configLogEnd = NULL;
+    if (loaded)
+      CompactConfigLog();
+  }
+  
+  return loaded;
 }
 
 // Write to FLASH
 void Stepper_SaveConfig(void) {
-  uint32_t configAddr = ADDR_FLASH_SECTOR_3;
-  int32_t i = 0;
+  int32_t i;
+  int32_t changes = 0;
+  uint8_t profile;
+  config_field field;
+  
+  // cleared before the values are read, so a change made meanwhile gets scheduled again
+  configSavePending = false;
+  configSaveImmediately = false;
+  
+  StoreActiveProfile();
+  
+  for (i=0; i < initializedSteppersCount; i++)  {
+    for (profile = 0; profile < CONFIG_PROFILES_COUNT; profile++) {
+      if (!(profileValid[i] & (1 << profile)))
+        continue;
+      for (field = CF_MINSPS; field < __CF_STEPPER_COUNT; field++)
+        changes += IsConfigRecordChanged(i, profile, field);
+    }
+  }
+  changes += (storedHubAddress != hubAddress);
+  
+  if (configLogEnd == NULL || configLogEnd + changes > configLogLimit) {
+    CompactConfigLog();
+    return;
+  }
+  
+  if (changes == 0)
+    return;
   
   HAL_FLASH_Unlock();
   __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_EOP | FLASH_FLAG_OPERR | FLASH_FLAG_WRPERR | FLASH_FLAG_PGAERR | FLASH_FLAG_PGSERR );
-  FLASH_Erase_Sector(FLASH_SECTOR_3, VOLTAGE_RANGE_3);
-    
+  
   for (i=0; i < initializedSteppersCount; i++)  {
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, configAddr, steppers[i].minSPS); 
-    configAddr+=4;
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, configAddr, steppers[i].maxSPS); 
-    configAddr+=4;
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, configAddr, steppers[i].accelerationSPS); 
-    configAddr+=4;
-    HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, configAddr, steppers[i].stepCtrlPrescaller); 
-    configAddr+=4;
+    for (profile = 0; profile < CONFIG_PROFILES_COUNT; profile++) {
+      if (!(profileValid[i] & (1 << profile)))
+        continue;
+      for (field = CF_MINSPS; field < __CF_STEPPER_COUNT; field++) {
+        if (IsConfigRecordChanged(i, profile, field))
+          ProgramProfileRecord(i, profile, field);
+      }
+    }
+  }
+  if (storedHubAddress != hubAddress) {
+    storedHubAddress = hubAddress;
+    ProgramConfigRecord(CONFIG_RECORD_KEY(0, CF_HUBADDRESS, 0), storedHubAddress);
   }
   
   HAL_FLASH_Lock();
 }
+
+stepper_error Stepper_SelectProfile(int32_t profile) {
+  int32_t i;
+  
+  if (profile < 0 || profile >= CONFIG_PROFILES_COUNT)
+    return SERR_LIMIT;
+  for (i=0; i < initializedSteppersCount; i++) {
+    if (!(steppers[i].status & SS_STOPPED))
+      return SERR_MUSTBESTOPPED;
+  }
+  if (profile == activeProfile)
+    return SERR_OK;
+  
+  StoreActiveProfile();
+  for (i=0; i < initializedSteppersCount; i++) {
+    // never set - starts as a copy of the current profile
+    if (!(profileValid[i] & (1 << profile))) {
+      memcpy(profileConfig[i][profile], profileConfig[i][activeProfile], sizeof(profileConfig[i][profile]));
+      profileValid[i] |= 1 << profile;
+    }
+    ApplyProfile(&steppers[i], profile);
+  }
+  activeProfile = profile;
+  return SERR_OK;
+}
+
+uint8_t Stepper_GetProfile(void) {
+  return activeProfile;
+}
+
+bool Stepper_GetProfileParams(char stepperName, int32_t profile, int32_t * minSPS, int32_t * maxSPS, int32_t * accSPS, int32_t * accPrescaler) {
+  stepper_state * stepper = GetState(stepperName);
+  int32_t * values;
+  
+  if (stepper == NULL || profile < 0 || profile >= CONFIG_PROFILES_COUNT)
+    return false;
+  if (profile == activeProfile) {
+    *minSPS       = GetConfigValue(stepper, CF_MINSPS);
+    *maxSPS       = GetConfigValue(stepper, CF_MAXSPS);
+    *accSPS       = GetConfigValue(stepper, CF_ACCSPS);
+    *accPrescaler = GetConfigValue(stepper, CF_ACCPRESCALER);
+    return true;
+  }
+  if (!(profileValid[stepper - steppers] & (1 << profile)))
+    return false;
+  values = profileConfig[stepper - steppers][profile];
+  *minSPS       = values[CF_MINSPS];
+  *maxSPS       = values[CF_MAXSPS];
+  *accSPS       = values[CF_ACCSPS];
+  *accPrescaler = values[CF_ACCPRESCALER];
+  return true;
+}
+
+void Stepper_ScheduleConfigSave(bool immediately) {
+  configChangeTick = HAL_GetTick();
+  if (immediately)
+    configSaveImmediately = true;
+  configSavePending = true;
+}
+
+bool AllSteppersStopped(void) {
+  int32_t i;
+  for (i=0; i < initializedSteppersCount; i++) {
+    if (!(steppers[i].status & SS_STOPPED))
+      return false;
+  }
+  return true;
+}
+
+bool Stepper_SavePendingConfig(void) {
+  if (!configSavePending)
+    return false;
+  if (!configSaveImmediately && (HAL_GetTick() - configChangeTick) < configSaveDelayMs)
+    return false;
+  if (!AllSteppersStopped())
+    return false;
+  Stepper_SaveConfig();
+  return true;
+}
+
+stepper_error Stepper_SetConfigSaveDelay(int32_t delayMs) {
+  if (delayMs < 0) {
+    configSaveDelayMs = 0;
+    return SERR_LIMIT;
+  }
+  if (delayMs > CONFIG_SAVE_DELAY_MAX_MS) {
+    configSaveDelayMs = CONFIG_SAVE_DELAY_MAX_MS;
+    return SERR_LIMIT;
+  }
+  configSaveDelayMs = delayMs;
+  return SERR_OK;
+}
+
+uint32_t Stepper_GetConfigSaveDelay(void) {
+  return configSaveDelayMs;
+}
+
+uint8_t Stepper_GetHubAddress(void) {
+  return hubAddress;
+}
+
+void Stepper_SetHubAddress(uint8_t address) {
+  if (address == hubAddress)
+    return;
+  hubAddress = address;
+  Stepper_ScheduleConfigSave(false);
+}
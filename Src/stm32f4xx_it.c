@@ -37,6 +37,8 @@
 
 /* USER CODE BEGIN 0 */
 #include "stepperController.h"
+#include "serial.h"
+#include "isrProfiler.h"
 
 extern stepper_state stepperX;
 extern stepper_state stepperY;
@@ -175,10 +177,12 @@ void SysTick_Handler(void)
 void DMA1_Stream5_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream5_IRQn 0 */
+  ISR_PROFILE_BEGIN(ISR_LATENCY_UNKNOWN);
 
   /* USER CODE END DMA1_Stream5_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_usart2_rx);
   /* USER CODE BEGIN DMA1_Stream5_IRQn 1 */
+  ISR_PROFILE_END(ISR_DMA_RX);
 
   /* USER CODE END DMA1_Stream5_IRQn 1 */
 }
@@ -189,10 +193,12 @@ void DMA1_Stream5_IRQHandler(void)
 void DMA1_Stream6_IRQHandler(void)
 {
   /* USER CODE BEGIN DMA1_Stream6_IRQn 0 */
+  ISR_PROFILE_BEGIN(ISR_LATENCY_UNKNOWN);
 
   /* USER CODE END DMA1_Stream6_IRQn 0 */
   HAL_DMA_IRQHandler(&hdma_usart2_tx);
   /* USER CODE BEGIN DMA1_Stream6_IRQn 1 */
+  ISR_PROFILE_END(ISR_DMA_TX);
 
   /* USER CODE END DMA1_Stream6_IRQn 1 */
 }
@@ -203,10 +209,17 @@ void DMA1_Stream6_IRQHandler(void)
 void USART2_IRQHandler(void)
 {
   /* USER CODE BEGIN USART2_IRQn 0 */
+  ISR_PROFILE_BEGIN(ISR_LATENCY_UNKNOWN);
+  if (__HAL_UART_GET_FLAG(&huart2, UART_FLAG_IDLE) && __HAL_UART_GET_IT_SOURCE(&huart2, UART_IT_IDLE))
+  {
+    __HAL_UART_CLEAR_IDLEFLAG(&huart2);
+    Serial_RxIdleCallback();
+  }
 
   /* USER CODE END USART2_IRQn 0 */
   HAL_UART_IRQHandler(&huart2);
   /* USER CODE BEGIN USART2_IRQn 1 */
+  ISR_PROFILE_END(ISR_USART2);
 
   /* USER CODE END USART2_IRQn 1 */
 }
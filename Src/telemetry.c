@@ -0,0 +1,171 @@
+#include <string.h>
+#include "stm32f4xx_hal.h"
+#include "stepperController.h"
+#include "telemetry.h"
+#include "serial.h"
+
+typedef struct {
+  char              stepper;
+  telemetry_fields  fields;
+} telemetry_subscription;
+
+static telemetry_subscription subscriptions[MAX_STEPPERS_COUNT];
+static volatile int32_t subscriptionsCount;
+
+// 0 - nothing is subscribed, the period set is kept in periodMs
+static volatile uint32_t periodTicks;
+static uint32_t periodMs = TELEMETRY_DEFAULT_PERIOD_MS;
+static volatile uint32_t ticksLeft;
+static volatile uint32_t droppedFrames;
+
+// Snapshot frame is written by controller timer, and read by main loop, only one side owns it at a time
+static uint8_t frame[TELEMETRY_MAX_FRAME_SIZE];
+static volatile uint32_t frameLength;
+static volatile bool frameReady;
+
+uint8_t * PutInt32(uint8_t * out, int32_t value) {
+  *out++ = (uint8_t)(value);
+  *out++ = (uint8_t)(value >> 8);
+  *out++ = (uint8_t)(value >> 16);
+  *out++ = (uint8_t)(value >> 24);
+  return out;
+}
+
+// Starts the frames at the period set, or stops them if there are no fields subscribed
+void UpdatePeriod(bool restart) {
+  uint32_t ticks = (periodMs * 1000u) / STEP_CONTROLLER_PERIOD_US;
+  int32_t i;
+  
+  for (i = 0; i < subscriptionsCount; i++) {
+    if (subscriptions[i].fields != TF_NONE)
+      break;
+  }
+  if (i == subscriptionsCount) {
+    periodTicks = 0;
+    return;
+  }
+  
+  if (ticks == 0) ticks = 1;
+  if (restart || periodTicks != ticks) {
+    // the controller timer looks at periodTicks first
+    ticksLeft = ticks;
+    periodTicks = ticks;
+  }
+}
+
+telemetry_fields Telemetry_Subscribe(char stepper, telemetry_fields fields, bool subscribe) {
+  int32_t i = 0;
+  
+  while (i < subscriptionsCount && subscriptions[i].stepper != stepper)
+    i++;
+  
+  if (i == subscriptionsCount) {
+    if (!subscribe)
+      return TF_NONE;
+    if (subscriptionsCount == MAX_STEPPERS_COUNT)
+      return TF_NONE;
+    // fill the record before it becomes visible to the controller timer
+    subscriptions[i].stepper = stepper;
+    subscriptions[i].fields  = TF_NONE;
+    subscriptionsCount++;
+  }
+  
+  // records are never removed, the ones with no fields are just skipped
+  subscriptions[i].fields = (telemetry_fields)(subscribe ? 
+                              (subscriptions[i].fields | fields) : 
+                              (subscriptions[i].fields & ~fields));
+  UpdatePeriod(false);
+  return subscriptions[i].fields;
+}
+
+uint32_t Telemetry_SetPeriod(uint32_t period) {
+  periodMs = (period < TELEMETRY_MIN_PERIOD_MS) ? TELEMETRY_MIN_PERIOD_MS : period;
+  UpdatePeriod(true);
+  return Telemetry_GetPeriod();
+}
+
+uint32_t Telemetry_GetPeriod(void) {
+  uint32_t ticks = (periodMs * 1000u) / STEP_CONTROLLER_PERIOD_US;
+  return ((ticks == 0) ? 1 : ticks) * STEP_CONTROLLER_PERIOD_US / 1000u;
+}
+
+uint32_t Telemetry_GetDroppedFrames(void) {
+  return droppedFrames;
+}
+
+bool Telemetry_GetSubscription(int32_t index, char * stepper, telemetry_fields * fields) {
+  if (index < 0 || index >= subscriptionsCount)
+    return false;
+  *stepper = subscriptions[index].stepper;
+  *fields  = subscriptions[index].fields;
+  return true;
+}
+
+void TakeSnapshot(void) {
+  uint8_t * out = frame + 2;
+  uint8_t checksum = 0;
+  int32_t count = subscriptionsCount;
+  int32_t i;
+  
+  out = PutInt32(out, Stepper_GetControllerTick());
+  *out++ = (uint8_t)(droppedFrames);
+  *out++ = (uint8_t)(droppedFrames >> 8);
+  
+  for (i = 0; i < count; i++) {
+    char stepper = subscriptions[i].stepper;
+    telemetry_fields fields = subscriptions[i].fields;
+    if (fields == TF_NONE)
+      continue;
+    *out++ = stepper;
+    *out++ = fields;
+    if (fields & TF_POSITION)  out = PutInt32(out, Stepper_GetCurrentPosition(stepper));
+    if (fields & TF_SPS)       out = PutInt32(out, Stepper_GetCurrentSPS(stepper));
+    if (fields & TF_STATUS)    *out++ = Stepper_GetStatus(stepper);
+  }
+  
+  frame[0] = TELEMETRY_FRAME_SYNC;
+  frame[1] = (uint8_t)(out - frame - 2);
+  
+  for (i = 0; i < out - frame; i++)
+    checksum += frame[i];
+  *out++ = checksum;
+  
+  frameLength = out - frame;
+  frameReady = true;
+}
+
+void Telemetry_ControllerTick(void) {
+  if (periodTicks == 0 || --ticksLeft)
+    return;
+  ticksLeft = periodTicks;
+  
+  // no unsolicited transmits on RS-485 bus (subscribing is rejected there, but the hub might have been addressed later)
+  if (Stepper_GetHubAddress() != 0)
+    return;
+  
+  if (frameReady) {
+    // main loop hasn't picked up the previous one yet
+    droppedFrames++;
+    return;
+  }
+  
+  TakeSnapshot();
+}
+
+bool Telemetry_SendPendingFrame(void) {
+  uint8_t * dst;
+  
+  if (!frameReady)
+    return false;
+  
+  dst = Serial_TxBulkReserve(frameLength);
+  if (dst != NULL) {
+    memcpy(dst, frame, frameLength);
+    Serial_TxBulkCommit(frameLength);
+  } else {
+    droppedFrames++;
+  }
+  
+  frameReady = false;
+  return true;
+}